@@ -6,8 +6,68 @@
 int block_register_disk(const char *name, uintptr_t abar, int port);
 int block_register_partition(const char *disk_name, int idx, uint64_t start, uint64_t count);
 
-/* Read sectors from a block device by name (count in sectors) */
-int block_read(const char *name, uint64_t lba, uint16_t count, void *out_buf, size_t out_len);
+/* Handle for a registered device, looked up once (e.g. at mount) and then
+ * passed to every call. Devices are never unregistered, so a handle stays
+ * valid. NULL if there is no such device. */
+struct block_dev;
+struct block_dev *block_open(const char *name);
+
+/* One piece of a request's memory; `len` is a nonzero multiple of 512 */
+struct block_seg {
+    void *buf;
+    size_t len;
+};
+
+struct bio;
+typedef void (*bio_done_t)(struct bio *bio);
+
+#define BIO_WRITE 0x1   /* write the segments instead of reading into them */
+#define BIO_FUA   0x2   /* the write is on media when the bio completes */
+#define BIO_FLUSH 0x4   /* then flush the write cache; count 0 = just flush */
+
+/* An asynchronous request: `count` sectors at `lba` (relative to the
+ * device, partitions included) to or from `segs` in order. Requests queue
+ * per disk and are cut into command-sized pieces as the port's slots free
+ * up, so there is no limit on `count` beyond the device size. */
+struct bio {
+    struct block_dev *dev;
+    uint64_t lba;
+    uint64_t count;
+    struct block_seg *segs;
+    uint32_t nsegs;
+    uint32_t flags;       /* BIO_* */
+    bio_done_t done;      /* may run in interrupt context; NULL to wait
+                           * for `completed` instead */
+    void *priv;
+    int status;           /* 0, or -1 once any part failed */
+    volatile int completed;
+
+    /* Owned by the block layer while in flight */
+    struct bio *next;
+    uint64_t disk_lba;
+    uint64_t issued;
+    uint32_t seg;
+    size_t seg_off;
+    uint32_t pending;
+};
+
+/* Queue `bio` on its disk and start it if the disk has room; never waits
+ * for the device. Returns 0 once queued, after which `done` runs exactly
+ * once, or without a callback `completed` is set; -1 if the request is
+ * malformed, with no callback. */
+int block_submit(struct bio *bio);
+
+/* Sleep until a bio submitted without a `done` callback completes.
+ * Returns its status. */
+int block_wait(struct bio *bio);
+
+/* Synchronous helpers built on block_submit (count in sectors). block_write
+ * takes BIO_FUA in `flags`. */
+int block_read(struct block_dev *dev, uint64_t lba, uint64_t count, void *out_buf, size_t out_len);
+int block_write(struct block_dev *dev, uint64_t lba, uint64_t count, const void *buf, size_t len, uint32_t flags);
+
+/* Flush the write cache of the disk behind a block device */
+int block_flush(struct block_dev *dev);
 
 /* Find partition LBA start by name, return 0 on success and writes start/count */
 int block_get_partition(const char *name, uint64_t *out_start, uint64_t *out_count);
@@ -57,6 +57,14 @@ uint8_t  pci_read_config_byte(uint8_t bus, uint8_t device, uint8_t function, uin
 void     pci_write_config_word(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint16_t value);
 void     pci_write_config_byte(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint8_t value);
 
+/* Config-space offset of capability `id` (PCI_CAP_*), 0 if absent */
+#define PCI_CAP_MSI 0x05
+int pci_find_capability(struct pci_device* dev, uint8_t id);
+
+/* Route the device's interrupt as a single MSI `vector` to the local APIC
+ * `apic_id` and turn INTx off. Returns -1 if the device has no MSI. */
+int pci_enable_msi(struct pci_device* dev, uint8_t vector, uint32_t apic_id);
+
 /* higher-level helpers */
 uint16_t pci_read_vendor(uint8_t bus, uint8_t device, uint8_t function);
 uint16_t pci_read_device(uint8_t bus, uint8_t device, uint8_t function);
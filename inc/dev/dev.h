@@ -1,5 +1,6 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 
 #define DEV_TYPE_BLOCK 1
 #define DEV_TYPE_CHAR  2
@@ -7,6 +8,7 @@
 
 struct dev_entry {
     char *name; /* e.g. "/dev/sda1" */
+    uint32_t hash; /* strhash(name), checked before the name */
     int type;
     void *data; /* optional pointer to device-specific data */
     size_t size; /* optional size (for initrd etc) */
@@ -14,8 +14,75 @@ struct ahci_port_info {
     void *abar_virt;
 };
 
-/* Read sectors from a device on AHCI port. Supports up to 8 sectors (4096 bytes)
- * per call using the per-port page buffer. `count` is sector count. `out_len`
- * must be >= count*512. Returns 0 on success, -1 on error. */
+struct ahci_request;
+typedef void (*ahci_done_t)(struct ahci_request *rq);
+
+#define AHCI_REQ_WRITE 0x1   /* write `buf` to the disk instead of reading */
+#define AHCI_REQ_FUA   0x2   /* the write is on media when done */
+#define AHCI_REQ_FLUSH 0x4   /* then flush the drive's write cache; with
+                              * count 0 the request is just the flush */
+
+/* An asynchronous transfer of `count` sectors at `lba` to or from `buf`. The
+ * driver issues it as one or more commands (NCQ-tagged when the drive
+ * supports it), depending on the buffer's physical layout and free slots,
+ * and runs `done` once the last of them has finished. A flush waits for
+ * everything issued before it. */
+struct ahci_request {
+    uint64_t lba;
+    uint32_t count;
+    void *buf;
+    uint32_t flags;       /* AHCI_REQ_* */
+    ahci_done_t done;     /* may be NULL: wait for `pending` to drop to 0.
+                           * Runs in the interrupt handler when the
+                           * controller has one, so it must not block. */
+    void *priv;           /* for the submitter */
+    int status;           /* 0 or -1, valid once done */
+
+    /* Driver state */
+    volatile uint32_t pending;   /* commands in flight, +1 while submitting */
+    uint32_t submitted;          /* sectors handed to commands so far */
+    uint8_t flushed;             /* the closing flush is issued */
+};
+
+/* Start `rq` on the port. Returns once every piece is issued, waiting for
+ * slots to free up if the queue is full; `done` may already have run by
+ * then. Returns 0, or -1 if the port is not usable. */
+int ahci_submit(uintptr_t abar, int port, struct ahci_request *rq);
+
+/* The same without waiting, safe from a completion callback: issue what
+ * the port has room for and return 0 once all of `rq` is out, 1 if some of
+ * it is left, -1 if the request or port is not usable. Whatever is left
+ * goes out with ahci_resume, e.g. after the next completion on the port. */
+int ahci_try_submit(uintptr_t abar, int port, struct ahci_request *rq);
+int ahci_resume(uintptr_t abar, int port, struct ahci_request *rq);
+
+/* Commands the port can have in flight at once (1 without NCQ) */
+int ahci_queue_depth(uintptr_t abar, int port);
+
+/* Retire finished commands on the port and run the callbacks of requests
+ * that completed; the interrupt handler does the same on its own. Returns
+ * the number of commands still in flight, -1 for an unknown port. */
+int ahci_poll(uintptr_t abar, int port);
+
+/* Commands the port has retired so far, and a wait for that count to move
+ * past `seen` (sleeping on the interrupt where there is one). Lets callers
+ * with their own completion state wait without spinning. */
+uint32_t ahci_retired(uintptr_t abar, int port);
+void ahci_wait_retired(uintptr_t abar, int port, uint32_t seen);
+
+/* Read `count` sectors from a device on AHCI port, sleeping until the
+ * completion interrupt. The HBA DMAs straight into
+ * `out_buf` through a scatter-gather list built from its page mappings; only
+ * buffers at odd addresses, unmapped ones or ones the HBA cannot reach go
+ * through the per-port bounce buffer. `out_len` must be >= count*512.
+ * Returns 0 on success, -1 on error. */
 int ahci_read(uintptr_t abar, int port, uint64_t lba, uint16_t count, void* out_buf, size_t out_len);
 
+/* Write `count` sectors from `buf` the same way. With `fua` the data is on
+ * media when this returns: FUA where the drive has it, a cache flush
+ * after the write where it does not. */
+int ahci_write(uintptr_t abar, int port, uint64_t lba, uint16_t count, const void* buf, size_t len, int fua);
+
+/* Flush the drive's write cache: everything written before is on media */
+int ahci_flush(uintptr_t abar, int port);
+
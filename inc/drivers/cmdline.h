@@ -4,3 +4,7 @@
  * Returns an allocated string (caller must free via kfree) or NULL.
  */
 char *cmdline_get(const char *key);
+
+/* Same, with the string allocated from arena `a` (NULL if `a` is NULL) */
+struct arena;
+char *cmdline_get_arena(struct arena *a, const char *key);
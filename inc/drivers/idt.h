@@ -27,6 +27,7 @@ typedef struct {
 void interrupts_init(void);
 void interrupts_reload(void);
 void interrupts_set_handler(uint8_t vector, void *handler);
+uint8_t interrupts_alloc_vec(void);
 void interrupts_handle_int(context_t *ctx);
 void interrupts_eoi(void);
 void apic_eoi(void);
\ No newline at end of file
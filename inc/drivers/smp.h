@@ -6,3 +6,16 @@ void ap_entry(void);
 
 /* SMP startup and management */
 extern volatile uint32_t smp_started_count;
+
+
+/* Build the LAPIC ID -> CPU index map; call once the LAPIC is enabled */
+void smp_index_init(void);
+
+/* Index of the executing CPU in TitanBootInfo.smp_cpus (0 until smp_index_init).
+ * Read from IA32_TSC_AUX with RDPID/RDTSCP once this CPU ran
+ * smp_cpu_local_init(), from the LAPIC ID otherwise. */
+uint32_t smp_cpu_index(void);
+
+/* Store this CPU's index in IA32_TSC_AUX (APs, once their LAPIC is up; the
+ * BSP is covered by smp_index_init) */
+void smp_cpu_local_init(void);
@@ -16,6 +16,11 @@ struct vfs_fh {
     void *ctx;
 };
 
+/* Allocate a handle for a filesystem's open(); vfs_close frees it */
+struct vfs_fh *vfs_fh_alloc(void);
+/* Free a handle that open() is giving up on, before it reaches the caller */
+void vfs_fh_free(struct vfs_fh *h);
+
 struct vfs_mount {
     const char *mount_point; /* prefix, e.g. "/" or "/boot" */
     void *fs_data;
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+/* In-kernel microbenchmarks: build with -DENABLE_BENCH to run them at the end
+ * of kernel_main. Results are printed in TSC cycles. */
+static inline uint64_t bench_rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void bench_run(void);
+
+/* Per-subsystem benchmarks (defined next to the code they measure) */
+void pmm_bench(void);
+void vmm_bench(void);
+void string_bench(void);
+void ahci_bench(void);
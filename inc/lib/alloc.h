@@ -4,3 +4,28 @@
 /* Kernel allocator: small objects via slab, large allocations are page-backed. */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+
+/* Zeroed array of n elements (NULL if n * size overflows). Large ones are
+ * built from the PMM's pre-zeroed frames rather than cleared here. */
+void *kcalloc(size_t n, size_t size);
+
+/* Resize, keeping the contents. Stays put while `size` fits the object's size
+ * class or page run, and a large allocation grows into free VA after it
+ * before anything is copied. NULL ptr = kmalloc, size 0 = kfree. */
+void *krealloc(void *ptr, size_t size);
+
+/* Allocation starting at a multiple of `align` (a power of two). Memory is
+ * physically contiguous only within a page: multi-page DMA buffers still
+ * come from pmm_alloc_contig. Free with kfree. */
+void *kmalloc_aligned(size_t size, size_t align);
+
+/* Usable size of a kmalloc allocation (at least what was asked for) */
+size_t ksize(const void *ptr);
+
+/* Print slab cache counters and the large-allocation counters */
+void kmalloc_print_stats(void);
+
+/* With -DENABLE_KMALLOC_TRACE every live kmalloc allocation is tagged with
+ * its caller's address; this prints the totals per call site, largest first.
+ * Resolve the addresses against the kernel image (see disasm.sh). */
+void kmalloc_dump_live(void);
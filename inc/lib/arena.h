@@ -0,0 +1,42 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bump-pointer arena for temporaries that all die together: a boot phase, a
+ * mount, one request. Objects are carved from page runs and never freed one
+ * by one; arena_reset/arena_destroy release everything at once. An arena has
+ * a single owner and no lock. */
+#define ARENA_ALIGN 16                  /* alignment of arena_alloc */
+#define ARENA_CHUNK_DEFAULT (16 * 1024)
+
+struct arena;
+
+/* Position to roll back to with arena_restore */
+struct arena_mark {
+    void *chunk;
+    uint8_t *cur;
+};
+
+/* New arena taking `chunk_size` bytes (0 = ARENA_CHUNK_DEFAULT) from the PMM
+ * at a time; the arena itself lives in its first chunk. NULL on failure. */
+struct arena *arena_create(size_t chunk_size);
+
+/* `size` bytes aligned to ARENA_ALIGN / to `align` (a power of two). Larger
+ * requests than a chunk get a run of their own, up to 2^PMM_MAX_ORDER pages.
+ * NULL when out of memory or `a` is NULL. */
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_alloc_aligned(struct arena *a, size_t size, size_t align);
+
+/* Copy of `s` in the arena */
+char *arena_strdup(struct arena *a, const char *s);
+
+/* Scoped use: everything allocated after arena_save is released by
+ * arena_restore with the same mark */
+struct arena_mark arena_save(struct arena *a);
+void arena_restore(struct arena *a, struct arena_mark m);
+
+/* Release every allocation but keep the first chunk for reuse */
+void arena_reset(struct arena *a);
+
+/* Release the arena and all its memory */
+void arena_destroy(struct arena *a);
@@ -7,10 +7,32 @@ void *memset(void *s, int c, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
 int memcmp(const void *s1, const void *s2, size_t n);
 
+/* Pick the mem* strategies for this CPU (ERMS/FSRM); call once SSE is on.
+ * Until then the SSE2 paths are used throughout. */
+void string_init(void);
+
+/* Zero `n` bytes (a multiple of 64) at 16-byte aligned `p` with non-temporal
+ * stores, leaving the cache alone. Stores are weakly ordered: sfence before
+ * another CPU may look at the memory. */
+void memzero_nt(void *p, size_t n);
+
+/* SSE2; never load across a page boundary past the terminator */
 size_t strlen(const char *s);
 int strncmp(const char *s1, const char *s2, size_t n);
 int strcmp(const char *s1, const char *s2);
 
+/* 32-bit FNV-1a, shared by the name-lookup tables: they keep each name's
+ * hash next to it and compare bytes only when the hashes match.
+ * strhash(s) == memhash(s, strlen(s)), and a hash can be built a byte at a
+ * time from STRHASH_INIT with strhash_step. */
+#define STRHASH_INIT 2166136261u
+static inline uint32_t strhash_step(uint32_t h, uint8_t c)
+{
+    return (h ^ c) * 16777619u;
+}
+uint32_t memhash(const void *p, size_t n);
+uint32_t strhash(const char *s);
+
 /* Allocate a duplicate of a string using kernel allocator */
 char *strdup(const char *s);
 int atoi(const char *s);
\ No newline at end of file
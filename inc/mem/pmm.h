@@ -4,6 +4,10 @@
 
 #define PMM_PAGE_SIZE 4096
 
+/* Buddy allocator: an order-n block is 2^n naturally aligned frames
+ * (order 9 = 2MiB, PMM_MAX_ORDER = 4MiB) */
+#define PMM_MAX_ORDER 10
+
 /* Initialize the PMM using the Multiboot2 memory map address (physical) */
 void pmm_init(uint64_t multiboot_phys_addr);
 
@@ -13,5 +17,41 @@ uint64_t pmm_alloc_frame(void);
 /* Free a single frame previously allocated (phys is page-aligned) */
 void pmm_free_frame(uint64_t phys);
 
-/* Return count of free frames currently available */
+/* Allocate a single frame that is already zero-filled, taken from a pool the
+ * idle loop keeps topped up; falls back to zeroing in place when it is empty.
+ * Free it with pmm_free_frame. */
+uint64_t pmm_alloc_zeroed_frame(void);
+
+/* Idle hook: zero up to one batch of frames into the pool.
+ * Returns the number added, 0 once the pool is full (or memory is short). */
+size_t pmm_zero_pool_refill(void);
+
+/* Allocate 2^order contiguous frames aligned to their size; returns physical address or 0 */
+uint64_t pmm_alloc_pages(unsigned order);
+
+/* Free a block from pmm_alloc_pages (frames of it may also be freed one by one) */
+void pmm_free_pages(uint64_t phys, unsigned order);
+
+/* Allocate `npages` physically contiguous frames for DMA. `align` is a power-of-two
+ * byte alignment (0 = page), `max_phys` an exclusive limit for the end of the
+ * range (e.g. 0x100000000 for 32-bit devices, 0 = no limit). Returns phys or 0. */
+uint64_t pmm_alloc_contig(size_t npages, uint64_t align, uint64_t max_phys);
+
+/* Free a range returned by pmm_alloc_contig */
+void pmm_free_contig(uint64_t phys, size_t npages);
+
+/* Register `fn` to be called when an allocation would fail: it returns frames
+ * its owner holds but does not need, and the number it freed. It runs under
+ * whatever locks the failing caller holds, so it must not block on its own. */
+void pmm_register_reclaim(size_t (*fn)(void));
+
+/* Number of frames up to the highest usable physical address: an array
+ * indexed by PFN needs this many entries */
+size_t pmm_frame_count(void);
+
+/* Return count of free frames currently available (including per-CPU caches
+ * and the zeroed pool) */
 size_t pmm_free_count(void);
+
+/* Print per-CPU frame cache and zeroed pool counters (hits, misses, drains) */
+void pmm_print_stats(void);
@@ -2,16 +2,65 @@
 #include <stddef.h>
 #include <stdint.h>
 
-/* Simple slab allocator for small objects (power-of-two size classes)
- * Supported sizes: 16,32,64,128,256,512,1024,2048
+/* Slab allocator. kmalloc's small sizes are served by power-of-two caches
+ * (16,32,64,...,2048 bytes); hot structures get exact-size named caches.
  */
+#define SLAB_MAX_SIZE 2048   /* largest size class */
+
 void slab_init(void);
 void *slab_alloc(size_t size);
-void slab_free(void *ptr);
+void slab_free(void *ptr);   /* any slab object, whichever cache it is from */
+size_t slab_size(const void *ptr);   /* object size of its cache, 0 if not slab */
+
+/* Named object caches */
+#define KMEM_NAME_MAX 24
+#define KMEM_CACHE_LINE 64
+
+struct kmem_cache;
+
+/* Cache of `size`-byte objects aligned to `align` (a power of two, 0 = pointer
+ * size; KMEM_CACHE_LINE keeps objects from sharing lines). `ctor`, if given,
+ * runs once per object when its page is created, not on every allocation:
+ * objects should be freed back in their constructed state. NULL on error. */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     void (*ctor)(void *obj));
+
+/* Release an unused cache; objects still allocated from it are leaked */
+void kmem_cache_destroy(struct kmem_cache *c);
+
+void *kmem_cache_alloc(struct kmem_cache *c);
+void kmem_cache_free(struct kmem_cache *c, void *obj);
+
+/* Return cached objects' memory to the PMM: depot magazines are drained and
+ * retained empty slabs freed. Registered with the PMM by slab_init; returns
+ * the number of frames freed. */
+size_t slab_reclaim(void);
+
+/* Counters of one cache. Allocations count once they succeed; a magazine
+ * hit is an alloc or free served without going to the depot or the pages. */
+struct kmem_cache_stats {
+    const char *name;
+    size_t obj_size;
+    size_t stride;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t mag_hits;
+    uint64_t mag_misses;
+    uint32_t pages_full;
+    uint32_t pages_partial;
+    uint32_t pages_empty;
+    uint64_t waste_alloc;   /* stride minus requested size, over all allocs */
+    uint64_t waste_page;    /* page tails no object fits in, over pages held */
+};
+
+void kmem_cache_get_stats(struct kmem_cache *c, struct kmem_cache_stats *st);
+
+/* Print the counters of every cache that has been used */
+void slab_print_stats(void);
 
 /* Debug helpers */
 size_t slab_free_objects(size_t size_class);
 
-/* Magazines: configure max CPUs & magazine size for slab */
-#define SLAB_MAX_CPUS 4
-#define SLAB_MAGAZINE_SIZE 16
+/* Per-CPU magazines hold up to SLAB_MAG_MAX objects (fewer for the larger
+ * size classes); a per-cache depot trades whole magazines between CPUs */
+#define SLAB_MAG_MAX 62
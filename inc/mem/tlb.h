@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/* TLB invalidations collected by one page-table update and issued together:
+ * one invlpg per address up to TLB_BATCH addresses, a full flush beyond */
+#define TLB_BATCH 32
+
+struct tlb_batch {
+    uint64_t addrs[TLB_BATCH];
+    uint32_t count;
+    uint8_t all;     /* overflowed: flush everything */
+    uint8_t kernel;  /* touches the shared upper half */
+};
+
+static inline void tlb_batch_init(struct tlb_batch *b)
+{
+    b->count = 0;
+    b->all = 0;
+    b->kernel = 0;
+}
+
+void tlb_batch_add(struct tlb_batch *b, uint64_t virt);
+
+/* Invalidate the batch on this CPU, then shoot it down on every other online
+ * CPU that may hold it: all of them for kernel addresses, otherwise those with
+ * `pml4_phys` loaded. Returns once every target has acknowledged; resets b. */
+void tlb_batch_flush(struct tlb_batch *b, uint64_t pml4_phys);
+
+/* Flush this CPU's whole TLB, global entries included */
+void tlb_flush_local_all(void);
+
+/* Set up the per-CPU shootdown queues and the IPI vector (BSP, after the PMM
+ * and the LAPIC are up); registers the BSP as online */
+void tlb_init(void);
+
+/* Start receiving shootdowns on this CPU (APs, once their IDT is loaded) */
+void tlb_cpu_online(void);
+
+/* Record the address space this CPU just loaded into CR3 */
+void tlb_set_active(uint64_t pml4_phys);
+
+/* Load `pml4_phys` into CR3 on this CPU. With PCIDs each CPU keeps the last
+ * TLB_PCID_SLOTS spaces (told apart by `id`) tagged, and reloads one without
+ * flushing unless `*gen` moved since it was tagged; without PCIDs it is a
+ * plain CR3 write. */
+#define TLB_PCID_SLOTS 8
+void tlb_switch(uint64_t pml4_phys, uint64_t id, volatile uint64_t *gen);
+
+/* Nonzero once this CPU runs with CR4.PCIDE set */
+int tlb_pcid_enabled(void);
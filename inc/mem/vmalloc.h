@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/* Kernel virtual ranges for page-backed allocations. The region lives in the
+ * shared upper half, so every address space sees it. */
+#define VMALLOC_START 0xFFFFA00000000000ULL
+#define VMALLOC_END   0xFFFFA10000000000ULL   /* 1TiB */
+
+/* Leave an unmapped page after the range: running off its end faults */
+#define VMALLOC_GUARD 0x1
+
+/* Set up the region as one free range (after the VMM) */
+void vmalloc_init(void);
+
+/* Reserve `pages` pages of kernel VA aligned to `align` bytes (a power of two,
+ * 0 = page). Nothing is mapped. Free ranges are kept on size-segregated lists
+ * and coalesced with their neighbours on release. Returns the base or 0. */
+uint64_t vmalloc_reserve(size_t pages, uint64_t align, uint32_t flags);
+
+/* Give back a range from vmalloc_reserve; the caller has unmapped it */
+void vmalloc_release(uint64_t addr);
+
+/* Usable pages of the range starting at `addr`, 0 if none starts there */
+size_t vmalloc_pages(uint64_t addr);
+
+/* Reserve a guarded range and back it with frames (2MiB-aligned ranges of
+ * 2MiB or more map as large pages). Returns NULL when out of VA or memory. */
+void *vmalloc(size_t size);
+
+/* vmalloc() with zero-filled memory: frames come from the PMM's zeroed pool */
+void *vzalloc(size_t size);
+
+/* vmalloc() starting at a multiple of `align` (a power of two) */
+void *vmalloc_aligned(size_t size, uint64_t align);
+
+/* Extend the vmalloc() range at `ptr` in place to hold `size` bytes, if the
+ * VA after it is free. Returns 0 when it now holds them (or already did),
+ * -1 if it has to move. */
+int vmalloc_grow(void *ptr, size_t size);
+
+/* Unmap a vmalloc() range, return its frames and its VA */
+void vfree(void *ptr);
@@ -2,20 +2,44 @@
 #include <stdint.h>
 #include <stddef.h>
 
-/* Basic VMM helpers for mapping/unmapping 4KiB pages in the active page tables */
+/* Basic VMM helpers for mapping/unmapping pages in the active page tables */
 #define VMM_PTE_P 0x001
 #define VMM_PTE_W 0x002
 #define VMM_PTE_U 0x004
 #define VMM_PTE_PS  (1ULL << 7)
+#define VMM_PTE_NX  (1ULL << 63)
+#define VMM_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+/* Leaf sizes vmm_map_range picks from */
+#define VMM_PAGE_4K 0x1000ULL
+#define VMM_PAGE_2M 0x200000ULL
+#define VMM_PAGE_1G 0x40000000ULL
+
 /* Initialize VMM (captures current CR3 / PML4 physical address) */
 void vmm_init(void);
 
 /* Map a single 4KiB page (returns 0 on success, -1 on error) */
 int vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags);
 
-/* Unmap a single 4KiB page */
+/* Unmap a single 4KiB page (a large page around it is split first) */
 int vmm_unmap_page(uint64_t virt);
 
+/* Map [virt, virt+len) to [phys, phys+len) using the largest leaves (1GiB,
+ * 2MiB, 4KiB) that the alignment of both addresses and the remaining length
+ * allow. Existing large pages in the way are split. Range operations walk each
+ * table once and flush the TLB once at the end (invlpg per leaf for small
+ * ranges, a full flush for large ones). Returns 0 or -1; on failure the part
+ * already mapped stays mapped. */
+int vmm_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags);
+
+/* Unmap [virt, virt+len), splitting large pages that straddle either end.
+ * Page tables are kept. Returns 0 or -1 if a split could not allocate. */
+int vmm_unmap_range(uint64_t virt, uint64_t len);
+
+/* As vmm_unmap_range, and return the frames that backed the range to the PMM
+ * (2MiB leaves as order-9 blocks) once the TLB has been flushed */
+int vmm_unmap_range_free(uint64_t virt, uint64_t len);
+
 /* Translate virtual -> physical by walking page tables (returns phys or 0) */
 uint64_t vmm_translate(uint64_t virt);
 
@@ -24,3 +48,36 @@ uint64_t vmm_map_alloc_page(uint64_t virt, uint64_t flags);
 
 /* Return current PML4 physical address */
 uint64_t vmm_get_pml4_phys(void);
+
+/* An address space: a PML4 whose upper half (entries 256..511) is shared with
+ * every other space, and a private lower half. `id` is never reused, so the
+ * TLB layer can tell spaces apart when it hands out PCIDs; `tlb_gen` is bumped
+ * on every page-table change so a CPU that cached the space under a PCID knows
+ * when its entries went stale. */
+struct vmm_space {
+    uint64_t pml4_phys;
+    uint64_t id;
+    volatile uint64_t tlb_gen;
+    struct vmm_space *next;
+};
+
+/* The space vmm_init found in CR3 */
+struct vmm_space *vmm_space_kernel(void);
+
+/* The space loaded on this CPU; the range functions above operate on it */
+struct vmm_space *vmm_space_current(void);
+
+/* New space with an empty lower half (NULL when out of memory) */
+struct vmm_space *vmm_space_create(void);
+
+/* Free a space's lower-half page tables and the space itself. The frames it
+ * mapped are the caller's; it must not be loaded on any CPU. */
+void vmm_space_destroy(struct vmm_space *as);
+
+/* Load `as` on this CPU. With PCIDs its TLB entries survive the switch and
+ * are reused when it is loaded again; otherwise this is a plain CR3 write. */
+void vmm_space_switch(struct vmm_space *as);
+
+/* Range operations on a space that need not be loaded */
+int vmm_space_map(struct vmm_space *as, uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags);
+int vmm_space_unmap(struct vmm_space *as, uint64_t virt, uint64_t len, int free_frames);
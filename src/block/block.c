@@ -5,31 +5,85 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <lib/alloc.h>
+#include <lib/spinlock.h>
 
 #define MAX_BLOCKS 8
 
+/* Most driver requests a disk keeps in flight: AHCI has 32 command slots.
+ * A disk gets as many tags as its port has slots. */
+#define BLOCK_QUEUE_DEPTH 32
+/* Largest piece of a bio handed to the driver at once, in sectors: what one
+ * AHCI command carries */
+#define BLOCK_PIECE_MAX 65536u
+
+/* A driver request carrying one piece of a bio */
+struct block_tag {
+    struct ahci_request rq;
+    struct bio *bio;
+    struct block_dev *disk;
+};
+
+/* Per-disk queue: bios waiting to be cut into pieces, and the tags those
+ * pieces ride on. Pieces go to the driver in order and without waiting; one
+ * the port had no room for is `stalled` and goes first once a command
+ * retires. One caller at a time dispatches; a completion or a new bio
+ * meanwhile sets `kick` so it goes round again. */
+struct block_queue {
+    spinlock_t lock;
+    struct bio *head, *tail;
+    uint32_t free;        /* idle tags */
+    struct block_tag *stalled;
+    uint8_t dispatching;
+    uint8_t kick;
+    struct block_tag tag[BLOCK_QUEUE_DEPTH];
+};
+
 struct block_dev {
     char name[16];
+    uint32_t hash;      /* strhash(name) */
     uintptr_t abar;
     int port;
     uint64_t start_lba;
     uint64_t count;
     int is_partition;
+    struct block_dev *disk;     /* the whole disk; itself for a disk */
+    struct block_queue *q;      /* disks only */
 };
 
 static struct block_dev blocks[MAX_BLOCKS];
 
+static struct block_dev *find_block(const char *name)
+{
+    uint32_t h = strhash(name);
+    for (int i = 0; i < MAX_BLOCKS; ++i) {
+        if (blocks[i].name[0] && blocks[i].hash == h && strcmp(blocks[i].name, name) == 0) return &blocks[i];
+    }
+    return NULL;
+}
+
 int block_register_disk(const char *name, uintptr_t abar, int port)
 {
     for (int i = 0; i < MAX_BLOCKS; ++i) {
         if (blocks[i].name[0] == '\0') {
             size_t j = 0; for (; j+1 < sizeof(blocks[i].name) && name[j]; ++j) blocks[i].name[j] = name[j];
             blocks[i].name[j] = '\0';
+            blocks[i].hash = strhash(blocks[i].name);
             blocks[i].abar = abar;
             blocks[i].port = port;
             blocks[i].start_lba = 0;
             blocks[i].count = 0;
             blocks[i].is_partition = 0;
+            blocks[i].disk = &blocks[i];
+            blocks[i].q = kcalloc(1, sizeof(struct block_queue));
+            if (!blocks[i].q) {
+                kprintf("block: no memory for the queue of %s\n", blocks[i].name);
+                blocks[i].disk = NULL;
+            } else {
+                int depth = ahci_queue_depth(abar, port);
+                if (depth < 1) depth = 1;
+                if (depth > BLOCK_QUEUE_DEPTH) depth = BLOCK_QUEUE_DEPTH;
+                blocks[i].q->free = depth >= 32 ? 0xFFFFFFFFu : (1u << depth) - 1;
+            }
             klog(1, "block: registered disk %s (abar=%p port=%d)\n", blocks[i].name, (void*)abar, port);
             return 0;
         }
@@ -51,12 +105,15 @@ int block_register_partition(const char *disk_name, int idx, uint64_t start, uin
         if (blocks[i].name[0] == '\0') {
             size_t k = 0; for (; k+1 < sizeof(blocks[i].name) && name[k]; ++k) blocks[i].name[k] = name[k];
             blocks[i].name[k] = '\0';
+            blocks[i].hash = strhash(blocks[i].name);
             /* copy from parent disk */
-            for (int p = 0; p < MAX_BLOCKS; ++p) {
-                if (strcmp(blocks[p].name, disk_name) == 0) {
-                    blocks[i].abar = blocks[p].abar;
-                    blocks[i].port = blocks[p].port;
-                }
+            struct block_dev *parent = find_block(disk_name);
+            if (parent) {
+                blocks[i].abar = parent->abar;
+                blocks[i].port = parent->port;
+                blocks[i].disk = parent->disk;
+            } else {
+                kprintf("block: partition %s has no disk %s\n", blocks[i].name, disk_name);
             }
             blocks[i].start_lba = start;
             blocks[i].count = count;
@@ -68,22 +125,228 @@ int block_register_partition(const char *disk_name, int idx, uint64_t start, uin
     return -1;
 }
 
-static struct block_dev *find_block(const char *name)
+
+struct block_dev *block_open(const char *name)
 {
-    for (int i = 0; i < MAX_BLOCKS; ++i) if (strcmp(blocks[i].name, name) == 0) return &blocks[i];
-    return NULL;
+    struct block_dev *b = find_block(name);
+    if (!b) kprintf("block: no device %s\n", name);
+    return b;
+}
+
+static void block_dispatch(struct block_dev *disk);
+
+/* Once `completed` is set a waiter may return and reuse the bio, so the
+ * callback is loaded first and the bio is not read after the store */
+static void block_complete(struct bio *bio)
+{
+    bio_done_t done = bio->done;
+    if (done) done(bio);
+    else __atomic_store_n(&bio->completed, 1, __ATOMIC_RELEASE);
 }
 
-int block_read(const char *name, uint64_t lba, uint16_t count, void *out_buf, size_t out_len)
+static void block_tag_done(struct ahci_request *rq)
 {
-    struct block_dev *b = find_block(name);
-    if (!b) { kprintf("block: read missing device %s\n", name); return -1; }
-    uint64_t final = lba;
-    if (b->is_partition) final = lba + b->start_lba;
-    int r = ahci_read(b->abar, b->port, final, count, out_buf, out_len);
-    if (r != 0) kprintf("block: read failed %s lba=%llu count=%u -> final_lba=%llu (err=%d)\n", name, (unsigned long long)lba, (unsigned)count, (unsigned long long)final, r);
+    struct block_tag *tag = rq->priv;
+    struct bio *bio = tag->bio;
+    struct block_dev *disk = tag->disk;
+    struct block_queue *q = disk->q;
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (rq->status) bio->status = -1;
+    int last = --bio->pending == 0;
+    tag->bio = NULL;
+    q->free |= 1u << (uint32_t)(tag - q->tag);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    if (last) block_complete(bio);
+    block_dispatch(disk);
+}
+
+/* Cut the next piece off the head bio onto an idle tag. Called with the
+ * queue lock held. A bio holds one count of `pending` until its last piece
+ * is cut. */
+static struct block_tag *block_cut(struct block_queue *q, struct block_dev *disk)
+{
+    struct bio *bio = q->head;
+    struct block_tag *tag = &q->tag[__builtin_ctz(q->free)];
+    q->free &= ~(1u << (uint32_t)(tag - q->tag));
+
+    struct ahci_request *rq = &tag->rq;
+    memset(rq, 0, sizeof(*rq));
+    rq->lba = bio->disk_lba + bio->issued;
+    uint64_t left = bio->count - bio->issued;
+    if (left) {
+        struct block_seg *sg = &bio->segs[bio->seg];
+        uint64_t n = (sg->len - bio->seg_off) / 512;
+        if (n > left) n = left;
+        if (n > BLOCK_PIECE_MAX) n = BLOCK_PIECE_MAX;
+        rq->count = (uint32_t)n;
+        rq->buf = (uint8_t*)sg->buf + bio->seg_off;
+        bio->issued += n;
+        bio->seg_off += (size_t)n * 512;
+        if (bio->seg_off == sg->len) {
+            bio->seg++;
+            bio->seg_off = 0;
+        }
+    }
+    if (bio->flags & BIO_WRITE) rq->flags |= AHCI_REQ_WRITE;
+    if (bio->flags & BIO_FUA) rq->flags |= AHCI_REQ_FUA;
+    rq->done = block_tag_done;
+    rq->priv = tag;
+    tag->bio = bio;
+    tag->disk = disk;
+
+    /* The last piece takes over the bio's hold; the flush goes with it,
+     * after everything issued before */
+    if (bio->issued == bio->count) {
+        if (bio->flags & BIO_FLUSH) rq->flags |= AHCI_REQ_FLUSH;
+        q->head = bio->next;
+        if (!q->head) q->tail = NULL;
+    } else {
+        bio->pending++;
+    }
+    return tag;
+}
+
+/* Hand pieces to the port while it has room. Never waits, so completions
+ * run it from the interrupt handler. */
+static void block_dispatch(struct block_dev *disk)
+{
+    struct block_queue *q = disk->q;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->dispatching) {
+        q->kick = 1;
+        spin_unlock_irqrestore(&q->lock, flags);
+        return;
+    }
+    q->dispatching = 1;
+
+    for (;;) {
+        q->kick = 0;
+        struct block_tag *tag = q->stalled;
+        int r;
+        if (tag) {
+            q->stalled = NULL;
+            spin_unlock_irqrestore(&q->lock, flags);
+            r = ahci_resume(disk->abar, disk->port, &tag->rq);
+        } else if (q->head && q->free) {
+            tag = block_cut(q, disk);
+            spin_unlock_irqrestore(&q->lock, flags);
+            r = ahci_try_submit(disk->abar, disk->port, &tag->rq);
+        } else {
+            break;
+        }
+        if (r < 0) {
+            tag->rq.status = -1;
+            block_tag_done(&tag->rq);
+        }
+        flags = spin_lock_irqsave(&q->lock);
+        if (r == 1) {
+            /* Out of room: the next completion resumes it, unless one
+             * already came in meanwhile */
+            q->stalled = tag;
+            if (!q->kick) break;
+        }
+    }
+
+    q->dispatching = 0;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+int block_submit(struct bio *bio)
+{
+    if (!bio || !bio->dev) return -1;
+    struct block_dev *b = bio->dev;
+    struct block_dev *disk = b->disk;
+    if (!disk || !disk->q) return -1;
+    if (bio->count == 0 && !(bio->flags & BIO_FLUSH)) return -1;
+
+    size_t have = 0;
+    for (uint32_t i = 0; i < bio->nsegs; ++i) {
+        if (!bio->segs[i].buf || !bio->segs[i].len || (bio->segs[i].len & 511)) return -1;
+        have += bio->segs[i].len / 512;
+    }
+    if (have < bio->count) return -1;
+    if (b->is_partition && (bio->lba > b->count || bio->count > b->count - bio->lba)) {
+        kprintf("block: request past end of %s lba=%llu count=%llu\n", b->name,
+                (unsigned long long)bio->lba, (unsigned long long)bio->count);
+        return -1;
+    }
+
+    bio->disk_lba = bio->lba + (b->is_partition ? b->start_lba : 0);
+    bio->status = 0;
+    bio->completed = 0;
+    bio->next = NULL;
+    bio->issued = 0;
+    bio->seg = 0;
+    bio->seg_off = 0;
+    bio->pending = 1;
+
+    struct block_queue *q = disk->q;
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->tail) q->tail->next = bio;
+    else q->head = bio;
+    q->tail = bio;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    block_dispatch(disk);
+    return 0;
+}
+
+int block_wait(struct bio *bio)
+{
+    struct block_dev *disk = bio->dev->disk;
+    while (!__atomic_load_n(&bio->completed, __ATOMIC_ACQUIRE)) {
+        uint32_t seen = ahci_retired(disk->abar, disk->port);
+        /* A stalled piece may be waiting on a slot that went to a request
+         * from outside this queue, whose completion does not kick it */
+        block_dispatch(disk);
+        if (__atomic_load_n(&bio->completed, __ATOMIC_ACQUIRE)) break;
+        ahci_wait_retired(disk->abar, disk->port, seen);
+    }
+    return bio->status;
+}
+
+/* Submit a single-segment bio and wait for it */
+static int block_sync(struct block_dev *dev, uint64_t lba, uint64_t count, void *buf, size_t len, uint32_t flags)
+{
+    if (!dev) return -1;
+    struct block_seg seg = { buf, len & ~(size_t)511 };
+    struct bio bio;
+    memset(&bio, 0, sizeof(bio));
+    bio.dev = dev;
+    bio.lba = lba;
+    bio.count = count;
+    bio.segs = &seg;
+    bio.nsegs = count ? 1 : 0;
+    bio.flags = flags;
+    if (block_submit(&bio) != 0) return -1;
+    return block_wait(&bio);
+}
+
+int block_read(struct block_dev *dev, uint64_t lba, uint64_t count, void *out_buf, size_t out_len)
+{
+    if (!count) return -1;
+    int r = block_sync(dev, lba, count, out_buf, out_len, 0);
+    if (r != 0) kprintf("block: read failed %s lba=%llu count=%llu (err=%d)\n", dev ? dev->name : "?", (unsigned long long)lba, (unsigned long long)count, r);
     return r;
 }
+
+int block_write(struct block_dev *dev, uint64_t lba, uint64_t count, const void *buf, size_t len, uint32_t flags)
+{
+    if (!count) return -1;
+    int r = block_sync(dev, lba, count, (void*)buf, len, BIO_WRITE | (flags & BIO_FUA));
+    if (r != 0) kprintf("block: write failed %s lba=%llu count=%llu (err=%d)\n", dev ? dev->name : "?", (unsigned long long)lba, (unsigned long long)count, r);
+    return r;
+}
+
+int block_flush(struct block_dev *dev)
+{
+    int r = block_sync(dev, 0, 0, NULL, 0, BIO_FLUSH);
+    if (r != 0) kprintf("block: flush failed %s (err=%d)\n", dev ? dev->name : "?", r);
+    return r;
+}
+
 int block_get_partition(const char *name, uint64_t *out_start, uint64_t *out_count)
 {
     struct block_dev *b = find_block(name);
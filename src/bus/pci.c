@@ -94,17 +94,17 @@ static uint64_t map_mmio(uint64_t phys, uint64_t size)
         mmio_alloc_ptr = base + 0x200000; /* +2MiB */
     }
 
+    /* Give the window the same offset within 2MiB as the BAR, so
+     * vmm_map_range can use large pages for big BARs */
     uint64_t virt_base = align_up(mmio_alloc_ptr, 0x1000);
+    if (map_size >= VMM_PAGE_2M)
+        virt_base = align_up(mmio_alloc_ptr, VMM_PAGE_2M) + (phys_base & (VMM_PAGE_2M - 1));
     mmio_alloc_ptr = virt_base + map_size;
 
-    for (uint64_t off = 0; off < map_size; off += 0x1000) {
-        uint64_t v = virt_base + off;
-        uint64_t p = phys_base + off;
-        int r = vmm_map_page(v, p, VMM_PTE_W);
-        if (r < 0) {
-            kprintf(LOG_ERROR "pci: vmm_map_page failed virt=0x%llx phys=0x%llx\n", (unsigned long long)v, (unsigned long long)p);
-            return 0;
-        }
+    if (vmm_map_range(virt_base, phys_base, map_size, VMM_PTE_W) < 0) {
+        kprintf(LOG_ERROR "pci: vmm_map_range failed virt=0x%llx phys=0x%llx size=0x%llx\n",
+                (unsigned long long)virt_base, (unsigned long long)phys_base, (unsigned long long)map_size);
+        return 0;
     }
 
     return virt_base + offset;
@@ -212,6 +212,40 @@ void pci_write_config_byte(uint8_t bus, uint8_t device, uint8_t function, uint8_
     pci_config_write32(bus, device, function, aligned, newv);
 }
 
+int pci_find_capability(struct pci_device* dev, uint8_t id)
+{
+    uint16_t status = pci_read_config_word(dev->bus, dev->device, dev->function, 0x06);
+    if (!(status & (1 << 4))) return 0; /* no capabilities list */
+    uint8_t cap = pci_read_config_byte(dev->bus, dev->device, dev->function, 0x34);
+    for (int iter = 0; cap && iter < 48; ++iter) {
+        if (pci_read_config_byte(dev->bus, dev->device, dev->function, cap) == id) return cap;
+        cap = pci_read_config_byte(dev->bus, dev->device, dev->function, cap + 1);
+    }
+    return 0;
+}
+
+int pci_enable_msi(struct pci_device* dev, uint8_t vector, uint32_t apic_id)
+{
+    int cap = pci_find_capability(dev, PCI_CAP_MSI);
+    if (!cap) return -1;
+
+    uint16_t ctrl = pci_read_config_word(dev->bus, dev->device, dev->function, cap + 2);
+    uint32_t addr = 0xFEE00000u | ((apic_id & 0xFF) << 12); /* fixed delivery, physical dest */
+    pci_config_write32(dev->bus, dev->device, dev->function, cap + 4, addr);
+    if (ctrl & (1 << 7)) { /* 64-bit address */
+        pci_config_write32(dev->bus, dev->device, dev->function, cap + 8, 0);
+        pci_write_config_word(dev->bus, dev->device, dev->function, cap + 12, vector);
+    } else {
+        pci_write_config_word(dev->bus, dev->device, dev->function, cap + 8, vector);
+    }
+    ctrl &= ~(7u << 4);  /* one message */
+    pci_write_config_word(dev->bus, dev->device, dev->function, cap + 2, ctrl | 1);
+
+    uint16_t cmd = pci_read_config_word(dev->bus, dev->device, dev->function, 0x04);
+    pci_write_config_word(dev->bus, dev->device, dev->function, 0x04, cmd | (1 << 10)); /* INTx disable */
+    return 0;
+}
+
 /* helpers: read 8/16 */
 static inline uint8_t pci_read8(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset)
 {
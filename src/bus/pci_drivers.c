@@ -215,21 +215,6 @@ static int probe_168c_002e(struct pci_device* dev)
 //function to read e1000 device eeprom and get mac address
 
 
-static int find_pci_cap(struct pci_device* dev, uint8_t capid)
-{
-    uint16_t status = pci_read_config_word(dev->bus, dev->device, dev->function, 0x06);
-    if (!(status & (1<<4))) return 0; /* no capabilities list */
-    uint8_t cap = pci_read_config_byte(dev->bus, dev->device, dev->function, 0x34);
-    int iter = 0;
-    while (cap && iter++ < 32) {
-        uint8_t cid = pci_read_config_byte(dev->bus, dev->device, dev->function, cap);
-        if (cid == capid) return cap;
-        cap = pci_read_config_byte(dev->bus, dev->device, dev->function, cap + 1);
-    }
-    return 0;
-}
-
-
 
 /* Register AHCI driver (call from kernel init) */
 void pci_register_builtin_drivers(void)
@@ -6,8 +6,11 @@
 #include <drivers/idt.h>
 #include <mem/pmm.h>
 #include <mem/vmm.h>
+#include <mem/tlb.h>
 #include <mem/slab.h>
+#include <mem/vmalloc.h>
 #include <lib/alloc.h>
+#include <lib/arena.h>
 #include <drivers/cmdline.h>
 #include <block/block.h>
 #include <fs/vfs.h>
@@ -18,6 +21,8 @@
 #include <bus/pci.h>
 #include <lib/string.h>
 #include <drivers/pit.h>
+#include <drivers/smp.h>
+#include <kernel/bench.h>
 
 void kernel_main()
 {
@@ -43,6 +48,7 @@ void kernel_main()
     smp_build_mp_info();
     extern void apic_init();
     apic_init();
+    smp_index_init();
     /* Initialize PIT before starting APs so pit_wait() works for SIPI timing */
     pit_init();
 
@@ -58,8 +64,10 @@ void kernel_main()
     kprintf(LOG_OK "PMM initialized.\n");
     vmm_init();
     kprintf(LOG_OK "VMM initialized.\n");
+    tlb_init();
     slab_init();
     kprintf(LOG_OK "Slab allocator initialized.\n");
+    vmalloc_init();
     pci_init();
     kprintf(LOG_OK "PCI initialized.\n");
     pci_print_devices();
@@ -73,18 +81,19 @@ void kernel_main()
     /* Register any extra, late-bound drivers (device-specific). Must be done before probing. */
     pci_register_extra_drivers();
     pci_probe_devices();
-      char* root_part = cmdline_get("root");
+    /* Strings and scratch data of the boot sequence, released at its end */
+    struct arena *boot_arena = arena_create(0);
+    char* root_part = cmdline_get_arena(boot_arena, "root");
     if (root_part) {
         kprintf("Root partition specified: %s\n", root_part);
     } else {
         kprintf("No root partition specified in command line.\n");
     }
-    char* loglevel = cmdline_get("loglevel");
+    char* loglevel = cmdline_get_arena(boot_arena, "loglevel");
     if (loglevel) {
         int lv = atoi(loglevel);
         set_loglevel(lv);
         kprintf("Log level specified: %s -> %d\n", loglevel, lv);
-        kfree(loglevel);
     } else {
         kprintf("No log level specified in command line.\n");
     }
@@ -219,6 +228,10 @@ void kernel_main()
       
     }
     #endif
+    arena_destroy(boot_arena);
+    #ifdef ENABLE_BENCH
+    bench_run();
+    #endif
     #ifdef ENABLE_SMP
     extern void smp_start_aps();
     smp_start_aps();
@@ -229,8 +242,9 @@ void kernel_main()
 
 void kernel_run()
 {
-    // Kernel main loop
+    // Kernel main loop: spend idle time zeroing frames, sleep once the pool is full
     while (1) {
+        if (pmm_zero_pool_refill()) continue;
         __asm__ volatile("hlt");
     }
 }
\ No newline at end of file
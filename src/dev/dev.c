@@ -15,6 +15,7 @@ int dev_register(const char *name, int type, void *data, size_t size)
             char *n = strdup(name);
             if (!n) return -1;
             devs[i].name = n;
+            devs[i].hash = strhash(n);
             devs[i].type = type;
             devs[i].data = data;
             devs[i].size = size;
@@ -27,8 +28,9 @@ int dev_register(const char *name, int type, void *data, size_t size)
 
 struct dev_entry *dev_get(const char *name)
 {
+    uint32_t h = strhash(name);
     for (int i = 0; i < MAX_DEVICES; ++i) {
-        if (devs[i].name && strcmp(devs[i].name, name) == 0) return &devs[i];
+        if (devs[i].name && devs[i].hash == h && strcmp(devs[i].name, name) == 0) return &devs[i];
     }
     return NULL;
 }
@@ -8,6 +8,8 @@
 #include <lib/alloc.h>
 #include <drivers/pit.h>
 #include <drivers/idt.h>
+#include <mem/tlb.h>
+#include <drivers/smp.h>
 void *sdt_address = NULL;
 bool use_xsdt = false;
 uint64_t cpu_read_msr(uint32_t msr) {
@@ -374,11 +376,15 @@ extern void enable_sse(void);
 static void smp_cpu_entry(void *arg) {
     titan_mp_info_t *info = (titan_mp_info_t*)arg;
     enable_sse();
+    /* Each CPU enables its own LAPIC (and x2APIC mode); smp_cpu_index() reads it */
+    apic_init();
+    smp_cpu_local_init();
     kprintf(LOG_OK "SMP CPU started: Processor ID %u, LAPIC ID %u\n",
             info->processor_id, info->lapic_id);
             gdt_init(info->processor_id);
             kprintf(LOG_OK "SMP CPU %u GDT initialized.\n", info->processor_id);
             interrupts_reload();
+            tlb_cpu_online();
     // Per-CPU setup you need:
     // - enable SSE for AP
     // - set up GDT/IDT (or load the same)
@@ -1,8 +1,14 @@
 #include <drivers/ahci.h>
 #include <kernel/kprintf.h>
 #include <mem/pmm.h>
+#include <mem/vmm.h>
 #include <common/boot.h>
 #include <lib/string.h>
+#include <lib/spinlock.h>
+#include <kernel/bench.h>
+#include <drivers/acpi.h>
+#include <drivers/idt.h>
+#include <drivers/pit.h>
 #include <dev/dev.h>
 #include <stddef.h>
 
@@ -69,12 +75,15 @@ struct hba_prdt_entry {
     uint32_t dbc; /* byte count, interrupt on completion */
 };
 
-/* Command table (minimal) */
+/* Command table: one 4KiB page, as many PRD entries as fit after the header */
+#define AHCI_PRDT_MAX ((4096 - 128) / 16)
+#define AHCI_PRD_MAX_BYTES (4u << 20)   /* one PRD entry covers at most 4MiB */
+
 struct hba_cmd_tbl {
     uint8_t cfis[64];
     uint8_t acmd[16];
     uint8_t reserved[48];
-    struct hba_prdt_entry prdt[1];
+    struct hba_prdt_entry prdt[AHCI_PRDT_MAX];
 };
 
 /* H2D FIS */
@@ -102,6 +111,49 @@ struct fis_h2d {
 
 static inline void delay(volatile int d) { while (d--) __asm__ volatile ("nop"); }
 
+/* Per-port DMA area: CLB, FIS, one command table per slot and
+ * AHCI_BOUNCE_PAGES of bounce buffer */
+#define AHCI_CMD_SLOTS 32
+#define AHCI_BOUNCE_PAGES 16
+#define AHCI_PORT_DMA_PAGES (2 + AHCI_CMD_SLOTS + AHCI_BOUNCE_PAGES)
+#define AHCI_BOUNCE_SECTORS (AHCI_BOUNCE_PAGES * 4096 / 512)
+#define AHCI_CMD_MAX_SECTORS 65536   /* a sector count of 0 means 65536 */
+
+#define HBA_CAP_SNCQ  (1u << 30)
+#define HBA_GHC_IE    (1u << 1)
+#define HBA_PxCMD_ST  (1u << 0)
+#define HBA_PxIS_DHRS (1u << 0)   /* D2H register FIS: non-queued command done */
+#define HBA_PxIS_PSS  (1u << 1)   /* PIO setup FIS */
+#define HBA_PxIS_SDBS (1u << 3)   /* set device bits FIS: NCQ tags done */
+#define HBA_PxIS_TFES (1u << 30)
+/* Task file, host bus data/fatal and interface fatal errors stop the port */
+#define HBA_PxIS_FATAL (HBA_PxIS_TFES | (1u << 29) | (1u << 28) | (1u << 27))
+#define HBA_PxIE_MASK (HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_SDBS | HBA_PxIS_FATAL)
+
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_READ_FPDMA        0x60
+#define ATA_CMD_WRITE_FPDMA       0x61
+#define ATA_CMD_FLUSH_CACHE       0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT   0xEA
+#define ATA_DEV_FUA               (1u << 7)   /* FPDMA: force unit access */
+
+/* A port that retires no command for this long is reset. The spin count
+ * bounds waits with interrupts off, when the PIT does not tick. */
+#define AHCI_TIMEOUT_MS 2000
+#define AHCI_TIMEOUT_SPINS 2000000
+
+/* What a busy slot is doing: its share of a request, and for reads through
+ * the bounce buffer where to copy it on completion */
+struct ahci_slot {
+    struct ahci_request *rq;
+    void *bounce_dst;
+    uint32_t bytes;
+    uint8_t bounce;       /* holds the bounce buffer */
+    uint8_t exclusive;    /* a non-queued command: nothing else may issue */
+};
+
 /* Per-controller and per-port persistent state to avoid leaking frames and to
  * ensure the port is started before submitting commands. */
 struct ahci_port_state {
@@ -109,11 +161,29 @@ struct ahci_port_state {
     uint64_t fb_ph;
     uint64_t ct_ph;
     uint64_t buf_ph;
+    uint64_t dma_limit;   /* first address the HBA cannot reach, 0 = none */
+    uint64_t sectors;
     int initialized;
+
+    /* Command queue. Slots double as NCQ tags; without NCQ only one command
+     * may be outstanding. Everything below is under `lock`. */
+    spinlock_t lock;
+    uint32_t nslots;
+    uint32_t busy;        /* issued and not yet reaped */
+    volatile uint32_t retired;   /* commands retired so far, for waiters */
+    uint8_t ncq;
+    uint8_t fua;          /* writes can force unit access */
+    uint8_t flush_cmd;
+    uint8_t bounce_busy;
+    uint8_t exclusive;    /* a flush is outstanding */
+    uint8_t drain;        /* a flush waits for the queue to empty */
+    struct ahci_slot slot[AHCI_CMD_SLOTS];
 };
 
 struct ahci_controller {
     uintptr_t abar;
+    uint8_t vector;       /* 0 while completions are polled */
+    uint32_t irq_apic;    /* LAPIC the interrupt is delivered to */
     struct ahci_port_state ports[32];
 };
 
@@ -222,86 +292,200 @@ static int find_cmdslot(volatile struct hba_port *port)
     return -1;
 }
 
-int ahci_read(uintptr_t abar, int port, uint64_t lba, uint16_t count, void* out_buf, size_t out_len)
+/* Point the PRDT at `len` bytes of the caller's buffer at `va`, one entry per
+ * physically contiguous run. Stops early at a full PRDT or at a page that is
+ * unmapped or out of the HBA's reach. Returns the bytes covered, trimmed to
+ * whole sectors, with the entry count in *prdtl; 0 means the buffer has to
+ * go through the bounce pages. */
+static size_t ahci_map_buffer(struct hba_cmd_tbl *tbl, const struct ahci_port_state *st,
+                              uintptr_t va, size_t len, uint16_t *prdtl)
 {
-    if (!out_buf) return -1;
-    if (count == 0 || count > 8) return -1;
-    if (out_len < (size_t)count * 512) return -1;
-
-    volatile struct hba_mem *hba = (volatile struct hba_mem*)abar;
-    volatile struct hba_port *p  = &hba->ports[port];
-
-    struct ahci_controller *ctrl = ahci_get_controller(abar);
-    if (!ctrl) return -1;
-
-    struct ahci_port_state *st = &ctrl->ports[port];
-    if (!st->initialized) return -1;
-
-    /* Ensure the port is running */
-    if (start_port(p) != 0) {
-        kprintf("ahci: failed to start port %d\n", port);
-        return -1;
-    }
-
-    /* Wait until the device is not busy / not requesting data */
-    /* (PxTFD: BSY=bit7, DRQ=bit3) */
-    {
-        int spin = 1000000;
-        while (spin--) {
-            uint32_t tfd = p->tfd;
-            if ((tfd & (1u << 7)) == 0 && (tfd & (1u << 3)) == 0) break;
-            delay(1);
-        }
-        /* If still busy, bail */
-        if ((p->tfd & (1u << 7)) || (p->tfd & (1u << 3))) {
-            kprintf("ahci: port %d still busy (tfd=%x)\n", port, p->tfd);
-            return -1;
+    *prdtl = 0;
+    if (va & 1) return 0;   /* PRD data addresses must be word aligned */
+
+    size_t covered = 0;
+    uint16_t n = 0;
+    uint64_t next_pa = 0;   /* where the last entry ends */
+    while (covered < len) {
+        uintptr_t v = va + covered;
+        size_t seg = PMM_PAGE_SIZE - (v & (PMM_PAGE_SIZE - 1));
+        if (seg > len - covered) seg = len - covered;
+        uint64_t pa = vmm_translate(v);
+        if (!pa || (st->dma_limit && pa + seg > st->dma_limit)) break;
+
+        if (n && pa == next_pa && tbl->prdt[n - 1].dbc + 1 + seg <= AHCI_PRD_MAX_BYTES) {
+            tbl->prdt[n - 1].dbc += (uint32_t)seg;
+        } else {
+            if (n == AHCI_PRDT_MAX) break;
+            struct hba_prdt_entry *e = &tbl->prdt[n++];
+            e->dba = (uint32_t)pa;
+            e->dbau = (uint32_t)(pa >> 32);
+            e->reserved = 0;
+            e->dbc = (uint32_t)seg - 1;   /* bytes - 1 */
         }
+        next_pa = pa + seg;
+        covered += seg;
     }
 
-    /* Clear pending interrupt + error bits */
-    p->is   = 0xFFFFFFFFu;
-    p->serr = 0xFFFFFFFFu;
-
-    /* Find a free command slot */
-    int slot = find_cmdslot(p);
-    if (slot < 0 || slot >= 32) {
-        kprintf("ahci: no free cmd slot on port %d\n", port);
-        return -1;
+    /* Drop the partial sector at the end */
+    size_t cut = covered & 511;
+    covered -= cut;
+    while (cut && n) {
+        uint32_t l = tbl->prdt[n - 1].dbc + 1;
+        if (l > cut) {
+            tbl->prdt[n - 1].dbc -= (uint32_t)cut;
+            cut = 0;
+        } else {
+            cut -= l;
+            n--;
+        }
     }
+    *prdtl = n;
+    return covered;
+}
 
-    /* Command list (32 headers) */
-    struct hba_cmd_header *cmdheader =
-        (struct hba_cmd_header*)PHYS_TO_VIRT(st->clb_ph);
-
-    /* Use the selected slot (DO NOT wipe all 32 entries every time) */
-    memset(&cmdheader[slot], 0, sizeof(cmdheader[slot]));
-    cmdheader[slot].cfl   = sizeof(struct fis_h2d) / 4; /* dwords */
-    cmdheader[slot].w     = 0;                          /* read */
-    cmdheader[slot].prdtl = 1;
+/* The state of an initialized port, NULL otherwise */
+static struct ahci_port_state *ahci_port(uintptr_t abar, int port)
+{
+    struct ahci_controller *ctrl = ahci_get_controller(abar);
+    if (!ctrl || port < 0 || port >= 32) return NULL;
+    struct ahci_port_state *st = &ctrl->ports[port];
+    return st->initialized ? st : NULL;
+}
 
-    /* One 4KiB command table per slot */
+/* Fill in the command header and H2D FIS for `slot` */
+static struct fis_h2d *ahci_prep_cmd(struct ahci_port_state *st, int slot, uint16_t prdtl, int write)
+{
     uint64_t ct_ph = st->ct_ph + ((uint64_t)slot * 4096ull);
     struct hba_cmd_tbl *cmdtbl = (struct hba_cmd_tbl*)PHYS_TO_VIRT(ct_ph);
-    memset(cmdtbl, 0, 4096);
 
+    struct hba_cmd_header *cmdheader = (struct hba_cmd_header*)PHYS_TO_VIRT(st->clb_ph);
+    memset(&cmdheader[slot], 0, sizeof(cmdheader[slot]));
+    cmdheader[slot].cfl   = sizeof(struct fis_h2d) / 4; /* dwords */
+    cmdheader[slot].w     = write ? 1 : 0;
+    cmdheader[slot].prdtl = prdtl;
     cmdheader[slot].ctba  = (uint32_t)ct_ph;
     cmdheader[slot].ctbau = (uint32_t)(ct_ph >> 32);
 
-    /* PRDT entry (single contiguous buffer) */
-    cmdtbl->prdt[0].dba  = (uint32_t)st->buf_ph;
-    cmdtbl->prdt[0].dbau = (uint32_t)(st->buf_ph >> 32);
-    cmdtbl->prdt[0].dbc  = ((uint32_t)count * 512u) - 1u; /* bytes - 1 */
-    cmdtbl->prdt[0].dbc |= (1u << 31);                    /* IOC */
-
-    /* Build CFIS (H2D) */
     struct fis_h2d *cfis = (struct fis_h2d*)cmdtbl->cfis;
-    memset(cfis, 0, sizeof(*cfis));
     cfis->type    = 0x27;     /* FIS_TYPE_REG_H2D */
     cfis->c       = 1;        /* command */
-    cfis->command = 0x25;     /* READ DMA EXT */
     cfis->device  = 1 << 6;   /* LBA mode */
+    return cfis;
+}
+
+/* Hand `slot` to the HBA. Called with the port lock held. */
+static void ahci_start_cmd(volatile struct hba_port *p, struct ahci_port_state *st, int slot, int queued)
+{
+    st->busy |= 1u << slot;
+
+    /* Make sure HBA sees the prepared structures before setting CI */
+    asm volatile("" ::: "memory");
+
+    /* PxSACT and PxCI only take 1 bits: no read-modify-write. With NCQ the
+     * tag is marked active first and stays so until the drive reports it
+     * done. */
+    if (queued) p->sact = 1u << slot;
+    p->ci = 1u << slot;
+}
 
+/* Issue the cache flush that ends `rq`. It is not an NCQ command, so it
+ * waits for the queue to drain, with new data commands held back
+ * meanwhile, and runs alone. Returns 0 once issued, 1 to wait. */
+static int ahci_issue_flush(volatile struct hba_port *p, struct ahci_port_state *st,
+                            struct ahci_request *rq)
+{
+    uint64_t flags = spin_lock_irqsave(&st->lock);
+    if (st->busy) {
+        st->drain = 1;
+        spin_unlock_irqrestore(&st->lock, flags);
+        return 1;
+    }
+    st->drain = 0;
+
+    uint64_t ct_ph = st->ct_ph;
+    struct hba_cmd_tbl *cmdtbl = (struct hba_cmd_tbl*)PHYS_TO_VIRT(ct_ph);
+    memset(cmdtbl, 0, offsetof(struct hba_cmd_tbl, prdt));
+    struct fis_h2d *cfis = ahci_prep_cmd(st, 0, 0, 0);
+    cfis->command = st->flush_cmd;
+
+    st->slot[0].rq = rq;
+    st->slot[0].bounce_dst = NULL;
+    st->slot[0].bytes = 0;
+    st->slot[0].bounce = 0;
+    st->slot[0].exclusive = 1;
+    st->exclusive = 1;
+    rq->pending++;
+    ahci_start_cmd(p, st, 0, 0);
+
+    spin_unlock_irqrestore(&st->lock, flags);
+    return 0;
+}
+
+/* Put the next piece of `rq` on a free slot. Returns 0 once it is issued,
+ * 1 when it has to wait for a slot, for the bounce buffer or for a flush. */
+static int ahci_issue(volatile struct hba_port *p, struct ahci_port_state *st,
+                      struct ahci_request *rq)
+{
+    uint64_t flags = spin_lock_irqsave(&st->lock);
+    uint32_t all = st->nslots >= 32 ? 0xFFFFFFFFu : (1u << st->nslots) - 1;
+    uint32_t free = all & ~st->busy;
+    if (!free || st->exclusive || (st->drain && st->busy)) {
+        spin_unlock_irqrestore(&st->lock, flags);
+        return 1;
+    }
+    int slot = __builtin_ctz(free);
+    int write = (rq->flags & AHCI_REQ_WRITE) != 0;
+
+    uint32_t left = rq->count - rq->submitted;
+    if (left > AHCI_CMD_MAX_SECTORS) left = AHCI_CMD_MAX_SECTORS;
+    uint8_t *buf = (uint8_t*)rq->buf + (size_t)rq->submitted * 512;
+
+    /* One 4KiB command table per slot; the PRDT entries in use are written
+     * below, so only the header part needs clearing */
+    uint64_t ct_ph = st->ct_ph + ((uint64_t)slot * 4096ull);
+    struct hba_cmd_tbl *cmdtbl = (struct hba_cmd_tbl*)PHYS_TO_VIRT(ct_ph);
+    memset(cmdtbl, 0, offsetof(struct hba_cmd_tbl, prdt));
+
+    /* DMA straight to or from the caller's buffer where its pages allow */
+    uint16_t prdtl;
+    size_t bytes = ahci_map_buffer(cmdtbl, st, (uintptr_t)buf, (size_t)left * 512, &prdtl);
+    int bounce = bytes == 0;
+    if (bounce) {
+        if (st->bounce_busy) {
+            spin_unlock_irqrestore(&st->lock, flags);
+            return 1;
+        }
+        st->bounce_busy = 1;
+        bytes = (size_t)(left < AHCI_BOUNCE_SECTORS ? left : AHCI_BOUNCE_SECTORS) * 512;
+        if (write) memcpy(PHYS_TO_VIRT(st->buf_ph), buf, bytes);
+        cmdtbl->prdt[0].dba  = (uint32_t)st->buf_ph;
+        cmdtbl->prdt[0].dbau = (uint32_t)(st->buf_ph >> 32);
+        cmdtbl->prdt[0].reserved = 0;
+        cmdtbl->prdt[0].dbc  = (uint32_t)bytes - 1u;
+        prdtl = 1;
+    }
+    cmdtbl->prdt[prdtl - 1].dbc |= (1u << 31);   /* IOC */
+    uint32_t n = (uint32_t)(bytes / 512);
+
+    struct fis_h2d *cfis = ahci_prep_cmd(st, slot, prdtl, write);
+    int fua = write && (rq->flags & AHCI_REQ_FUA) && st->fua;
+    if (st->ncq) {
+        /* FPDMA QUEUED: the sector count moves to FEATURES, the tag goes in
+         * COUNT bits 7:3 */
+        cfis->command  = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+        cfis->featurel = (uint8_t)(n & 0xFF);
+        cfis->featureh = (uint8_t)((n >> 8) & 0xFF);
+        cfis->countl   = (uint8_t)(slot << 3);
+        if (fua) cfis->device |= ATA_DEV_FUA;
+    } else {
+        if (!write) cfis->command = ATA_CMD_READ_DMA_EXT;
+        else cfis->command = fua ? ATA_CMD_WRITE_DMA_FUA_EXT : ATA_CMD_WRITE_DMA_EXT;
+        cfis->countl  = (uint8_t)(n & 0xFF);
+        cfis->counth  = (uint8_t)((n >> 8) & 0xFF);
+    }
+
+    uint64_t lba = rq->lba + rq->submitted;
     cfis->lba0 = (uint8_t)(lba & 0xFF);
     cfis->lba1 = (uint8_t)((lba >> 8) & 0xFF);
     cfis->lba2 = (uint8_t)((lba >> 16) & 0xFF);
@@ -309,42 +493,397 @@ int ahci_read(uintptr_t abar, int port, uint64_t lba, uint16_t count, void* out_
     cfis->lba4 = (uint8_t)((lba >> 32) & 0xFF);
     cfis->lba5 = (uint8_t)((lba >> 40) & 0xFF);
 
-    cfis->countl = (uint8_t)(count & 0xFF);
-    cfis->counth = (uint8_t)((count >> 8) & 0xFF);
+    st->slot[slot].rq = rq;
+    st->slot[slot].bounce_dst = (bounce && !write) ? buf : NULL;
+    st->slot[slot].bytes = (uint32_t)bytes;
+    st->slot[slot].bounce = (uint8_t)bounce;
+    st->slot[slot].exclusive = 0;
+    rq->submitted += n;
+    rq->pending++;
+    ahci_start_cmd(p, st, slot, st->ncq);
 
-    /* Make sure HBA sees the prepared structures before setting CI */
-    asm volatile("" ::: "memory");
+    spin_unlock_irqrestore(&st->lock, flags);
+    return 0;
+}
 
-    /* Issue command (OR-in, do not clobber) */
-    p->ci |= (1u << slot);
+/* Retire `slot` with `status`; requests whose last command it was go on
+ * `fin` for their callback. Called with the port lock held. */
+/* Slots set in `mask`. Counted by hand: without -mpopcnt the builtin is a
+ * libgcc call, and the kernel does not link libgcc. */
+static int ahci_count_slots(uint32_t mask)
+{
+    int n = 0;
+    for (; mask; mask &= mask - 1) ++n;
+    return n;
+}
 
-    /* Poll for completion or task-file error */
-    int t = 2000000;
-    while (t--) {
-        if ((p->ci & (1u << slot)) == 0) break;
+/* A request that completed, with its callback loaded while the port lock
+ * was held: once `pending` reaches 0 the request may belong to a waiter
+ * that has already returned, so it is not read again */
+struct ahci_fin {
+    ahci_done_t done;
+    struct ahci_request *rq;
+};
 
-        /* Task File Error Status in PxIS is bit 30 (TFES) */
-        if (p->is & (1u << 30)) {
-            kprintf("ahci: TFES on port %d (is=%x tfd=%x)\n", port, p->is, p->tfd);
-            return -1;
+static void ahci_retire(struct ahci_port_state *st, int slot, int status,
+                        struct ahci_fin *fin, int *nfin)
+{
+    struct ahci_slot *s = &st->slot[slot];
+    struct ahci_request *rq = s->rq;
+    if (s->bounce) {
+        if (s->bounce_dst && status == 0) memcpy(s->bounce_dst, PHYS_TO_VIRT(st->buf_ph), s->bytes);
+        st->bounce_busy = 0;
+    }
+    if (s->exclusive) st->exclusive = 0;
+    if (status) rq->status = -1;
+    s->rq = NULL;
+    st->busy &= ~(1u << slot);
+    ahci_done_t done = rq->done;
+    if (--rq->pending == 0 && done) {
+        fin[*nfin].done = done;
+        fin[*nfin].rq = rq;
+        (*nfin)++;
+    }
+    /* After `pending`: a waiter that sees the new count sees the request
+     * state too */
+    st->retired++;
+}
+
+/* Retire every command the port has finished: those no longer in PxSACT or
+ * PxCI. An error, or `reset`, fails everything outstanding and restarts the
+ * port. Called from the interrupt handler and from pollers; callbacks run
+ * after the lock is dropped. Returns the number of commands retired. */
+static int ahci_reap(volatile struct hba_port *p, struct ahci_port_state *st, int portno, int reset)
+{
+    struct ahci_fin fin[AHCI_CMD_SLOTS];
+    int nfin = 0, retired = 0;
+
+    uint64_t flags = spin_lock_irqsave(&st->lock);
+    uint32_t is = p->is;
+    if (is) p->is = is;
+    if ((is & HBA_PxIS_FATAL) || reset) {
+        if (st->busy) {
+            kprintf("ahci: port %d %s with %d commands outstanding, resetting\n", portno,
+                    reset ? "timed out" : "failed", ahci_count_slots(st->busy));
+            dump_port_status(p, portno);
+        }
+        /* Clearing ST drops PxCI and PxSACT; a drive still BSY needs a
+         * COMRESET */
+        stop_port(p);
+        p->serr = 0xFFFFFFFFu;
+        p->is = 0xFFFFFFFFu;
+        if (p->tfd & ((1u << 7) | (1u << 3))) port_reset_and_wait(p, portno);
+        else start_port(p);
+        for (uint32_t busy = st->busy; busy; busy &= busy - 1) {
+            ahci_retire(st, __builtin_ctz(busy), -1, fin, &nfin);
+            ++retired;
+        }
+    } else {
+        uint32_t done = st->busy & ~(p->sact | p->ci);
+        for (; done; done &= done - 1) {
+            ahci_retire(st, __builtin_ctz(done), 0, fin, &nfin);
+            ++retired;
+        }
+    }
+    spin_unlock_irqrestore(&st->lock, flags);
+
+    for (int i = 0; i < nfin; ++i) fin[i].done(fin[i].rq);
+    return retired;
+}
+
+/* Drop the submission's hold on `rq`, completing it if nothing is left */
+static void ahci_release(struct ahci_port_state *st, struct ahci_request *rq)
+{
+    uint64_t flags = spin_lock_irqsave(&st->lock);
+    ahci_done_t done = rq->done;
+    int last = --rq->pending == 0;
+    spin_unlock_irqrestore(&st->lock, flags);
+    if (last && done) done(rq);
+}
+
+/* Wait until the port has retired more than `seen` commands. With an
+ * interrupt routed to this CPU and interrupts on, the CPU sleeps in hlt
+ * and the handler does the reaping; otherwise the port is polled. A port
+ * that makes no progress for AHCI_TIMEOUT_MS is reset, failing what it
+ * had outstanding. */
+static void ahci_wait(struct ahci_controller *ctrl, volatile struct hba_port *p,
+                      struct ahci_port_state *st, int port, uint32_t seen)
+{
+    uint64_t start = pit_get_ticks();
+    uint32_t spins = 0;
+    while (st->retired == seen && st->busy) {
+        uint64_t flags = irq_save();
+        int sleep = ctrl->vector && (flags & (1ULL << 9)) && apic_get_id() == ctrl->irq_apic;
+        if (sleep) {
+            /* sti takes effect after hlt starts: no wakeup is lost between
+             * the check and the sleep */
+            if (st->retired == seen) __asm__ volatile ("sti; hlt" ::: "memory");
+            irq_restore(flags);
+        } else {
+            irq_restore(flags);
+            if (ahci_reap(p, st, port, 0)) return;
+            __asm__ volatile ("pause");
+            ++spins;
+        }
+        if (pit_get_ticks() - start > AHCI_TIMEOUT_MS || spins > AHCI_TIMEOUT_SPINS) {
+            ahci_reap(p, st, port, 1);
+            return;
         }
+    }
+}
 
-        delay(1);
+static void ahci_isr(context_t *ctx)
+{
+    for (int c = 0; c < MAX_AHCI_CONTROLLERS; ++c) {
+        struct ahci_controller *ctrl = &ahci_controllers[c];
+        if (!ctrl->vector || ctrl->vector != ctx->int_no) continue;
+        volatile struct hba_mem *hba = (volatile struct hba_mem*)ctrl->abar;
+        uint32_t is = hba->is;
+        /* Per-port status first (reaping clears it), then the summary bits */
+        for (uint32_t pending = is; pending; pending &= pending - 1) {
+            int port = __builtin_ctz(pending);
+            if (ctrl->ports[port].initialized) ahci_reap(&hba->ports[port], &ctrl->ports[port], port, 0);
+            else hba->ports[port].is = hba->ports[port].is;
+        }
+        hba->is = is;
     }
+    apic_eoi();
+}
+
+/* Check `rq`, make sure the port runs and reset the request's progress */
+static int ahci_begin(uintptr_t abar, int port, struct ahci_request *rq)
+{
+    if (!rq) return -1;
+    if (rq->count ? !rq->buf : !(rq->flags & AHCI_REQ_FLUSH)) return -1;
+    if (!ahci_port(abar, port)) return -1;
 
-    if (p->ci & (1u << slot)) {
-        kprintf("ahci: read timeout on port %d (ci=%x is=%x tfd=%x)\n",
-                port, p->ci, p->is, p->tfd);
+    volatile struct hba_mem *hba = (volatile struct hba_mem*)abar;
+    volatile struct hba_port *p  = &hba->ports[port];
+    if (!(p->cmd & HBA_PxCMD_ST) && start_port(p) != 0) {
+        kprintf("ahci: failed to start port %d\n", port);
         return -1;
     }
 
-    /* Copy out */
-    void *buf_v = PHYS_TO_VIRT(st->buf_ph);
-    memcpy(out_buf, buf_v, (size_t)count * 512);
+    /* The submission holds one count of `pending` until every piece is out,
+     * so pieces finishing meanwhile cannot complete the request early */
+    rq->status = 0;
+    rq->submitted = 0;
+    rq->flushed = 0;
+    rq->pending = 1;
+    return 0;
+}
+
+/* Issue what is left of `rq` without waiting: its data pieces, then the
+ * flush that ends it. Returns 0 once all of it is out (the submission's
+ * hold is dropped, which may complete it), 1 when the port has no room
+ * for the next piece. */
+static int ahci_advance(volatile struct hba_port *p, struct ahci_port_state *st,
+                        struct ahci_request *rq)
+{
+    while (rq->submitted < rq->count && rq->status == 0) {
+        if (ahci_issue(p, st, rq) != 0) return 1;
+    }
 
+    /* A drive without FUA gets a flush after the data instead */
+    int flush = (rq->flags & AHCI_REQ_FLUSH) ||
+                ((rq->flags & AHCI_REQ_WRITE) && (rq->flags & AHCI_REQ_FUA) && !st->fua);
+    if (flush && !rq->flushed) {
+        if (rq->status == 0) {
+            if (ahci_issue_flush(p, st, rq) != 0) return 1;
+            rq->flushed = 1;
+        } else {
+            /* Failed already: stop holding data commands back for it */
+            uint64_t flags = spin_lock_irqsave(&st->lock);
+            st->drain = 0;
+            spin_unlock_irqrestore(&st->lock, flags);
+        }
+    }
+    ahci_release(st, rq);
     return 0;
 }
 
+int ahci_submit(uintptr_t abar, int port, struct ahci_request *rq)
+{
+    if (ahci_begin(abar, port, rq) != 0) return -1;
+    struct ahci_port_state *st = ahci_port(abar, port);
+    volatile struct hba_mem *hba = (volatile struct hba_mem*)abar;
+    volatile struct hba_port *p  = &hba->ports[port];
+    struct ahci_controller *ctrl = ahci_get_controller(abar);
+    for (;;) {
+        uint32_t seen = st->retired;
+        if (ahci_advance(p, st, rq) == 0) return 0;
+        /* Out of slots (or bounce space): wait for a command to retire */
+        ahci_wait(ctrl, p, st, port, seen);
+    }
+}
+
+int ahci_try_submit(uintptr_t abar, int port, struct ahci_request *rq)
+{
+    if (ahci_begin(abar, port, rq) != 0) return -1;
+    return ahci_resume(abar, port, rq);
+}
+
+int ahci_resume(uintptr_t abar, int port, struct ahci_request *rq)
+{
+    struct ahci_port_state *st = ahci_port(abar, port);
+    if (!st) return -1;
+    volatile struct hba_mem *hba = (volatile struct hba_mem*)abar;
+    return ahci_advance(&hba->ports[port], st, rq);
+}
+
+int ahci_queue_depth(uintptr_t abar, int port)
+{
+    struct ahci_port_state *st = ahci_port(abar, port);
+    return st ? (int)st->nslots : 0;
+}
+
+int ahci_poll(uintptr_t abar, int port)
+{
+    struct ahci_port_state *st = ahci_port(abar, port);
+    if (!st) return -1;
+    volatile struct hba_mem *hba = (volatile struct hba_mem*)abar;
+    ahci_reap(&hba->ports[port], st, port, 0);
+    return ahci_count_slots(__atomic_load_n(&st->busy, __ATOMIC_RELAXED));
+}
+
+uint32_t ahci_retired(uintptr_t abar, int port)
+{
+    struct ahci_port_state *st = ahci_port(abar, port);
+    return st ? st->retired : 0;
+}
+
+void ahci_wait_retired(uintptr_t abar, int port, uint32_t seen)
+{
+    struct ahci_port_state *st = ahci_port(abar, port);
+    if (!st) return;
+    volatile struct hba_mem *hba = (volatile struct hba_mem*)abar;
+    ahci_wait(ahci_get_controller(abar), &hba->ports[port], st, port, seen);
+}
+
+/* Submit `rq` and sleep until it completes; a port that stops making
+ * progress is reset, which fails the request */
+static int ahci_sync(uintptr_t abar, int port, struct ahci_request *rq)
+{
+    struct ahci_port_state *st = ahci_port(abar, port);
+    if (!st) return -1;
+    volatile struct hba_mem *hba = (volatile struct hba_mem*)abar;
+    volatile struct hba_port *p  = &hba->ports[port];
+
+    if (ahci_submit(abar, port, rq) != 0) return -1;
+    struct ahci_controller *ctrl = ahci_get_controller(abar);
+    for (;;) {
+        uint32_t seen = st->retired;
+        if (!rq->pending) break;
+        ahci_wait(ctrl, p, st, port, seen);
+    }
+    return rq->status;
+}
+
+int ahci_read(uintptr_t abar, int port, uint64_t lba, uint16_t count, void* out_buf, size_t out_len)
+{
+    if (!out_buf) return -1;
+    if (count == 0) return -1;
+    if (out_len < (size_t)count * 512) return -1;
+
+    struct ahci_request rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.lba = lba;
+    rq.count = count;
+    rq.buf = out_buf;
+    return ahci_sync(abar, port, &rq);
+}
+
+int ahci_write(uintptr_t abar, int port, uint64_t lba, uint16_t count, const void* buf, size_t len, int fua)
+{
+    if (!buf) return -1;
+    if (count == 0) return -1;
+    if (len < (size_t)count * 512) return -1;
+
+    struct ahci_request rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.lba = lba;
+    rq.count = count;
+    rq.buf = (void*)buf;
+    rq.flags = AHCI_REQ_WRITE | (fua ? AHCI_REQ_FUA : 0);
+    return ahci_sync(abar, port, &rq);
+}
+
+int ahci_flush(uintptr_t abar, int port)
+{
+    struct ahci_request rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.flags = AHCI_REQ_FLUSH;
+    return ahci_sync(abar, port, &rq);
+}
+
+#ifdef ENABLE_BENCH
+/* Random 4KiB reads over the first disk at rising queue depths */
+void ahci_bench(void)
+{
+    uintptr_t abar = 0;
+    int port = -1;
+    struct ahci_port_state *st = NULL;
+    for (int c = 0; c < MAX_AHCI_CONTROLLERS && port < 0; ++c) {
+        for (int i = 0; i < 32; ++i) {
+            struct ahci_port_state *s = &ahci_controllers[c].ports[i];
+            if (s->initialized && s->sectors >= 2048) {
+                abar = ahci_controllers[c].abar;
+                port = i;
+                st = s;
+                break;
+            }
+        }
+    }
+    if (port < 0) {
+        kprintf(LOG_INFO "ahci bench: no disk\n");
+        return;
+    }
+
+    /* One 4KiB buffer per request, 32 requests */
+    uint64_t phys = pmm_alloc_pages(5);
+    if (!phys) return;
+    uint8_t *base = PHYS_TO_VIRT(phys);
+
+    static const uint32_t depths[] = { 1, 4, 8, 16, 32 };
+    const uint32_t reads = 1024;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    struct ahci_request rqs[32];
+
+    kprintf(LOG_INFO "ahci bench: port %d, NCQ %s, %u slots\n", port,
+            st->ncq ? "on" : "off", st->nslots);
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+        uint32_t qd = depths[d];
+        uint32_t issued = 0, completed = 0, errors = 0;
+        memset(rqs, 0, sizeof(rqs));
+
+        uint64_t t0 = bench_rdtsc();
+        while (completed < reads) {
+            for (uint32_t i = 0; i < qd; ++i) {
+                struct ahci_request *rq = &rqs[i];
+                if (rq->pending) continue;
+                if (rq->count) {
+                    ++completed;
+                    if (rq->status) ++errors;
+                    rq->count = 0;
+                }
+                if (issued == reads) continue;
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                rq->lba = ((seed >> 16) % (st->sectors - 8)) & ~7ULL;
+                rq->count = 8;
+                rq->buf = base + (size_t)i * 4096;
+                if (ahci_submit(abar, port, rq) != 0) rq->status = -1;
+                ++issued;
+            }
+            ahci_poll(abar, port);
+        }
+        uint64_t t1 = bench_rdtsc();
+        kprintf(LOG_INFO "ahci bench: QD %2u: %llu cycles per 4KiB read (%u errors)\n", qd,
+                (unsigned long long)((t1 - t0) / reads), errors);
+    }
+    pmm_free_pages(phys, 5);
+}
+#endif
+
 void hexdump8(const void *buf, size_t len)
 {
     const uint8_t *b = (const uint8_t*)buf;
@@ -385,21 +924,24 @@ static int ahci_identify_port_internal(volatile struct hba_mem *abar, int portno
     struct ahci_port_state *st = &ctrl->ports[portno];
 
     if (!st->initialized) {
-        /* allocate persistent CLB and FIS receive buffers */
-        st->clb_ph = pmm_alloc_frame(); if (!st->clb_ph) return -1;
-        void *clb = PHYS_TO_VIRT(st->clb_ph); memset(clb, 0, 4096);
+        /* One contiguous DMA area per port: CLB, FIS receive area, command
+         * table, then the bounce buffer. HBAs without CAP.S64A need it below 4GiB. */
+        uint64_t dma_limit = (abar->cap & (1u << 31)) ? 0 : 0x100000000ULL;
+        uint64_t dma_ph = pmm_alloc_contig(AHCI_PORT_DMA_PAGES, PMM_PAGE_SIZE, dma_limit);
+        if (!dma_ph) return -1;
+        st->dma_limit = dma_limit;
+        memset(PHYS_TO_VIRT(dma_ph), 0, AHCI_PORT_DMA_PAGES * 4096);
+
+        st->clb_ph = dma_ph;
         port->clb = (uint32_t)st->clb_ph; port->clbu = (uint32_t)(st->clb_ph >> 32);
 
-        st->fb_ph = pmm_alloc_frame(); if (!st->fb_ph) return -1;
-        void *fb = PHYS_TO_VIRT(st->fb_ph); memset(fb, 0, 4096);
+        st->fb_ph = dma_ph + 0x1000;
         port->fb = (uint32_t)st->fb_ph; port->fbu = (uint32_t)(st->fb_ph >> 32);
 
-        st->ct_ph = pmm_alloc_frame(); if (!st->ct_ph) return -1;
-        void *ct = PHYS_TO_VIRT(st->ct_ph); memset(ct, 0, 4096);
-
-        st->buf_ph = pmm_alloc_frame(); if (!st->buf_ph) return -1;
-        void *buf = PHYS_TO_VIRT(st->buf_ph); memset(buf, 0, 4096);
+        st->ct_ph = dma_ph + 0x2000;
+        st->buf_ph = st->ct_ph + AHCI_CMD_SLOTS * 0x1000;
 
+        st->nslots = 1;
         st->initialized = 1;
     }
 
@@ -505,6 +1047,31 @@ static int ahci_identify_port_internal(volatile struct hba_mem *abar, int portno
 
     uint32_t word60 = id[60] | (id[61] << 16);
     uint64_t sectors = (uint64_t)word60;
+    /* Word 83 bit 10: 48-bit LBA, with the real size in words 100-103 */
+    if (id[83] & (1u << 10)) {
+        uint64_t lba48 = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                         ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+        if (lba48) sectors = lba48;
+    }
+
+    /* Queue commands when both the HBA (CAP.SNCQ) and the drive (word 76
+     * bit 8) do NCQ; the queue is as deep as the smaller of the HBA's
+     * slots (CAP.NCS) and the drive's depth (word 75) */
+    uint32_t hba_slots = ((abar->cap >> 8) & 0x1F) + 1;
+    if (sig != 0xEB140101 && (abar->cap & HBA_CAP_SNCQ) &&
+        id[76] != 0xFFFF && (id[76] & (1u << 8))) {
+        uint32_t depth = (id[75] & 0x1F) + 1u;
+        st->nslots = depth < hba_slots ? depth : hba_slots;
+        st->ncq = 1;
+        kprintf("ahci: port %d NCQ depth %u\n", portno, st->nslots);
+    }
+    st->sectors = sectors;
+
+    /* FPDMA writes always take the FUA bit; otherwise it needs WRITE DMA
+     * FUA EXT (word 84 bit 6, valid when bits 15:14 read 01). FLUSH CACHE
+     * EXT (word 83 bit 13) goes with 48-bit LBA. */
+    st->fua = st->ncq || ((id[84] & 0xC000) == 0x4000 && (id[84] & (1u << 6)));
+    st->flush_cmd = (id[83] & (1u << 13)) ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE;
 
     /* If IDENTIFY returned empty info, try ATAPI INQUIRY as a fallback (covers SATAPI) */
     if ((model[0] == '\0' || sectors == 0)) {
@@ -649,6 +1216,34 @@ int ahci_identify_port(uintptr_t abar, int port, void* out_buf, size_t out_len)
     return ahci_identify_port_internal(abarv, port, out_buf, out_len);
 }
 
+/* Route the controller's MSI to this CPU and enable completion interrupts
+ * on its ports. Without MSI completions stay polled: PCI INTx is level-
+ * triggered and active-low, and which GSI a line lands on needs the ACPI
+ * routing tables, which are not parsed here; interrupts_set_handler would
+ * program the pin edge-triggered and active-high. */
+static void ahci_setup_irq(struct pci_device *dev, struct ahci_controller *ctrl)
+{
+    volatile struct hba_mem *hba = (volatile struct hba_mem*)ctrl->abar;
+    if (!pci_find_capability(dev, PCI_CAP_MSI)) {
+        kprintf("ahci: no MSI, completions are polled\n");
+        return;
+    }
+    uint8_t vec = interrupts_alloc_vec();
+    ctrl->irq_apic = apic_get_id();
+    interrupts_set_handler(vec, ahci_isr);
+    pci_enable_msi(dev, vec, ctrl->irq_apic);
+
+    for (int i = 0; i < 32; ++i) {
+        if (!ctrl->ports[i].initialized) continue;
+        hba->ports[i].is = 0xFFFFFFFFu;
+        hba->ports[i].ie = HBA_PxIE_MASK;
+    }
+    hba->is = 0xFFFFFFFFu;
+    ctrl->vector = vec;
+    hba->ghc |= HBA_GHC_IE;
+    kprintf("ahci: completions on vector %u (MSI)\n", vec);
+}
+
 int ahci_attach(struct pci_device *dev)
 {
     if (!dev) return -1;
@@ -672,5 +1267,8 @@ int ahci_attach(struct pci_device *dev)
         }
     }
 
+    struct ahci_controller *ctrl = ahci_get_controller((uintptr_t)abarv);
+    if (ctrl && !ctrl->vector) ahci_setup_irq(dev, ctrl);
+
     return 0;
 }
\ No newline at end of file
@@ -1,12 +1,14 @@
 #include <common/boot.h>
 #include <kernel/kprintf.h>
 #include <lib/string.h>
+#include <lib/arena.h>
 #include <stddef.h>
 
 /* strdup is defined in lib/string.c */
 char *strdup(const char *s);
 
-char *cmdline_get(const char *src)
+/* Value of `src` copied into `a`, or onto the heap when `a` is NULL */
+static char *cmdline_copy(struct arena *a, const char *src)
 {
     const char* cmd_line = TitanBootInfo.cmdline;
     if (!cmd_line) {
@@ -26,9 +28,19 @@ char *cmdline_get(const char *src)
             }
             value[i] = '\0';
             kprintf("Command '%s' value: %s\n", src, value);
-            return strdup(value);
+            return a ? arena_strdup(a, value) : strdup(value);
         }
         while (*p && *p != ' ') p++;
     }
     return NULL;
 }
+
+char *cmdline_get(const char *src)
+{
+    return cmdline_copy(NULL, src);
+}
+
+char *cmdline_get_arena(struct arena *a, const char *src)
+{
+    return a ? cmdline_copy(a, src) : NULL;
+}
@@ -54,10 +54,18 @@ int_stub%+%1:
     
     ; Align stack to 16 bytes
     and rsp, ~0xF
-    sub rsp, 8
-    
+
+    ; Handlers may use SSE (mem*, compiler code): keep the interrupted
+    ; code's XMM state
+    sub rsp, 512
+    fxsave64 [rsp]
+
+    ; RSP is 16-byte aligned here, so the handler is entered with the
+    ; RSP = 8 (mod 16) the ABI expects
     call interrupts_handle_int
     
+    fxrstor64 [rsp]
+
     ; Restore original stack pointer
     mov rsp, rbp
     
@@ -426,44 +426,8 @@ static int probe_rtl8139(struct pci_device* dev)
         /* Allocate contiguous RX buffer (8K+16+1500 for safety) */
         const size_t rx_size = 8192 + 16 + 1500;
         int pages = (rx_size + 4095) / 4096;
-        uint64_t phys_base = 0;
-        
-        for (int attempt = 0; attempt < 200; ++attempt) {
-            uint64_t frames[16];
-            if (pages > 16) break;
-            
-            bool ok = true;
-            for (int i = 0; i < pages; ++i) {
-                frames[i] = pmm_alloc_frame();
-                if (!frames[i]) {
-                    ok = false;
-                    break;
-                }
-            }
-            
-            if (!ok) {
-                for (int i = 0; i < pages; ++i) {
-                    if (frames[i]) pmm_free_frame(frames[i]);
-                }
-                continue;
-            }
-            
-            /* Check contiguity */
-            for (int i = 1; i < pages; ++i) {
-                if (frames[i] != frames[i-1] + 4096) {
-                    ok = false;
-                    break;
-                }
-            }
-            
-            if (!ok) {
-                for (int i = 0; i < pages; ++i) pmm_free_frame(frames[i]);
-                continue;
-            }
-            
-            phys_base = frames[0];
-            break;
-        }
+        /* RBSTART is 32 bits wide: the ring must sit below 4GiB */
+        uint64_t phys_base = pmm_alloc_contig(pages, PMM_PAGE_SIZE, 0x100000000ULL);
         
         if (!phys_base) {
             kprintf(LOG_ERROR "rtl8139: failed to allocate contiguous RX buffer\n");
@@ -531,43 +495,8 @@ static int probe_rtl8139(struct pci_device* dev)
         /* Allocate contiguous RX buffer */
         const size_t rx_size = 8192 + 16 + 1500;
         int pages = (rx_size + 4095) / 4096;
-        uint64_t phys_base = 0;
-        
-        for (int attempt = 0; attempt < 200; ++attempt) {
-            uint64_t frames[16];
-            if (pages > 16) break;
-            
-            bool ok = true;
-            for (int i = 0; i < pages; ++i) {
-                frames[i] = pmm_alloc_frame();
-                if (!frames[i]) {
-                    ok = false;
-                    break;
-                }
-            }
-            
-            if (!ok) {
-                for (int i = 0; i < pages; ++i) {
-                    if (frames[i]) pmm_free_frame(frames[i]);
-                }
-                continue;
-            }
-            
-            for (int i = 1; i < pages; ++i) {
-                if (frames[i] != frames[i-1] + 4096) {
-                    ok = false;
-                    break;
-                }
-            }
-            
-            if (!ok) {
-                for (int i = 0; i < pages; ++i) pmm_free_frame(frames[i]);
-                continue;
-            }
-            
-            phys_base = frames[0];
-            break;
-        }
+        /* RBSTART is 32 bits wide: the ring must sit below 4GiB */
+        uint64_t phys_base = pmm_alloc_contig(pages, PMM_PAGE_SIZE, 0x100000000ULL);
         
         if (!phys_base) {
             kprintf(LOG_ERROR "rtl8139: failed to allocate contiguous RX buffer\n");
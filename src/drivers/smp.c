@@ -10,11 +10,89 @@
 /* enable_sse() is defined in entry.c; declare here for per-AP setup */
 extern void enable_sse(void);
 
+/* LAPIC ID -> index into TitanBootInfo.smp_cpus, so per-CPU data can be found
+ * with a single LAPIC ID read */
+static uint16_t smp_apic_index[MAX_CPUS];
+static volatile bool smp_index_ready = false;
+
+/* Faster still: each CPU stores its index in IA32_TSC_AUX, which RDPID (or
+ * RDTSCP) reads without touching the LAPIC. The tag tells a programmed value
+ * from whatever firmware left there. */
+#define MSR_TSC_AUX     0xC0000103
+#define SMP_AUX_TAG     0x5A000000u
+#define SMP_AUX_MASK    0xFF000000u
+
+enum { SMP_AUX_NONE, SMP_AUX_RDTSCP, SMP_AUX_RDPID };
+static int smp_aux_mode = SMP_AUX_NONE;
+
+static uint32_t smp_index_from_apic(void)
+{
+    uint32_t lapic = apic_get_id();
+    if (lapic < MAX_CPUS) return smp_apic_index[lapic];
+    for (uint32_t i = 0; i < TitanBootInfo.smp_info.cpu_count; ++i) {
+        if (TitanBootInfo.smp_cpus[i].apic_id == lapic) return i;
+    }
+    return 0;
+}
+
+void smp_cpu_local_init(void)
+{
+    if (!smp_index_ready || smp_aux_mode == SMP_AUX_NONE) return;
+    uint32_t aux = SMP_AUX_TAG | smp_index_from_apic();
+    __asm__ volatile ("wrmsr" :: "c"(MSR_TSC_AUX), "a"(aux), "d"(0));
+}
+
+void smp_index_init(void)
+{
+    for (uint32_t i = 0; i < TitanBootInfo.smp_info.cpu_count; ++i) {
+        uint32_t id = TitanBootInfo.smp_cpus[i].apic_id;
+        if (id < MAX_CPUS) smp_apic_index[id] = (uint16_t)i;
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    uint32_t max_leaf = eax;
+    if (max_leaf >= 7) {
+        __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+        if (ecx & (1u << 22)) smp_aux_mode = SMP_AUX_RDPID;
+    }
+    if (smp_aux_mode == SMP_AUX_NONE) {
+        __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000), "c"(0));
+        if (eax >= 0x80000001) {
+            __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+            if (edx & (1u << 27)) smp_aux_mode = SMP_AUX_RDTSCP;
+        }
+    }
+
+    smp_index_ready = true;
+    smp_cpu_local_init();
+}
+
+uint32_t smp_cpu_index(void)
+{
+    if (!smp_index_ready) return 0;
+
+    uint64_t aux = 0;
+    if (smp_aux_mode == SMP_AUX_RDPID) {
+        __asm__ volatile ("rdpid %0" : "=r"(aux));
+    } else if (smp_aux_mode == SMP_AUX_RDTSCP) {
+        uint32_t lo, hi, c;
+        __asm__ volatile ("rdtscp" : "=a"(lo), "=d"(hi), "=c"(c));
+        aux = c;
+    }
+    if (((uint32_t)aux & SMP_AUX_MASK) == SMP_AUX_TAG) return (uint32_t)aux & ~SMP_AUX_MASK;
+
+    /* This CPU has not run smp_cpu_local_init() yet */
+    return smp_index_from_apic();
+}
+
 /* AP entrypoint called from trampoline. It will look up this CPU's mp_info by
  * LAPIC ID and invoke the configured `goto_address` with the provided argument.
  */
 void ap_entry(void)
 {
+    /* First: mem* and printf use SSE registers */
+    enable_sse();
     uint32_t lapic = apic_get_id();
 
     /* Signal that we reached AP entry (increment counter) */
@@ -32,9 +110,7 @@ void ap_entry(void)
 
         kprintf(LOG_INFO "AP: found MP info at index %u\n", i);
 
-        /* Perform minimal per-CPU setup: enable SSE, initialize GDT/IDT for this CPU */
-        enable_sse();
-
+        /* Perform minimal per-CPU setup: initialize GDT/IDT for this CPU */
         /* If processor_id is valid, initialize GDT/TSS for this CPU index */
         if (info->processor_id < MAX_CPUS) {
             gdt_init(info->processor_id);
@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <common/multiboot2.h>
 #include <common/boot.h>
+#include <lib/string.h>
 boot_t TitanBootInfo;
 
 extern char _kernel_phys_start[];
@@ -39,6 +40,7 @@ void _start(uint64_t mb_addr, uint64_t hhdm_base) {
     TitanBootInfo.mb2_addr  = mb_addr;
     TitanBootInfo.hhdm_base = hhdm_base;
     enable_sse();
+    string_init();
     uint32_t total_size = *(uint32_t*)mb_addr;
         struct multiboot_tag_framebuffer* fb_tag = NULL;
 
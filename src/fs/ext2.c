@@ -4,6 +4,7 @@
 #include <lib/string.h>
 #include <kernel/kprintf.h>
 #include <lib/alloc.h>
+#include <mem/slab.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -64,24 +65,28 @@ struct ext2_inode {
 
 struct ext2_fs {
     char devname[16];
+    struct block_dev *dev;      /* opened once at mount */
     struct ext2_super sb;
     uint32_t block_size;
     uint32_t inode_size;
     uint32_t inode_table_block;
 };
 
-static int read_sectors_from_dev(const char *dev, uint64_t lba, uint16_t count, void *buf, size_t len)
-{
-    return block_read(dev, lba, count, buf, len);
-}
+/* Per-open state behind a vfs_fh, in an exact-size cache */
+struct ext2_file {
+    struct ext2_inode ino;
+    struct ext2_fs *fs;
+};
 
-static int ext2_read_block(const char *dev, uint32_t block_no, void *buf, size_t buf_len, uint32_t block_size)
+static struct kmem_cache *file_cache = NULL;
+
+static int ext2_read_block(struct ext2_fs *fs, uint32_t block_no, void *buf, size_t buf_len)
 {
-    uint64_t lba = (uint64_t)block_no * (block_size / 512);
-    uint16_t cnt = (uint16_t)(block_size / 512);
-    int r = read_sectors_from_dev(dev, lba, cnt, buf, buf_len);
+    uint64_t lba = (uint64_t)block_no * (fs->block_size / 512);
+    uint32_t cnt = fs->block_size / 512;
+    int r = block_read(fs->dev, lba, cnt, buf, buf_len);
     if (r != 0) {
-        klog(0, "ext2: ext2_read_block failed dev=%s block_no=%u lba=%llu cnt=%u err=%d\n", dev, (unsigned)block_no, (unsigned long long)lba, (unsigned)cnt, r);
+        klog(0, "ext2: ext2_read_block failed dev=%s block_no=%u lba=%llu cnt=%u err=%d\n", fs->devname, (unsigned)block_no, (unsigned long long)lba, (unsigned)cnt, r);
         return r;
     }
     return 0;
@@ -93,13 +98,17 @@ static int ext2_read_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *
 static void *ext2_mount(void *mount_data)
 {
     const char *dev = (const char*)mount_data;
+    if (!file_cache) file_cache = kmem_cache_create("ext2_file", sizeof(struct ext2_file), 0, NULL);
+    if (!file_cache) return NULL;
     struct ext2_fs *fs = kmalloc(sizeof(*fs));
     if (!fs) return NULL;
     size_t i = 0; for (; i + 1 < sizeof(fs->devname) && dev[i]; ++i) fs->devname[i] = dev[i]; fs->devname[i] = '\0';
+    fs->dev = block_open(dev);
+    if (!fs->dev) { kfree(fs); return NULL; }
 
     uint8_t buf[1024*2]; /* enough for superblock + more */
     /* superblock at offset 1024 bytes -> sector 2 (assuming 512-byte sectors) */
-    int r = read_sectors_from_dev(dev, 2, 2, buf, sizeof(buf));
+    int r = block_read(fs->dev, 2, 2, buf, sizeof(buf));
     if (r != 0) {
         klog(0, "ext2: failed to read superblock from %s (err=%d)\n", dev, r);
         kfree(fs);
@@ -123,7 +132,7 @@ static void *ext2_mount(void *mount_data)
     klog(1, "ext2: block_size=%u s_log_block_size=%u gd_block=%u\n", fs->block_size, (unsigned)sb->s_log_block_size, gd_block);
     uint8_t *gd = kmalloc(fs->block_size);
     if (!gd) { klog(0, "ext2: out of memory for group descriptor\n"); kfree(fs); return NULL; }
-    int r2 = ext2_read_block(dev, gd_block, gd, fs->block_size, fs->block_size);
+    int r2 = ext2_read_block(fs, gd_block, gd, fs->block_size);
     if (r2 != 0) {
         klog(0, "ext2: failed to read group descriptor (err=%d)\n", r2);
         kfree(gd);
@@ -173,7 +182,7 @@ static int ext2_read_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *
     uint32_t gd_block_off = (uint32_t)(gd_offset_bytes % fs->block_size);
 
     uint8_t gdbuf[4096];
-    if (ext2_read_block(fs->devname, gd_blockno, gdbuf, sizeof(gdbuf), fs->block_size) != 0) {
+    if (ext2_read_block(fs, gd_blockno, gdbuf, sizeof(gdbuf)) != 0) {
         klog(0, "ext2: failed to read group descriptor for group=%u\n", group);
         return -1;
     }
@@ -183,7 +192,7 @@ static int ext2_read_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *
     uint32_t block = inode_table + (local_index / inodes_per_block);
     uint32_t offset = (local_index % inodes_per_block) * fs->inode_size;
     uint8_t blockbuf[4096];
-    if (ext2_read_block(fs->devname, block, blockbuf, sizeof(blockbuf), fs->block_size) != 0) return -1;
+    if (ext2_read_block(fs, block, blockbuf, sizeof(blockbuf)) != 0) return -1;
     memcpy(out, blockbuf + offset, sizeof(*out));
 
     /* Diagnostic: print key inode fields */
@@ -198,12 +207,14 @@ static int ext2_read_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *
 /* find entry in directory inode by name, return inode number or 0 */
 static uint32_t ext2_find_in_dir(struct ext2_fs *fs, struct ext2_inode *dir, const char *name)
 {
+    /* Entries carry their name length: compare that before any bytes */
+    size_t want = strlen(name);
     /* iterate direct blocks only for simplicity */
     for (int i = 0; i < 12; ++i) {
         if (dir->i_block[i] == 0) continue;
         klog(1, "ext2: scanning dir block %d (blk=%u) for '%s'\n", i, dir->i_block[i], name);
         uint8_t blk[4096];
-        if (ext2_read_block(fs->devname, dir->i_block[i], blk, sizeof(blk), fs->block_size) != 0) {
+        if (ext2_read_block(fs, dir->i_block[i], blk, sizeof(blk)) != 0) {
             klog(0, "ext2: failed to read dir block %u\n", dir->i_block[i]);
             continue;
         }
@@ -213,16 +224,14 @@ static uint32_t ext2_find_in_dir(struct ext2_fs *fs, struct ext2_inode *dir, con
             uint16_t rec_len = *((uint16_t*)(blk + off + 4));
             size_t name_len = (size_t)*(uint8_t*)(blk + off + 6);
             if (!inode) break;
-            if (rec_len == 0 || rec_len > fs->block_size) {
+            if (rec_len < 8 || rec_len > fs->block_size) {
                 klog(0, "ext2: invalid rec_len=%u at offset=%u, aborting\n", (unsigned)rec_len, off);
                 break;
             }
-            if (name_len >= 256) name_len = 255;
-            char entry_name[256];
-            memcpy(entry_name, blk + off + 8, name_len);
-            entry_name[name_len] = '\0';
-            klog(1, "ext2: dir entry ino=%u rec=%u name_len=%zu name=%s\n", inode, (unsigned)rec_len, name_len, entry_name);
-            if (strcmp(entry_name, name) == 0) return inode;
+            if (name_len > (size_t)rec_len - 8) name_len = (size_t)rec_len - 8;
+            const char *entry_name = (const char*)(blk + off + 8);
+            klog(1, "ext2: dir entry ino=%u rec=%u name_len=%zu name=%.*s\n", inode, (unsigned)rec_len, name_len, (int)name_len, entry_name);
+            if (name_len == want && memcmp(entry_name, name, want) == 0) return inode;
             off += rec_len;
             if (rec_len == 0) break;
         }
@@ -263,11 +272,11 @@ static void *ext2_open(void *fs, const char *path, size_t *out_size)
     }
 
     /* Build file handle */
-    struct vfs_fh *h = kmalloc(sizeof(*h));
+    struct vfs_fh *h = vfs_fh_alloc();
     if (!h) return NULL;
     /* store inode pointer data in ctx by allocating a small struct */
-    struct { struct ext2_inode ino; struct ext2_fs *fs; } *ctx = kmalloc(sizeof(*ctx));
-    if (!ctx) { kfree(h); return NULL; }
+    struct ext2_file *ctx = kmem_cache_alloc(file_cache);
+    if (!ctx) { vfs_fh_free(h); return NULL; }
     ctx->ino = inode; ctx->fs = efs;
     h->ctx = ctx;
     h->read = ext2_file_read;
@@ -279,32 +288,98 @@ static void *ext2_open(void *fs, const char *path, size_t *out_size)
 /* lambdas not supported; implement wrapper read/close - but for simplicity, we'll instead define static wrappers using function pointers above. */
 
 /* For C, replace lambdas with static functions: */
+/* One run of physically consecutive blocks of a read. Runs covering whole
+ * blocks land in the caller's buffer; a partial first or last block goes
+ * through `bounce`. */
+struct ext2_run {
+    struct bio bio;
+    struct block_seg seg;
+    uint8_t *bounce;
+    uint8_t *dst;
+    size_t skip;          /* bytes of the bounce block before the data */
+    size_t len;           /* bytes of the caller's buffer covered */
+};
+
 static ssize_t ext2_file_read(void *ctxp, void *buf, size_t offset, size_t len)
 {
-    struct { struct ext2_inode ino; struct ext2_fs *fs; } *c = ctxp;
+    struct ext2_file *c = ctxp;
     size_t total = c->ino.i_size;
     if (offset >= total) return 0;
     if (offset + len > total) len = total - offset;
-    size_t copied = 0;
     uint32_t blocksize = c->fs->block_size;
-    while (copied < len) {
-        uint32_t block_index = (offset + copied) / blocksize;
-        uint32_t block_off = (offset + copied) % blocksize;
+
+    /* Submit every block up front and merge neighbours, so the disk has the
+     * whole read queued at once instead of one block at a time */
+    struct ext2_run runs[12];
+    int nruns = 0;
+    size_t pos = 0;
+    uint32_t next_blk = 0;
+    while (pos < len) {
+        uint32_t block_index = (offset + pos) / blocksize;
+        uint32_t block_off = (offset + pos) % blocksize;
         if (block_index >= 12) break; /* not handling indirection */
         uint32_t blk = c->ino.i_block[block_index];
         if (!blk) break;
-        uint8_t blockbuf[4096];
-        if (ext2_read_block(c->fs->devname, blk, blockbuf, sizeof(blockbuf), blocksize) != 0) break;
-        size_t to_copy = blocksize - block_off;
-        if (to_copy > len - copied) to_copy = len - copied;
-        memcpy((uint8_t*)buf + copied, blockbuf + block_off, to_copy);
-        copied += to_copy;
+        size_t n = blocksize - block_off;
+        if (n > len - pos) n = len - pos;
+        int whole = n == blocksize;
+
+        struct ext2_run *prev = nruns ? &runs[nruns - 1] : NULL;
+        if (whole && prev && !prev->bounce && blk == next_blk) {
+            prev->bio.count += blocksize / 512;
+            prev->seg.len += blocksize;
+            prev->len += n;
+        } else {
+            struct ext2_run *r = &runs[nruns];
+            memset(r, 0, sizeof(*r));
+            r->dst = (uint8_t*)buf + pos;
+            r->len = n;
+            if (!whole) {
+                r->bounce = kmalloc(blocksize);
+                if (!r->bounce) break;
+                r->skip = block_off;
+            }
+            r->seg.buf = whole ? r->dst : r->bounce;
+            r->seg.len = blocksize;
+            r->bio.dev = c->fs->dev;
+            r->bio.lba = (uint64_t)blk * (blocksize / 512);
+            r->bio.count = blocksize / 512;
+            r->bio.segs = &r->seg;
+            r->bio.nsegs = 1;
+            ++nruns;
+        }
+        next_blk = blk + 1;
+        pos += n;
+    }
+
+    for (int i = 0; i < nruns; ++i) {
+        if (block_submit(&runs[i].bio) != 0) {
+            runs[i].bio.status = -1;
+            runs[i].bio.completed = 1;
+        }
+    }
+
+    /* The read stops at the first run that failed */
+    size_t copied = 0;
+    int ok = 1;
+    for (int i = 0; i < nruns; ++i) {
+        struct ext2_run *r = &runs[i];
+        int st = block_wait(&r->bio);
+        if (ok && st != 0) {
+            klog(0, "ext2: read failed dev=%s lba=%llu err=%d\n", c->fs->devname, (unsigned long long)r->bio.lba, st);
+            ok = 0;
+        }
+        if (ok) {
+            if (r->bounce) memcpy(r->dst, r->bounce + r->skip, r->len);
+            copied += r->len;
+        }
+        if (r->bounce) kfree(r->bounce);
     }
     return (ssize_t)copied;
 }
 static void ext2_file_close(void *ctxp)
 {
-    kfree(ctxp);
+    kmem_cache_free(file_cache, ctxp);
 }
 
 static struct vfs_ops ext2_ops = {
@@ -3,27 +3,38 @@
 #include <fs/ext2.h>
 #include <lib/string.h>
 #include <kernel/kprintf.h>
-#include <lib/alloc.h>
+#include <lib/arena.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#define FSTAB_DIAG_READ 1024
+
 /* Very small fstab parser: reads file into a buffer and parses lines
  * Format supported: <device> <mountpoint> <fstype> [options ...]
+ * Buffers come from `scratch`, sized to the file.
  */
-int fstab_parse_and_mount(const char *path)
+static int fstab_parse(struct arena *scratch, const char *path)
 {
-    char buf[4096];
-    ssize_t r = vfs_read_all(path, buf, sizeof(buf));
+    size_t fsz = 0;
+    void *fh = vfs_open(path, &fsz);
+    ssize_t r = -1;
+    char *buf = NULL;
+    if (fh) {
+        size_t cap = fsz ? fsz : 4096;
+        buf = arena_alloc(scratch, cap + 1);
+        r = buf ? vfs_read(fh, buf, 0, cap) : -1;
+        vfs_close(fh);
+    }
     if (r < 0) {
         klog(1, "fstab: no %s found (skipping)\n", path);
         /* Diagnostic: check /etc directory presence and list entries */
-        char dblk[1024];
+        char *dblk = arena_alloc(scratch, FSTAB_DIAG_READ);
         size_t dsz = 0;
         void *dh = vfs_open("/etc", &dsz);
-        if (!dh) {
+        if (!dh || !dblk) {
             klog(1, "fstab: vfs_open(/etc) failed - /etc not found on root fs\n");
         } else {
-            ssize_t dr = vfs_read(dh, dblk, 0, sizeof(dblk));
+            ssize_t dr = vfs_read(dh, dblk, 0, FSTAB_DIAG_READ);
             klog(1, "fstab: /etc inode size=%zu bytes, read=%d\n", dsz, (int)dr);
             if (dr > 0) {
                 size_t off = 0;
@@ -45,14 +56,12 @@ int fstab_parse_and_mount(const char *path)
                     if (rec == 0) break;
                 }
             }
-            vfs_close(dh);
         }
+        if (dh) vfs_close(dh);
         return -1;
     }
-    size_t len = (size_t)r;
     /* ensure NUL-termination for parsing simplicity */
-    if (len >= sizeof(buf)) len = sizeof(buf) - 1;
-    buf[len] = '\0';
+    buf[r] = '\0';
 
     char *p = buf;
     while (p && *p) {
@@ -108,3 +117,12 @@ int fstab_parse_and_mount(const char *path)
 
     return 0;
 }
+
+int fstab_parse_and_mount(const char *path)
+{
+    struct arena *scratch = arena_create(0);
+    if (!scratch) return -1;
+    int ret = fstab_parse(scratch, path);
+    arena_destroy(scratch);
+    return ret;
+}
@@ -1,7 +1,7 @@
 #include <fs/ustar.h>
 #include <fs/vfs.h>
 #include <lib/string.h>
-#include <lib/alloc.h>
+#include <lib/arena.h>
 #include <kernel/kprintf.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -12,15 +12,24 @@
 
 struct ustar_entry {
     char *name;
+    uint32_t hash;               /* strhash(name) */
     void *data;
     size_t size;
     struct ustar_entry *next;
+    struct ustar_entry *hnext;   /* bucket chain */
 };
 
+/* The mount, its entries and their names all live in one arena: entries are
+ * packed together that way, and unmount frees the lot at once. Opens look
+ * names up in a hash table sized to the entry count once the archive has
+ * been scanned. */
 struct ustar_fs {
     void *base;
     size_t size;
     struct ustar_entry *entries;
+    struct ustar_entry **buckets;
+    uint32_t nbuckets;           /* power of two */
+    struct arena *arena;
 };
 
 /* Header layout: 512-byte ustar header */
@@ -72,9 +81,10 @@ static void *ustar_open(void *fs, const char *path, size_t *out_size)
 {
     struct ustar_fs *u = fs;
     if (path[0] == '/') path++;
-    for (struct ustar_entry *e = u->entries; e; e = e->next) {
-        if (strcmp(e->name, path) == 0) {
-            struct vfs_fh *h = kmalloc(sizeof(*h));
+    uint32_t h = strhash(path);
+    for (struct ustar_entry *e = u->buckets[h & (u->nbuckets - 1)]; e; e = e->hnext) {
+        if (e->hash == h && strcmp(e->name, path) == 0) {
+            struct vfs_fh *h = vfs_fh_alloc();
             if (!h) return NULL;
             h->read = ustar_file_read;
             h->close = ustar_file_close;
@@ -92,58 +102,69 @@ static void *ustar_mount(void *mount_data)
     void *base = args[0];
     size_t size = (size_t)args[1];
 
-    struct ustar_fs *u = kmalloc(sizeof(*u));
-    if (!u) return NULL;
+    struct arena *ar = arena_create(0);
+    struct ustar_fs *u = arena_alloc(ar, sizeof(*u));
+    if (!u) {
+        arena_destroy(ar);
+        return NULL;
+    }
     u->base = base;
     u->size = size;
     u->entries = NULL;
+    u->arena = ar;
+    size_t count = 0;
 
     size_t off = 0;
     while (off + 512 <= size) {
         struct ustar_hdr *h = (struct ustar_hdr*)((uint8_t*)base + off);
         if (h->name[0] == '\0') break; /* end */
         size_t fsz = oct_to_size(h->size, sizeof(h->size));
-        char *name = strdup(h->name);
-        /* normalize names: strip leading './' or '/' */
-        if (name) {
-            if (name[0] == '/') {
-                /* shift left */
-                size_t l = strlen(name);
-                memmove(name, name+1, l);
-            } else if (name[0] == '.' && name[1] == '/') {
-                size_t l = strlen(name);
-                memmove(name, name+2, l-1);
-            }
-        }
         if (h->typeflag == '0' || h->typeflag == '\0') {
-            struct ustar_entry *e = kmalloc(sizeof(*e));
-            e->name = name;
+            /* normalize names: strip leading './' or '/' */
+            const char *name = h->name;
+            if (name[0] == '/') name += 1;
+            else if (name[0] == '.' && name[1] == '/') name += 2;
+
+            struct ustar_entry *e = arena_alloc(ar, sizeof(*e));
+            if (e) e->name = arena_strdup(ar, name);
+            if (!e || !e->name) break;
+            e->hash = strhash(e->name);
             e->data = (uint8_t*)base + off + 512;
             e->size = fsz;
             e->next = u->entries;
             u->entries = e;
+            ++count;
             kprintf("ustar: found %s size=%zu\n", e->name, fsz);
-        } else {
-            if (name) kfree(name);
         }
         /* advance by header+data rounded up to 512 */
         size_t blocks = (fsz + 511) / 512;
         off += 512 + blocks * 512;
     }
+
+    /* At most two entries per bucket on average */
+    u->nbuckets = 16;
+    while (u->nbuckets < count / 2) u->nbuckets <<= 1;
+    u->buckets = arena_alloc(ar, u->nbuckets * sizeof(*u->buckets));
+    if (!u->buckets) {
+        arena_destroy(ar);
+        return NULL;
+    }
+    memset(u->buckets, 0, u->nbuckets * sizeof(*u->buckets));
+    /* Entries run newest first; append so a name stored twice still
+     * resolves to its later copy */
+    for (struct ustar_entry *e = u->entries; e; e = e->next) {
+        struct ustar_entry **b = &u->buckets[e->hash & (u->nbuckets - 1)];
+        while (*b) b = &(*b)->hnext;
+        e->hnext = NULL;
+        *b = e;
+    }
     return u;
 }
 
 static void ustar_unmount(void *fs)
 {
     struct ustar_fs *u = fs;
-    struct ustar_entry *e = u->entries;
-    while (e) {
-        struct ustar_entry *n = e->next;
-        kfree(e->name);
-        kfree(e);
-        e = n;
-    }
-    kfree(u);
+    arena_destroy(u->arena);
 }
 
 /* Export vfs_ops */
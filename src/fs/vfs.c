@@ -2,6 +2,7 @@
 #include <lib/string.h>
 #include <kernel/kprintf.h>
 #include <lib/alloc.h>
+#include <mem/slab.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -9,11 +10,37 @@
 
 struct mount_entry {
     char mount_point[32];
+    size_t len;
+    uint32_t hash;   /* strhash(mount_point) */
     struct vfs_ops *ops;
     void *fs;
 };
 
 static struct mount_entry mounts[MAX_MOUNTS];
+static uint32_t mount_lens;   /* bit k: some mount point is k bytes long */
+
+static void update_mount_lens(void)
+{
+    mount_lens = 0;
+    for (int i = 0; i < MAX_MOUNTS; ++i) {
+        if (mounts[i].ops) mount_lens |= 1u << mounts[i].len;
+    }
+}
+
+/* Handles are opened and closed constantly: keep them in an exact-size cache */
+static struct kmem_cache *fh_cache = NULL;
+
+struct vfs_fh *vfs_fh_alloc(void)
+{
+    if (!fh_cache) fh_cache = kmem_cache_create("vfs_fh", sizeof(struct vfs_fh), 0, NULL);
+    if (!fh_cache) return NULL;
+    return kmem_cache_alloc(fh_cache);
+}
+
+void vfs_fh_free(struct vfs_fh *h)
+{
+    if (h) kmem_cache_free(fh_cache, h);
+}
 
 int vfs_mount(const char *path, struct vfs_ops *ops, void *mount_data)
 {
@@ -24,11 +51,14 @@ int vfs_mount(const char *path, struct vfs_ops *ops, void *mount_data)
             size_t j = 0;
             for (; j + 1 < n && path[j]; ++j) mounts[i].mount_point[j] = path[j];
             mounts[i].mount_point[j] = '\0';
+            mounts[i].len = j;
+            mounts[i].hash = memhash(mounts[i].mount_point, j);
             /* attempt mount first */
             void *fs = ops->mount ? ops->mount(mount_data) : mount_data;
             if (!fs) return -1;
             mounts[i].ops = ops;
             mounts[i].fs = fs;
+            update_mount_lens();
                     klog(1, "vfs: mounted %s\n", mounts[i].mount_point);
             return 0;
         }
@@ -38,13 +68,15 @@ int vfs_mount(const char *path, struct vfs_ops *ops, void *mount_data)
 
 int vfs_unmount(const char *path)
 {
+    uint32_t h = strhash(path);
     for (int i = 0; i < MAX_MOUNTS; ++i) {
-        if (mounts[i].ops && strcmp(mounts[i].mount_point, path) == 0) {
+        if (mounts[i].ops && mounts[i].hash == h && strcmp(mounts[i].mount_point, path) == 0) {
             if (mounts[i].ops->unmount) mounts[i].ops->unmount(mounts[i].fs);
             klog(1, "vfs: unmounted %s\n", mounts[i].mount_point);
             mounts[i].ops = NULL;
             mounts[i].fs = NULL;
             mounts[i].mount_point[0] = '\0';
+            update_mount_lens();
             return 0;
         }
     }
@@ -56,12 +88,23 @@ int vfs_list_dir(const char *path)
     void *fh = vfs_open(path, &sz);
     if (!fh) return -1;
 
-    /* Read the full directory blob (size may be 0 for empty dirs) */
+    /* Read the full directory blob (size may be 0 for empty dirs, or when the fs does not know it) */
     size_t buf_len = sz ? sz : 4096;
     uint8_t *buf = kmalloc(buf_len);
     if (!buf) { vfs_close(fh); return -1; }
 
     ssize_t r = vfs_read(fh, buf, 0, buf_len);
+
+    /* Size unknown: keep growing while reads fill the buffer */
+    while (!sz && r == (ssize_t)buf_len) {
+        uint8_t *nb = krealloc(buf, buf_len * 2);
+        if (!nb) break;
+        buf = nb;
+        ssize_t more = vfs_read(fh, buf + buf_len, buf_len, buf_len);
+        buf_len *= 2;
+        if (more <= 0) break;
+        r += more;
+    }
     if (r <= 0) {
         kprintf("vfs: %s appears empty or unreadable (r=%d)\n", path, (int)r);
         kfree(buf);
@@ -91,18 +134,23 @@ int vfs_list_dir(const char *path)
     vfs_close(fh);
     return count;
 }
-/* Find best mount by prefix match */
+/* Find best mount by prefix match. The path is hashed once, a byte at a
+ * time: after k bytes h is the hash of its k-byte prefix, which a k-byte
+ * mount point has to match. Lengths no mount has are skipped. */
 static struct mount_entry *find_mount(const char *path, const char **rel)
 {
     struct mount_entry *best = NULL;
     size_t best_len = 0;
-    for (int i = 0; i < MAX_MOUNTS; ++i) {
-        if (!mounts[i].ops) continue;
-        const char *mp = mounts[i].mount_point;
-        size_t l = strlen(mp);
-        if (l > best_len && strncmp(path, mp, l) == 0) {
-            best = &mounts[i];
-            best_len = l;
+    uint32_t h = STRHASH_INIT;
+    for (size_t k = 1; k < sizeof(mounts[0].mount_point) && path[k - 1]; ++k) {
+        h = strhash_step(h, (uint8_t)path[k - 1]);
+        if (!(mount_lens & (1u << k))) continue;
+        for (int i = 0; i < MAX_MOUNTS; ++i) {
+            struct mount_entry *m = &mounts[i];
+            if (m->ops && m->len == k && m->hash == h && memcmp(path, m->mount_point, k) == 0) {
+                best = m;
+                best_len = k;
+            }
         }
     }
     if (best) {
@@ -134,7 +182,7 @@ void vfs_close(void *fh)
     if (!fh) return;
     struct vfs_fh *h = (struct vfs_fh*)fh;
     if (h->close) h->close(h->ctx);
-    kfree(h);
+    vfs_fh_free(h);
 }
 
 /* FD table (simple global table) */
@@ -0,0 +1,16 @@
+#include <kernel/bench.h>
+#include <kernel/kprintf.h>
+#include <lib/alloc.h>
+
+#ifdef ENABLE_BENCH
+void bench_run(void)
+{
+    kprintf(LOG_INFO "bench: running microbenchmarks\n");
+    pmm_bench();
+    vmm_bench();
+    string_bench();
+    ahci_bench();
+    kmalloc_print_stats();
+    kprintf(LOG_OK "bench: done\n");
+}
+#endif
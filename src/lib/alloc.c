@@ -1,95 +1,301 @@
 #include <lib/alloc.h>
+#include <lib/spinlock.h>
 #include <mem/slab.h>
-#include <mem/vmm.h>
+#include <mem/vmalloc.h>
 #include <mem/pmm.h>
 #include <common/boot.h>
 #include <kernel/kprintf.h>
+#include <lib/string.h>
 #include <stdint.h>
 #include <stddef.h>
 
-#define KALLOC_MAGIC 0x4B4D414C /* 'KMAL' */
+/* Large (vmalloc-backed) allocations; small ones are counted per slab cache */
+static struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failed;
+    uint64_t bytes;      /* requested, summed over allocs */
+    uint64_t pages;      /* held right now */
+    uint64_t peak_pages;
+} large_stats;
 
-typedef struct {
-    uint32_t magic;
-    uint32_t pages;
-} kalloc_header_t;
+#ifdef ENABLE_KMALLOC_TRACE
+/* Every live allocation tagged with the address kmalloc returns to, in an
+ * open-addressed table keyed by pointer (linear probing, deletions shift the
+ * run back so lookups never need tombstones) */
+#define TRACE_SLOTS 16384
+#define TRACE_SITES 64
 
-extern char _kernel_bss_end[];
-static uintptr_t heap_cur = 0;
+struct trace_entry {
+    uint64_t ptr;        /* 0 = empty slot */
+    uint64_t caller;
+    uint64_t size;
+};
 
-static void kmalloc_init(void)
+static struct trace_entry *trace_table = NULL;
+static uint32_t trace_live = 0;
+static uint64_t trace_dropped = 0;
+static int trace_failed = 0;
+static spinlock_t trace_lock = SPINLOCK_INIT;
+
+static inline uint32_t trace_slot(uint64_t ptr)
 {
-    if (heap_cur) return;
-    heap_cur = PAGE_ALIGN_UP((uintptr_t)_kernel_bss_end);
+    return (uint32_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (TRACE_SLOTS - 1);
 }
 
-void *kmalloc(size_t size)
+static int trace_setup(void)
 {
-    if (size == 0) return NULL;
+    if (trace_table) return 0;
+    if (trace_failed) return -1;
+    size_t bytes = TRACE_SLOTS * sizeof(struct trace_entry);
+    uint64_t phys = pmm_alloc_contig(DIV_ROUND_UP(bytes, PMM_PAGE_SIZE), 0, 0);
+    if (!phys) {
+        trace_failed = 1;
+        kprintf(LOG_WARN "kmalloc: no memory for the allocation trace table\n");
+        return -1;
+    }
+    struct trace_entry *t = (struct trace_entry*)PHYS_TO_VIRT(phys);
+    memset(t, 0, bytes);
+    trace_table = t;
+    return 0;
+}
 
-    /* small allocations -> slab */
-    if (size <= 2048) {
-        return slab_alloc(size);
+static void trace_add(void *ptr, size_t size, uint64_t caller)
+{
+    uint64_t flags = spin_lock_irqsave(&trace_lock);
+    if (trace_setup() < 0 || trace_live >= TRACE_SLOTS * 3 / 4) {
+        trace_dropped++;
+    } else {
+        uint32_t i = trace_slot((uint64_t)ptr);
+        while (trace_table[i].ptr) i = (i + 1) & (TRACE_SLOTS - 1);
+        trace_table[i].ptr = (uint64_t)ptr;
+        trace_table[i].caller = caller;
+        trace_table[i].size = size;
+        trace_live++;
     }
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
 
-    kmalloc_init();
+static void trace_del(void *ptr)
+{
+    uint64_t flags = spin_lock_irqsave(&trace_lock);
+    if (!trace_table) goto out;
+    uint32_t i = trace_slot((uint64_t)ptr);
+    while (trace_table[i].ptr && trace_table[i].ptr != (uint64_t)ptr) i = (i + 1) & (TRACE_SLOTS - 1);
+    if (!trace_table[i].ptr) goto out;   /* allocated while the table was full */
 
-    size_t tot = size + sizeof(kalloc_header_t);
-    size_t npages = DIV_ROUND_UP(tot, PAGE_SIZE);
+    /* Pull later entries of the run into the hole unless that would move
+     * them before their home slot */
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & (TRACE_SLOTS - 1); trace_table[j].ptr; j = (j + 1) & (TRACE_SLOTS - 1)) {
+        uint32_t home = trace_slot(trace_table[j].ptr);
+        if (((j - home) & (TRACE_SLOTS - 1)) >= ((j - hole) & (TRACE_SLOTS - 1))) {
+            trace_table[hole] = trace_table[j];
+            hole = j;
+        }
+    }
+    trace_table[hole].ptr = 0;
+    trace_live--;
+out:
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+#endif
 
-    uintptr_t start = heap_cur;
+static void large_note_pages(int64_t delta)
+{
+    uint64_t held = __atomic_add_fetch(&large_stats.pages, (uint64_t)delta, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&large_stats.peak_pages, __ATOMIC_RELAXED);
+    while (held > peak &&
+           !__atomic_compare_exchange_n(&large_stats.peak_pages, &peak, held, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
 
-    size_t mapped = 0;
-    for (size_t i = 0; i < npages; ++i) {
-        uint64_t phys = vmm_map_alloc_page(start + i * PAGE_SIZE, VMM_PTE_W);
-        if (!phys) break;
-        mapped++;
-    }
+static inline int is_large(const void *ptr)
+{
+    uint64_t addr = (uint64_t)ptr;
+    return addr >= VMALLOC_START && addr < VMALLOC_END;
+}
 
-    if (mapped != npages) {
-        /* unwind
-         * for each mapped page: unmap and free frame
-         */
-        for (size_t i = 0; i < mapped; ++i) {
-            uintptr_t v = start + i * PAGE_SIZE;
-            uint64_t phys = vmm_translate(v);
-            if (phys) {
-                vmm_unmap_page(v);
-                pmm_free_frame(phys);
-            }
+#define ALLOC_ZERO 0x1
+
+/* Everything allocates through here so the trace sees the outer caller */
+static void *kmalloc_caller(size_t size, uint64_t align, uint32_t flags, uint64_t caller)
+{
+    (void)caller;
+    if (size == 0) return NULL;
+
+    void *ptr;
+    if (size <= SLAB_MAX_SIZE && align <= SLAB_MAX_SIZE) {
+        /* small allocations -> slab. Objects of a size class are aligned to
+         * their size, so a class at least `align` large is aligned enough. */
+        ptr = slab_alloc(size < align ? align : size);
+        if (ptr && (flags & ALLOC_ZERO)) memset(ptr, 0, size);
+    } else {
+        /* large allocations -> a guarded vmalloc range of their own */
+        if (align > PAGE_SIZE) ptr = vmalloc_aligned(size, align);
+        else if (flags & ALLOC_ZERO) ptr = vzalloc(size);
+        else ptr = vmalloc(size);
+        if (ptr) {
+            __atomic_add_fetch(&large_stats.allocs, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&large_stats.bytes, size, __ATOMIC_RELAXED);
+            large_note_pages((int64_t)DIV_ROUND_UP(size, PAGE_SIZE));
+        } else {
+            __atomic_add_fetch(&large_stats.failed, 1, __ATOMIC_RELAXED);
         }
+    }
+
+#ifdef ENABLE_KMALLOC_TRACE
+    if (ptr) trace_add(ptr, size, caller);
+#endif
+    return ptr;
+}
+
+void *kmalloc(size_t size)
+{
+    return kmalloc_caller(size, 0, 0, (uint64_t)__builtin_return_address(0));
+}
+
+void *kcalloc(size_t n, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) return NULL;
+    return kmalloc_caller(total, 0, ALLOC_ZERO, (uint64_t)__builtin_return_address(0));
+}
+
+void *kmalloc_aligned(size_t size, size_t align)
+{
+    if (align & (align - 1)) return NULL;
+    return kmalloc_caller(size, align, 0, (uint64_t)__builtin_return_address(0));
+}
+
+size_t ksize(const void *ptr)
+{
+    if (!ptr) return 0;
+    if (is_large(ptr)) return vmalloc_pages((uint64_t)ptr) * PAGE_SIZE;
+    return slab_size(ptr);
+}
+
+void *krealloc(void *ptr, size_t size)
+{
+    uint64_t caller = (uint64_t)__builtin_return_address(0);
+    if (!ptr) return kmalloc_caller(size, 0, 0, caller);
+    if (size == 0) {
+        kfree(ptr);
         return NULL;
     }
 
-    /* Write header at start of region */
-    kalloc_header_t *h = (kalloc_header_t*)start;
-    h->magic = KALLOC_MAGIC;
-    h->pages = (uint32_t)npages;
+    size_t old = ksize(ptr);
+    if (!old) {
+        kprintf(LOG_WARN "krealloc: %p was not allocated by kmalloc\n", ptr);
+        return NULL;
+    }
 
-    heap_cur += npages * PAGE_SIZE;
+    /* Still fits its size class or page run: nothing moves. A large range can
+     * also grow into free VA right after it. Shrinking never moves either. */
+    int in_place = size <= old;
+    if (!in_place && is_large(ptr) && vmalloc_grow(ptr, size) == 0) {
+        large_note_pages((int64_t)(DIV_ROUND_UP(size, PAGE_SIZE) - old / PAGE_SIZE));
+        in_place = 1;
+    }
+    if (in_place) {
+#ifdef ENABLE_KMALLOC_TRACE
+        trace_del(ptr);
+        trace_add(ptr, size, caller);
+#endif
+        return ptr;
+    }
 
-    return (void*)(start + sizeof(kalloc_header_t));
+    void *n = kmalloc_caller(size, 0, 0, caller);
+    if (!n) return NULL;
+    memcpy(n, ptr, old);
+    kfree(ptr);
+    return n;
 }
 
 void kfree(void *ptr)
 {
     if (!ptr) return;
+#ifdef ENABLE_KMALLOC_TRACE
+    trace_del(ptr);
+#endif
 
-    uintptr_t page_base = (uintptr_t)ptr & ~(PAGE_SIZE - 1);
-    kalloc_header_t *h = (kalloc_header_t*)page_base;
+    /* The address alone says which allocator it came from */
+    if (is_large(ptr)) {
+        size_t pages = vmalloc_pages((uint64_t)ptr);
+        if (pages) {
+            __atomic_add_fetch(&large_stats.frees, 1, __ATOMIC_RELAXED);
+            large_note_pages(-(int64_t)pages);
+        }
+        vfree(ptr);
+        return;
+    }
+    slab_free(ptr);
+}
+
+void kmalloc_print_stats(void)
+{
+    slab_print_stats();
+    uint64_t allocs = __atomic_load_n(&large_stats.allocs, __ATOMIC_RELAXED);
+    uint64_t frees = __atomic_load_n(&large_stats.frees, __ATOMIC_RELAXED);
+    kprintf(LOG_INFO "kmalloc: large live=%llu allocs=%llu frees=%llu failed=%llu avg size=%llu\n",
+            (unsigned long long)(allocs - frees), (unsigned long long)allocs, (unsigned long long)frees,
+            (unsigned long long)large_stats.failed,
+            (unsigned long long)(allocs ? large_stats.bytes / allocs : 0));
+    kprintf(LOG_INFO "kmalloc: large pages held=%llu peak=%llu\n",
+            (unsigned long long)large_stats.pages, (unsigned long long)large_stats.peak_pages);
+}
+
+void kmalloc_dump_live(void)
+{
+#ifdef ENABLE_KMALLOC_TRACE
+    struct site { uint64_t caller, count, bytes; } sites[TRACE_SITES];
+    uint32_t nsites = 0;
+    uint64_t other_count = 0, other_bytes = 0;
 
-    if (h->magic == KALLOC_MAGIC) {
-        for (uint32_t i = 0; i < h->pages; ++i) {
-            uintptr_t v = page_base + (uintptr_t)i * PAGE_SIZE;
-            uint64_t phys = vmm_translate(v);
-            if (phys) {
-                vmm_unmap_page(v);
-                pmm_free_frame(phys);
+    /* Group the live allocations by call site */
+    uint64_t flags = spin_lock_irqsave(&trace_lock);
+    for (uint32_t i = 0; trace_table && i < TRACE_SLOTS; ++i) {
+        struct trace_entry *e = &trace_table[i];
+        if (!e->ptr) continue;
+        uint32_t s = 0;
+        while (s < nsites && sites[s].caller != e->caller) s++;
+        if (s == nsites) {
+            if (nsites == TRACE_SITES) {
+                other_count++;
+                other_bytes += e->size;
+                continue;
             }
+            sites[nsites++] = (struct site){ e->caller, 0, 0 };
         }
-        return;
+        sites[s].count++;
+        sites[s].bytes += e->size;
     }
+    uint32_t live = trace_live;
+    uint64_t dropped = trace_dropped;
+    spin_unlock_irqrestore(&trace_lock, flags);
 
-    /* otherwise assume slab object */
-    slab_free(ptr);
+    /* Largest holders first */
+    for (uint32_t i = 0; i < nsites; ++i) {
+        for (uint32_t j = i + 1; j < nsites; ++j) {
+            if (sites[j].bytes > sites[i].bytes) {
+                struct site t = sites[i];
+                sites[i] = sites[j];
+                sites[j] = t;
+            }
+        }
+    }
+
+    kprintf(LOG_INFO "kmalloc: %u live allocations from %u call sites (%llu not tracked)\n",
+            live, nsites, (unsigned long long)dropped);
+    for (uint32_t i = 0; i < nsites; ++i)
+        kprintf(LOG_INFO "kmalloc:   %016llx %llu allocs, %llu bytes\n",
+                (unsigned long long)sites[i].caller, (unsigned long long)sites[i].count,
+                (unsigned long long)sites[i].bytes);
+    if (other_count)
+        kprintf(LOG_INFO "kmalloc:   (other sites) %llu allocs, %llu bytes\n",
+                (unsigned long long)other_count, (unsigned long long)other_bytes);
+#else
+    kprintf(LOG_WARN "kmalloc: call-site tracking is off (build with -DENABLE_KMALLOC_TRACE)\n");
+#endif
 }
@@ -0,0 +1,135 @@
+#include <lib/arena.h>
+#include <lib/string.h>
+#include <mem/pmm.h>
+#include <common/boot.h>
+
+/* Chunks are buddy blocks reached through the HHDM: no mapping to set up and
+ * one PMM call per chunk. The newest chunk is the one being bumped; the
+ * first, holding the arena itself, is at the end of the list. */
+struct arena_chunk {
+    struct arena_chunk *next;
+    unsigned order;
+};
+
+struct arena {
+    struct arena_chunk *chunks;
+    uint8_t *cur;
+    uint8_t *end;
+    uint8_t *base;        /* first byte after the arena in its home chunk */
+    size_t chunk_size;
+};
+
+static inline uint8_t *chunk_end(struct arena_chunk *c)
+{
+    return (uint8_t*)c + ((size_t)PAGE_SIZE << c->order);
+}
+
+static struct arena_chunk *chunk_new(size_t bytes)
+{
+    unsigned order = 0;
+    while (((size_t)PAGE_SIZE << order) < bytes) {
+        if (++order > PMM_MAX_ORDER) return NULL;
+    }
+    uint64_t phys = pmm_alloc_pages(order);
+    if (!phys) return NULL;
+    struct arena_chunk *c = (struct arena_chunk*)PHYS_TO_VIRT(phys);
+    c->next = NULL;
+    c->order = order;
+    return c;
+}
+
+static void chunk_free(struct arena_chunk *c)
+{
+    pmm_free_pages(VIRT_TO_PHYS(c), c->order);
+}
+
+struct arena *arena_create(size_t chunk_size)
+{
+    if (chunk_size == 0) chunk_size = ARENA_CHUNK_DEFAULT;
+    struct arena_chunk *c = chunk_new(chunk_size);
+    if (!c) return NULL;
+
+    struct arena *a = (struct arena*)ALIGN_UP((uintptr_t)(c + 1), ARENA_ALIGN);
+    a->chunks = c;
+    a->base = (uint8_t*)ALIGN_UP((uintptr_t)(a + 1), ARENA_ALIGN);
+    a->cur = a->base;
+    a->end = chunk_end(c);
+    a->chunk_size = chunk_size;
+    return a;
+}
+
+void *arena_alloc_aligned(struct arena *a, size_t size, size_t align)
+{
+    if (!a || size == 0 || (align & (align - 1))) return NULL;
+    if (align < ARENA_ALIGN) align = ARENA_ALIGN;
+
+    uintptr_t p = ALIGN_UP((uintptr_t)a->cur, align);
+    if (p <= (uintptr_t)a->end && size <= (uintptr_t)a->end - p) {
+        a->cur = (uint8_t*)(p + size);
+        return (void*)p;
+    }
+
+    /* Start a new chunk; what is left of the current one is given up */
+    size_t need = sizeof(struct arena_chunk) + align + size;
+    if (need < size) return NULL;
+    struct arena_chunk *c = chunk_new(need > a->chunk_size ? need : a->chunk_size);
+    if (!c) return NULL;
+    c->next = a->chunks;
+    a->chunks = c;
+    p = ALIGN_UP((uintptr_t)(c + 1), align);
+    a->cur = (uint8_t*)(p + size);
+    a->end = chunk_end(c);
+    return (void*)p;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    return arena_alloc_aligned(a, size, ARENA_ALIGN);
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *d = arena_alloc_aligned(a, len, 1);
+    if (d) memcpy(d, s, len);
+    return d;
+}
+
+struct arena_mark arena_save(struct arena *a)
+{
+    struct arena_mark m = { a->chunks, a->cur };
+    return m;
+}
+
+void arena_restore(struct arena *a, struct arena_mark m)
+{
+    while (a->chunks != m.chunk) {
+        struct arena_chunk *c = a->chunks;
+        a->chunks = c->next;
+        chunk_free(c);
+    }
+    a->cur = m.cur;
+    a->end = chunk_end(a->chunks);
+}
+
+void arena_reset(struct arena *a)
+{
+    while (a->chunks->next) {
+        struct arena_chunk *c = a->chunks;
+        a->chunks = c->next;
+        chunk_free(c);
+    }
+    a->cur = a->base;
+    a->end = chunk_end(a->chunks);
+}
+
+void arena_destroy(struct arena *a)
+{
+    if (!a) return;
+    struct arena_chunk *c = a->chunks;
+    while (c) {
+        struct arena_chunk *n = c->next;
+        chunk_free(c);
+        c = n;
+    }
+}
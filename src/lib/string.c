@@ -1,41 +1,250 @@
 #include <lib/string.h>
 #include <lib/alloc.h>
+#include <common/boot.h>
+#include <kernel/bench.h>
+#include <kernel/kprintf.h>
+#include <mem/pmm.h>
 
-void *memcpy(void *restrict dest, const void *restrict src, size_t n) {
-    uint8_t *restrict pdest = (uint8_t *restrict)dest;
-    const uint8_t *restrict psrc = (const uint8_t *restrict)src;
+/* Fast string operations, filled in by string_init(): with ERMS rep movsb /
+ * rep stosb beat vector loops from a few hundred bytes on, with FSRM rep movsb
+ * is fast for short copies as well. Below that, SSE2 16-byte moves. */
+static uint8_t mem_erms = 0;
+static uint8_t mem_fsrm = 0;
 
-    for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
+#define MEM_REP_MIN (256)         /* ERMS pays off from here */
+#define MEM_NT_MIN  (256 * 1024)  /* memset past this skips the cache */
+
+typedef uint64_t u64_unaligned __attribute__((aligned(1), may_alias));
+typedef uint32_t u32_unaligned __attribute__((aligned(1), may_alias));
+typedef uint16_t u16_unaligned __attribute__((aligned(1), may_alias));
+
+void string_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 7) return;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    mem_erms = (ebx >> 9) & 1;
+    mem_fsrm = (edx >> 4) & 1;
+}
+
+/* n < 16. Everything is loaded before anything is stored, so overlapping
+ * buffers are fine (memmove uses it too). */
+static inline void copy_small(uint8_t *d, const uint8_t *s, size_t n)
+{
+    if (n >= 8) {
+        uint64_t a = *(const u64_unaligned*)s, b = *(const u64_unaligned*)(s + n - 8);
+        *(u64_unaligned*)d = a;
+        *(u64_unaligned*)(d + n - 8) = b;
+    } else if (n >= 4) {
+        uint32_t a = *(const u32_unaligned*)s, b = *(const u32_unaligned*)(s + n - 4);
+        *(u32_unaligned*)d = a;
+        *(u32_unaligned*)(d + n - 4) = b;
+    } else if (n >= 2) {
+        uint16_t a = *(const u16_unaligned*)s, b = *(const u16_unaligned*)(s + n - 2);
+        *(u16_unaligned*)d = a;
+        *(u16_unaligned*)(d + n - 2) = b;
+    } else if (n) {
+        *d = *s;
     }
+}
+
+static inline void rep_movsb(void *d, const void *s, size_t n)
+{
+    __asm__ volatile ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) :: "memory");
+}
+
+/* n >= 16, ascending: 64 bytes per round, then 16, then the last 16 bytes
+ * (loaded up front) overlap what is already done. Safe when d < s. */
+static void sse_copy_fwd(uint8_t *d, const uint8_t *s, size_t n)
+{
+    uint8_t *last = d + n - 16;
+    __asm__ volatile (
+        "movdqu -16(%1,%2), %%xmm4\n\t"
+        "cmp $64, %2\n\t"
+        "jb 2f\n"
+        "1:\n\t"
+        "movdqu (%1), %%xmm0\n\t"
+        "movdqu 16(%1), %%xmm1\n\t"
+        "movdqu 32(%1), %%xmm2\n\t"
+        "movdqu 48(%1), %%xmm3\n\t"
+        "movdqu %%xmm0, (%0)\n\t"
+        "movdqu %%xmm1, 16(%0)\n\t"
+        "movdqu %%xmm2, 32(%0)\n\t"
+        "movdqu %%xmm3, 48(%0)\n\t"
+        "add $64, %1\n\t"
+        "add $64, %0\n\t"
+        "sub $64, %2\n\t"
+        "cmp $64, %2\n\t"
+        "jae 1b\n"
+        "2:\n\t"
+        "cmp $16, %2\n\t"
+        "jbe 4f\n"
+        "3:\n\t"
+        "movdqu (%1), %%xmm0\n\t"
+        "movdqu %%xmm0, (%0)\n\t"
+        "add $16, %1\n\t"
+        "add $16, %0\n\t"
+        "sub $16, %2\n\t"
+        "cmp $16, %2\n\t"
+        "ja 3b\n"
+        "4:\n\t"
+        "movdqu %%xmm4, (%3)"
+        : "+r"(d), "+r"(s), "+r"(n)
+        : "r"(last)
+        : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "memory", "cc");
+}
+
+/* Mirror image for memmove with d > s: descending, first 16 bytes last */
+static void sse_copy_bwd(uint8_t *d, const uint8_t *s, size_t n)
+{
+    uint8_t *de = d + n;
+    const uint8_t *se = s + n;
+    __asm__ volatile (
+        "movdqu (%4), %%xmm4\n\t"
+        "cmp $64, %2\n\t"
+        "jb 2f\n"
+        "1:\n\t"
+        "movdqu -16(%1), %%xmm0\n\t"
+        "movdqu -32(%1), %%xmm1\n\t"
+        "movdqu -48(%1), %%xmm2\n\t"
+        "movdqu -64(%1), %%xmm3\n\t"
+        "movdqu %%xmm0, -16(%0)\n\t"
+        "movdqu %%xmm1, -32(%0)\n\t"
+        "movdqu %%xmm2, -48(%0)\n\t"
+        "movdqu %%xmm3, -64(%0)\n\t"
+        "sub $64, %1\n\t"
+        "sub $64, %0\n\t"
+        "sub $64, %2\n\t"
+        "cmp $64, %2\n\t"
+        "jae 1b\n"
+        "2:\n\t"
+        "cmp $16, %2\n\t"
+        "jbe 4f\n"
+        "3:\n\t"
+        "movdqu -16(%1), %%xmm0\n\t"
+        "movdqu %%xmm0, -16(%0)\n\t"
+        "sub $16, %1\n\t"
+        "sub $16, %0\n\t"
+        "sub $16, %2\n\t"
+        "cmp $16, %2\n\t"
+        "ja 3b\n"
+        "4:\n\t"
+        "movdqu %%xmm4, (%3)"
+        : "+r"(de), "+r"(se), "+r"(n)
+        : "r"(d), "r"(s)
+        : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "memory", "cc");
+}
 
+void *memcpy(void *restrict dest, const void *restrict src, size_t n) {
+    if (n < 16) copy_small(dest, src, n);
+    else if (mem_fsrm || (mem_erms && n >= MEM_REP_MIN)) rep_movsb(dest, src, n);
+    else sse_copy_fwd(dest, src, n);
     return dest;
 }
 
+/* Fill 16-byte aligned `p` with `n` (a multiple of 64, nonzero) bytes of
+ * the pattern `v` repeated, bypassing the cache. The pattern is built in
+ * xmm0 by the same asm statement that stores it. */
+static void sse_fill_nt(uint8_t *p, size_t n, uint64_t v)
+{
+    __asm__ volatile (
+        "movq %2, %%xmm0\n\t"
+        "punpcklqdq %%xmm0, %%xmm0\n\t"
+        "1:\n\t"
+        "movntdq %%xmm0, (%0)\n\t"
+        "movntdq %%xmm0, 16(%0)\n\t"
+        "movntdq %%xmm0, 32(%0)\n\t"
+        "movntdq %%xmm0, 48(%0)\n\t"
+        "add $64, %0\n\t"
+        "sub $64, %1\n\t"
+        "jnz 1b"
+        : "+r"(p), "+r"(n) : "r"(v) : "xmm0", "memory", "cc");
+}
+
+void memzero_nt(void *p, size_t n)
+{
+    if (n == 0) return;
+    sse_fill_nt(p, n, 0);
+}
+
 void *memset(void *s, int c, size_t n) {
     uint8_t *p = (uint8_t *)s;
+    uint64_t v = (uint8_t)c * 0x0101010101010101ULL;
 
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t)c;
+    if (n < 16) {
+        if (n >= 8) {
+            *(u64_unaligned*)p = v;
+            *(u64_unaligned*)(p + n - 8) = v;
+        } else if (n >= 4) {
+            *(u32_unaligned*)p = (uint32_t)v;
+            *(u32_unaligned*)(p + n - 4) = (uint32_t)v;
+        } else if (n >= 2) {
+            *(u16_unaligned*)p = (uint16_t)v;
+            *(u16_unaligned*)(p + n - 2) = (uint16_t)v;
+        } else if (n) {
+            *p = (uint8_t)c;
+        }
+        return s;
+    }
+
+    if (n >= MEM_NT_MIN) {
+        /* Unaligned head and tail the normal way, the aligned middle with
+         * non-temporal stores */
+        uint8_t *a = (uint8_t*)ALIGN_UP((uintptr_t)p, 64);
+        size_t mid = (n - (size_t)(a - p)) & ~(size_t)63;
+        sse_fill_nt(a, mid, v);
+        __asm__ volatile ("sfence" ::: "memory");
+        memset(p, c, (size_t)(a - p));
+        memset(a + mid, c, n - (size_t)(a - p) - mid);
+        return s;
+    }
+
+    if (mem_erms && n >= MEM_REP_MIN) {
+        void *d = p;
+        __asm__ volatile ("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+        return s;
     }
 
+    /* 16 <= n: first and last 16 unaligned, the rest in aligned rounds */
+    uint8_t *end = p + n;
+    __asm__ volatile (
+        "movq %2, %%xmm0\n\t"
+        "punpcklqdq %%xmm0, %%xmm0\n\t"
+        "movdqu %%xmm0, (%0)\n\t"
+        "movdqu %%xmm0, -16(%1)\n\t"
+        "add $16, %0\n\t"
+        "and $-16, %0\n\t"
+        "sub $16, %1\n\t"
+        "cmp %1, %0\n\t"
+        "jae 2f\n"
+        "1:\n\t"
+        "movdqa %%xmm0, (%0)\n\t"
+        "add $16, %0\n\t"
+        "cmp %1, %0\n\t"
+        "jb 1b\n"
+        "2:"
+        : "+r"(p), "+r"(end)
+        : "r"(v)
+        : "xmm0", "memory", "cc");
     return s;
 }
 
 void *memmove(void *dest, const void *src, size_t n) {
-    uint8_t *pdest = (uint8_t *)dest;
-    const uint8_t *psrc = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
 
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
-        }
+    /* Forward copies are safe unless dest starts inside src: rep movsb is
+     * defined byte by byte, so it copes with d < s */
+    if (d == s || n == 0) return dest;
+    if (d < s || d >= s + n) {
+        if (n < 16) copy_small(d, s, n);
+        else if (mem_fsrm || (mem_erms && n >= MEM_REP_MIN)) rep_movsb(d, s, n);
+        else sse_copy_fwd(d, s, n);
+    } else {
+        if (n < 16) copy_small(d, s, n);
+        else sse_copy_bwd(d, s, n);
     }
-
     return dest;
 }
 
@@ -43,7 +252,47 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     const uint8_t *p1 = (const uint8_t *)s1;
     const uint8_t *p2 = (const uint8_t *)s2;
 
-    for (size_t i = 0; i < n; i++) {
+    /* 64 bytes a round while they match, then 16 at a time: the first clear
+     * bit of the pcmpeqb mask is the first difference */
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint32_t mask;
+        __asm__ ("movdqu (%1), %%xmm0\n\t"
+                 "movdqu 16(%1), %%xmm1\n\t"
+                 "movdqu 32(%1), %%xmm2\n\t"
+                 "movdqu 48(%1), %%xmm3\n\t"
+                 "movdqu (%2), %%xmm4\n\t"
+                 "pcmpeqb %%xmm4, %%xmm0\n\t"
+                 "movdqu 16(%2), %%xmm4\n\t"
+                 "pcmpeqb %%xmm4, %%xmm1\n\t"
+                 "movdqu 32(%2), %%xmm4\n\t"
+                 "pcmpeqb %%xmm4, %%xmm2\n\t"
+                 "movdqu 48(%2), %%xmm4\n\t"
+                 "pcmpeqb %%xmm4, %%xmm3\n\t"
+                 "pand %%xmm1, %%xmm0\n\t"
+                 "pand %%xmm3, %%xmm2\n\t"
+                 "pand %%xmm2, %%xmm0\n\t"
+                 "pmovmskb %%xmm0, %0"
+                 : "=r"(mask) : "r"(p1 + i), "r"(p2 + i), "m"(*(const uint8_t (*)[64])(p1 + i)),
+                   "m"(*(const uint8_t (*)[64])(p2 + i))
+                 : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4");
+        if (mask != 0xFFFF) break;
+    }
+    for (; i + 16 <= n; i += 16) {
+        uint32_t mask;
+        __asm__ ("movdqu (%1), %%xmm0\n\t"
+                 "movdqu (%2), %%xmm1\n\t"
+                 "pcmpeqb %%xmm1, %%xmm0\n\t"
+                 "pmovmskb %%xmm0, %0"
+                 : "=r"(mask) : "r"(p1 + i), "r"(p2 + i), "m"(*(const uint8_t (*)[16])(p1 + i)),
+                   "m"(*(const uint8_t (*)[16])(p2 + i))
+                 : "xmm0", "xmm1");
+        if (mask != 0xFFFF) {
+            size_t k = i + (size_t)__builtin_ctz(~mask);
+            return p1[k] < p2[k] ? -1 : 1;
+        }
+    }
+    for (; i < n; i++) {
         if (p1[i] != p2[i]) {
             return p1[i] < p2[i] ? -1 : 1;
         }
@@ -52,30 +301,92 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     return 0;
 }
 
+/* Loads that stay inside one page can run past the terminator: the bytes
+ * after it may be garbage but never unmapped */
+#define STR_PAGE_OK(p) (((uintptr_t)(p) & 4095) <= 4096 - 16)
+
+/* Bit i set where a[i] != b[i] or a[i] is the terminator */
+static inline uint32_t str_diff16(const uint8_t *a, const uint8_t *b)
+{
+    uint32_t same;
+    __asm__ ("movdqu (%1), %%xmm0\n\t"
+             "movdqu (%2), %%xmm1\n\t"
+             "pxor %%xmm2, %%xmm2\n\t"
+             "pcmpeqb %%xmm0, %%xmm2\n\t"
+             "pcmpeqb %%xmm0, %%xmm1\n\t"
+             "pandn %%xmm1, %%xmm2\n\t"
+             "pmovmskb %%xmm2, %0"
+             : "=r"(same) : "r"(a), "r"(b), "m"(*(const uint8_t (*)[16])a),
+               "m"(*(const uint8_t (*)[16])b)
+             : "xmm0", "xmm1", "xmm2");
+    return ~same & 0xFFFF;
+}
+
 size_t strlen(const char *s) {
-    size_t len = 0;
-    while (s[len] != '\0') {
-        len++;
+    /* Aligned 16-byte blocks never cross a page; drop the bytes before s */
+    const uint8_t *p = (const uint8_t*)((uintptr_t)s & ~(uintptr_t)15);
+    uint32_t mask;
+    __asm__ ("pxor %%xmm0, %%xmm0\n\t"
+             "pcmpeqb (%1), %%xmm0\n\t"
+             "pmovmskb %%xmm0, %0"
+             : "=r"(mask) : "r"(p), "m"(*(const uint8_t (*)[16])p) : "xmm0");
+    mask >>= (uintptr_t)s & 15;
+    if (mask) return (size_t)__builtin_ctz(mask);
+
+    for (;;) {
+        p += 16;
+        __asm__ ("pxor %%xmm0, %%xmm0\n\t"
+                 "pcmpeqb (%1), %%xmm0\n\t"
+                 "pmovmskb %%xmm0, %0"
+                 : "=r"(mask) : "r"(p), "m"(*(const uint8_t (*)[16])p) : "xmm0");
+        if (mask) return (size_t)(p - (const uint8_t*)s) + (size_t)__builtin_ctz(mask);
     }
-    return len;
 }
 
-int strncmp(const char *s1, const char *s2, size_t n) {
-    for (size_t i = 0; i < n; i++) {
-        if (s1[i] != s2[i]) {
-            return (unsigned char)s1[i] - (unsigned char)s2[i];
-        }
-        if (s1[i] == '\0') {
-            return 0;
+/* 16 bytes a step while neither side is near the end of a page, one byte
+ * at a time while one is */
+static int str_compare(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    while (n) {
+        if (STR_PAGE_OK(a) && STR_PAGE_OK(b)) {
+            uint32_t m = str_diff16(a, b);
+            if (n < 16) m &= (1u << n) - 1;
+            if (m) {
+                unsigned i = (unsigned)__builtin_ctz(m);
+                return (int)a[i] - (int)b[i];
+            }
+            if (n <= 16) return 0;
+            a += 16; b += 16; n -= 16;
+            continue;
         }
+        if (*a != *b) return (int)*a - (int)*b;
+        if (!*a) return 0;
+        a++; b++; n--;
     }
     return 0;
 }
 
+int strncmp(const char *s1, const char *s2, size_t n) {
+    return str_compare((const uint8_t*)s1, (const uint8_t*)s2, n);
+}
+
 int strcmp(const char *s1, const char *s2) {
-    size_t i = 0;
-    while (s1[i] && s1[i] == s2[i]) i++;
-    return (unsigned char)s1[i] - (unsigned char)s2[i];
+    return str_compare((const uint8_t*)s1, (const uint8_t*)s2, SIZE_MAX);
+}
+
+uint32_t memhash(const void *p, size_t n)
+{
+    const uint8_t *b = p;
+    uint32_t h = STRHASH_INIT;
+    for (size_t i = 0; i < n; i++) h = strhash_step(h, b[i]);
+    return h;
+}
+
+uint32_t strhash(const char *s)
+{
+    uint32_t h = STRHASH_INIT;
+    while (*s) h = strhash_step(h, (uint8_t)*s++);
+    return h;
 }
 
 char *strdup(const char *s) {
@@ -95,4 +406,74 @@ int atoi(const char *s) {
     int v = 0;
     while (*s >= '0' && *s <= '9') { v = v * 10 + (*s - '0'); s++; }
     return sign * v;
-}
\ No newline at end of file
+}
+
+#ifdef ENABLE_BENCH
+/* The old byte loop, as the baseline; the barrier keeps the compiler from
+ * turning it back into a memcpy call */
+static void bench_bytecopy(uint8_t *d, const uint8_t *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i];
+        __asm__ volatile ("" ::: "memory");
+    }
+}
+
+/* Bytes per 100 cycles for `iters` operations of `n` bytes */
+static uint64_t bench_rate(uint64_t cycles, size_t n, uint64_t iters)
+{
+    return cycles ? (uint64_t)n * iters * 100 / cycles : 0;
+}
+
+void string_bench(void)
+{
+    /* Two 2MiB blocks: room for a 1MiB buffer at any of the offsets used */
+    uint64_t pa = pmm_alloc_pages(9), pb = pmm_alloc_pages(9);
+    if (!pa || !pb) {
+        kprintf(LOG_WARN "string bench: no memory for buffers\n");
+        if (pa) pmm_free_pages(pa, 9);
+        if (pb) pmm_free_pages(pb, 9);
+        return;
+    }
+    uint8_t *a = PHYS_TO_VIRT(pa), *b = PHYS_TO_VIRT(pb);
+    memset(a, 0x5A, 2 << 20);
+    memset(b, 0x5A, 2 << 20);
+
+    kprintf(LOG_INFO "string bench: ERMS=%u FSRM=%u, bytes per 100 cycles:\n", mem_erms, mem_fsrm);
+    kprintf(LOG_INFO "string bench: %8s %8s %8s %8s %8s %8s\n",
+            "size", "loop", "memcpy", "memset", "memmove", "memcmp");
+    static const size_t sizes[] = { 8, 64, 512, 4096, 32768, 262144, 1u << 20 };
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+        size_t n = sizes[k];
+        /* About 16MiB of traffic per measurement, at least 16 rounds */
+        uint64_t iters = (16u << 20) / n;
+        if (iters < 16) iters = 16;
+
+        uint64_t t0 = bench_rdtsc();
+        for (uint64_t i = 0; i < iters; ++i) bench_bytecopy(b, a, n);
+        uint64_t t1 = bench_rdtsc();
+        for (uint64_t i = 0; i < iters; ++i) memcpy(b, a, n);
+        uint64_t t2 = bench_rdtsc();
+        for (uint64_t i = 0; i < iters; ++i) memset(b, (int)i, n);
+        uint64_t t3 = bench_rdtsc();
+        for (uint64_t i = 0; i < iters; ++i) memmove(a + 256, a, n);
+        uint64_t t4 = bench_rdtsc();
+        memcpy(b, a, n);
+        volatile int sink = 0;
+        for (uint64_t i = 0; i < iters; ++i) sink += memcmp(a, b, n);
+        uint64_t t5 = bench_rdtsc();
+        (void)sink;
+
+        kprintf(LOG_INFO "string bench: %8zu %8llu %8llu %8llu %8llu %8llu\n", n,
+                (unsigned long long)bench_rate(t1 - t0, n, iters),
+                (unsigned long long)bench_rate(t2 - t1, n, iters),
+                (unsigned long long)bench_rate(t3 - t2, n, iters),
+                (unsigned long long)bench_rate(t4 - t3, n, iters),
+                (unsigned long long)bench_rate(t5 - t4, n, iters));
+    }
+    kprintf(LOG_INFO "string bench: loop = the old byte-at-a-time memcpy, memmove is 256 bytes up\n");
+
+    pmm_free_pages(pa, 9);
+    pmm_free_pages(pb, 9);
+}
+#endif
@@ -3,188 +3,997 @@
 #include <kernel/kprintf.h>
 #include <common/multiboot2.h>
 #include <lib/string.h>
+#include <kernel/bench.h>
+#include <lib/spinlock.h>
+#include <drivers/smp.h>
 
-/* Bitmap size (bytes) to support up to 8 * PMM_BITMAP_BYTES pages. 256KiB -> ~2M pages (~8GiB)
- * Keep it reasonable in .bss */
-#define PMM_BITMAP_BYTES (256 * 1024)
-static uint8_t pmm_bitmap[PMM_BITMAP_BYTES];
+/* One bit per frame up to max_phys, kept in 64-bit words so scans and range
+ * updates touch 64 frames at a time. Sized from the memory map and placed in
+ * a free region at boot, see pmm_init(). Bits past total_frames stay set. */
+static uint64_t *pmm_bitmap;
+static uint64_t pmm_bitmap_bytes = 0;
 static uint64_t total_frames = 0;
 static uint64_t max_phys = 0;
 static size_t free_frames = 0;
 
+/* The boot stub's HHDM covers 0..4GiB; pmm_init() extends it over all RAM
+ * before the free lists are built, since free blocks are linked through it. */
+#define PMM_BOOT_HHDM_LIMIT 0x100000000ULL
+#define PMM_BLOCK_MAGIC 0x42554459 /* 'BUDY' */
+
+/* Header stored at the start of every free block. The bitmap stays the source
+ * of truth for used/free frames; the header only records the block order. */
+struct pmm_block {
+    struct pmm_block *next;
+    struct pmm_block *prev;
+    uint32_t magic;
+    uint32_t order;
+};
+
+static struct pmm_block *free_lists[PMM_MAX_ORDER + 1];
+
+/* Guards the bitmap, the buddy lists and free_frames */
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+/* Per-CPU hot lists of single frames, refilled from and drained to the buddy
+ * lists PMM_PCP_BATCH frames at a time. CPUs past PMM_PCP_CPUS go straight
+ * to the buddy allocator. */
+#define PMM_PCP_CPUS 64
+#define PMM_PCP_HIGH 64
+#define PMM_PCP_BATCH 16
+
+struct pmm_pcp {
+    uint64_t frames[PMM_PCP_HIGH];
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t drains;
+} __attribute__((aligned(64)));
+
+static struct pmm_pcp pcp[PMM_PCP_CPUS];
+
+/* One bit per frame sitting in a per-CPU cache. Such frames are used in
+ * pmm_bitmap but owned by nobody; the bit is set and cleared atomically, so
+ * a second free of a cached frame is caught without the global lock. */
+static uint64_t *pcp_cached;
+
+/* Frames zeroed ahead of time by pmm_zero_pool_refill() from the idle loop,
+ * handed out by pmm_alloc_zeroed_frame(). Shared by all CPUs. */
+#define PMM_ZERO_POOL 256
+#define PMM_ZERO_BATCH 16
+/* The refill stops once this few frames are left in the buddy lists, so
+ * background zeroing never competes with real allocations for the last
+ * of memory */
+#define PMM_ZERO_RESERVE 256
+
+static uint64_t zero_pool[PMM_ZERO_POOL];
+static uint32_t zero_count = 0;
+static uint64_t zero_hits = 0;
+static uint64_t zero_misses = 0;
+static spinlock_t zero_lock = SPINLOCK_INIT;
+
 static inline void set_frame_used(uint64_t frame)
 {
-    uint64_t byte = frame >> 3;
-    uint8_t bit = frame & 7;
-    pmm_bitmap[byte] |= (1 << bit);
+    pmm_bitmap[frame >> 6] |= 1ULL << (frame & 63);
 }
 static inline void set_frame_free(uint64_t frame)
 {
-    uint64_t byte = frame >> 3;
-    uint8_t bit = frame & 7;
-    pmm_bitmap[byte] &= ~(1 << bit);
+    pmm_bitmap[frame >> 6] &= ~(1ULL << (frame & 63));
 }
 static inline int frame_is_free(uint64_t frame)
 {
-    uint64_t byte = frame >> 3;
-    uint8_t bit = frame & 7;
-    return (pmm_bitmap[byte] & (1 << bit)) == 0;
+    return (pmm_bitmap[frame >> 6] & (1ULL << (frame & 63))) == 0;
 }
 
-void pmm_init(uint64_t multiboot_phys_addr)
+/* Mark a frame cached; 0 if it already was (a double free) */
+static inline int pcp_mark_cached(uint64_t frame)
+{
+    uint64_t bit = 1ULL << (frame & 63);
+    return !(__atomic_fetch_or(&pcp_cached[frame >> 6], bit, __ATOMIC_ACQ_REL) & bit);
+}
+static inline void pcp_clear_cached(uint64_t frame)
 {
-    /* Zero bitmap (mark everything used first) */
-    memset(pmm_bitmap, 0xFF, PMM_BITMAP_BYTES);
+    __atomic_fetch_and(&pcp_cached[frame >> 6], ~(1ULL << (frame & 63)), __ATOMIC_RELEASE);
+}
+static inline int pcp_is_cached(uint64_t frame)
+{
+    return (__atomic_load_n(&pcp_cached[frame >> 6], __ATOMIC_ACQUIRE) >> (frame & 63)) & 1;
+}
 
-    /* Parse multiboot memory map */
-    uint64_t mb = multiboot_phys_addr;
-    if (!mb) {
-        kprintf("pmm_init: no multiboot info\n");
-        return;
+static int have_popcnt = 0;
+
+static inline unsigned popcount64(uint64_t w)
+{
+    if (have_popcnt) {
+        uint64_t r;
+        __asm__("popcnt %1, %0" : "=r"(r) : "rm"(w));
+        return (unsigned)r;
     }
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned)((w * 0x0101010101010101ULL) >> 56);
+}
 
-    struct multiboot_tag *tag = (struct multiboot_tag*)(mb + 8);
+/* Set (used) or clear (free) the bits of [frame, frame + count): partial
+ * words at either end are masked, whole words in between are stored. */
+static void set_range(uint64_t frame, uint64_t count, int used)
+{
+    if (count == 0) return;
+    uint64_t last = frame + count - 1;
+    uint64_t w = frame >> 6, lw = last >> 6;
+    uint64_t head = ~0ULL << (frame & 63);
+    uint64_t tail = ~0ULL >> (63 - (last & 63));
 
-    uint64_t highest = 0;
+    if (w == lw) head &= tail;
+    if (used) pmm_bitmap[w] |= head;
+    else pmm_bitmap[w] &= ~head;
+    if (w == lw) return;
+    for (++w; w < lw; ++w) pmm_bitmap[w] = used ? ~0ULL : 0;
+    if (used) pmm_bitmap[lw] |= tail;
+    else pmm_bitmap[lw] &= ~tail;
+}
+static void set_range_used(uint64_t frame, uint64_t count)
+{
+    set_range(frame, count, 1);
+}
+static void set_range_free(uint64_t frame, uint64_t count)
+{
+    set_range(frame, count, 0);
+}
 
-    for (; tag->type != MULTIBOOT_TAG_TYPE_END; tag = (struct multiboot_tag*)((uint8_t*)tag + ((tag->size + 7) & ~7))) {
-        if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
-            struct multiboot_tag_mmap *mm = (struct multiboot_tag_mmap*)tag;
-            uint32_t entries_len = mm->size - sizeof(struct multiboot_tag_mmap);
-            uint8_t *ptr = (uint8_t*)mm->entries;
-            for (uint32_t off = 0; off + mm->entry_size <= entries_len; off += mm->entry_size) {
-                struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry*)(ptr + off);
-                if (e->type == MULTIBOOT_MEMORY_AVAILABLE) {
-                    uint64_t end = e->addr + e->len;
-                    if (end > highest) highest = end;
-                }
-            }
+/* First frame in [from, end) that is used (`used` != 0) or free, else `end` */
+static uint64_t bitmap_find(uint64_t from, uint64_t end, int used)
+{
+    while (from < end) {
+        uint64_t w = pmm_bitmap[from >> 6];
+        if (!used) w = ~w;
+        w &= ~0ULL << (from & 63);
+        if (w) {
+            uint64_t f = (from & ~63ULL) + (uint64_t)__builtin_ctzll(w);
+            return f < end ? f : end;
         }
+        from = (from | 63) + 1;
     }
+    return end;
+}
 
-    max_phys = highest;
-    total_frames = (max_phys + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
-    uint64_t needed_bytes = (total_frames + 7) / 8;
-    if (needed_bytes > PMM_BITMAP_BYTES) {
-        kprintf("pmm_init: memory too large, clipping bitmap to %llu bytes (supports %llu frames)\n",
-                (unsigned long long)PMM_BITMAP_BYTES, (unsigned long long)(PMM_BITMAP_BYTES * 8));
-        total_frames = (PMM_BITMAP_BYTES * 8);
-    }
-
-    /* Mark all frames used by default */
-    for (uint64_t f = 0; f < total_frames; ++f) set_frame_used(f);
-
-    /* Now mark available regions as free excluding kernel and reserved ranges */
-    tag = (struct multiboot_tag*)(mb + 8);
-    for (; tag->type != MULTIBOOT_TAG_TYPE_END; tag = (struct multiboot_tag*)((uint8_t*)tag + ((tag->size + 7) & ~7))) {
-        if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
-            struct multiboot_tag_mmap *mm = (struct multiboot_tag_mmap*)tag;
-            uint32_t entries_len = mm->size - sizeof(struct multiboot_tag_mmap);
-            uint8_t *ptr = (uint8_t*)mm->entries;
-            for (uint32_t off = 0; off + mm->entry_size <= entries_len; off += mm->entry_size) {
-                struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry*)(ptr + off);
-                if (e->type == MULTIBOOT_MEMORY_AVAILABLE) {
-                    uint64_t start = e->addr;
-                    uint64_t end = e->addr + e->len;
-                    if (start >= max_phys) continue;
-                    if (end > max_phys) end = max_phys;
-                    uint64_t fstart = start / PMM_PAGE_SIZE;
-                    uint64_t fend = (end + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
-                    for (uint64_t f = fstart; f < fend && f < total_frames; ++f) {
-                        set_frame_free(f);
-                    }
+static uint64_t bitmap_count_free(void)
+{
+    uint64_t used = 0, words = DIV_ROUND_UP(total_frames, 64);
+    for (uint64_t w = 0; w < words; ++w) used += popcount64(pmm_bitmap[w]);
+    return words * 64 - used;
+}
+
+static inline struct pmm_block *frame_to_block(uint64_t frame)
+{
+    return (struct pmm_block*)PHYS_TO_VIRT(frame * PMM_PAGE_SIZE);
+}
+static inline uint64_t block_to_frame(struct pmm_block *b)
+{
+    return VIRT_TO_PHYS(b) / PMM_PAGE_SIZE;
+}
+
+static void buddy_push(uint64_t frame, unsigned order)
+{
+    struct pmm_block *b = frame_to_block(frame);
+    b->magic = PMM_BLOCK_MAGIC;
+    b->order = order;
+    b->prev = NULL;
+    b->next = free_lists[order];
+    if (b->next) b->next->prev = b;
+    free_lists[order] = b;
+}
+
+static void buddy_unlink(struct pmm_block *b)
+{
+    if (b->prev) b->prev->next = b->next;
+    else free_lists[b->order] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    b->magic = 0;
+}
+
+static inline int is_free_head(uint64_t frame, unsigned order)
+{
+    if (!frame_is_free(frame)) return 0;
+    struct pmm_block *b = frame_to_block(frame);
+    return b->magic == PMM_BLOCK_MAGIC && b->order == order;
+}
+
+/* Insert a block whose frames are already marked free, merging with its buddy
+ * for as long as the buddy is itself a free block of the same order. A free
+ * first frame always starts a free block here: any larger free block covering
+ * the buddy would also cover the block being inserted. */
+static void buddy_insert(uint64_t frame, unsigned order)
+{
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = frame ^ (1ULL << order);
+        if (buddy + (1ULL << order) > total_frames) break;
+        if (!is_free_head(buddy, order)) break;
+        buddy_unlink(frame_to_block(buddy));
+        frame &= ~(1ULL << order);
+        order++;
+    }
+    buddy_push(frame, order);
+}
+
+/* Largest order of an aligned block starting at `frame` that fits before `end` */
+static unsigned max_block_order(uint64_t frame, uint64_t end)
+{
+    unsigned order = PMM_MAX_ORDER;
+    while (order > 0 && ((frame & ((1ULL << order) - 1)) || frame + (1ULL << order) > end)) order--;
+    return order;
+}
+
+/* Hand a run of free frames to the buddy lists as maximal aligned blocks. The
+ * caller guarantees no piece can merge with a neighbour (a whole free run at
+ * init, or the tail of a block split for a contiguous allocation), so nothing
+ * has to look at the headers of frames that are not listed yet. */
+static void buddy_push_range(uint64_t start, uint64_t end)
+{
+    uint64_t f = start;
+    while (f < end) {
+        unsigned order = max_block_order(f, end);
+        buddy_push(f, order);
+        f += 1ULL << order;
+    }
+}
+
+/* Physical ranges that must never reach the free lists */
+struct pmm_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+#define PMM_MAX_RESERVED (4 + MAX_BOOT_MODULES)
+static struct pmm_range reserved[PMM_MAX_RESERVED];
+static unsigned reserved_count = 0;
+
+static void reserve_range(uint64_t start, uint64_t end)
+{
+    if (start >= end || reserved_count >= PMM_MAX_RESERVED) return;
+    reserved[reserved_count].start = ALIGN_DOWN(start, PMM_PAGE_SIZE);
+    reserved[reserved_count].end = PAGE_ALIGN_UP(end);
+    reserved_count++;
+}
+
+static struct multiboot_tag_mmap *find_mmap(uint64_t mb)
+{
+    for (struct multiboot_tag *t = (struct multiboot_tag*)(mb + 8);
+         t->type != MULTIBOOT_TAG_TYPE_END;
+         t = (struct multiboot_tag*)((uint8_t*)t + ((t->size + 7) & ~7))) {
+        if (t->type == MULTIBOOT_TAG_TYPE_MMAP) return (struct multiboot_tag_mmap*)t;
+    }
+    return NULL;
+}
+
+#define for_each_mmap_entry(mm, e) \
+    for (uint8_t *_p = (uint8_t*)(mm)->entries; \
+         _p + (mm)->entry_size <= (uint8_t*)(mm) + (mm)->size && ((e) = (struct multiboot_mmap_entry*)_p); \
+         _p += (mm)->entry_size)
+
+/* Find `size` bytes of available memory the boot HHDM already reaches, away
+ * from every reserved range. Used once, for the bitmap and the HHDM tables. */
+static uint64_t find_boot_region(struct multiboot_tag_mmap *mm, uint64_t size)
+{
+    struct multiboot_mmap_entry *e;
+    for_each_mmap_entry(mm, e) {
+        if (e->type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+        uint64_t start = PAGE_ALIGN_UP(e->addr);
+        uint64_t end = ALIGN_DOWN(e->addr + e->len, PMM_PAGE_SIZE);
+        if (end > PMM_BOOT_HHDM_LIMIT) end = PMM_BOOT_HHDM_LIMIT;
+
+        /* Slide the candidate past any reserved range it overlaps */
+        int moved = 1;
+        while (moved && start + size <= end) {
+            moved = 0;
+            for (unsigned i = 0; i < reserved_count; ++i) {
+                if (start < reserved[i].end && reserved[i].start < start + size) {
+                    start = reserved[i].end;
+                    moved = 1;
                 }
             }
         }
+        if (!moved && start + size <= end) return start;
+    }
+    return 0;
+}
+
+/* Page-table frames for the HHDM extension, bumped out of the boot region */
+static uint64_t early_next = 0;
+static uint64_t early_end = 0;
+
+static uint64_t early_alloc_table(void)
+{
+    if (early_next >= early_end) return 0;
+    uint64_t phys = early_next;
+    early_next += PMM_PAGE_SIZE;
+    memset(PHYS_TO_VIRT(phys), 0, PMM_PAGE_SIZE);
+    return phys;
+}
+
+static int cpu_has_1g_pages(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+    if (eax < 0x80000001) return 0;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001));
+    return (edx >> 26) & 1;
+}
+
+static int cpu_has_popcnt(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return (ecx >> 23) & 1;
+}
+
+/* Worst-case table frames extend_hhdm() needs to reach `limit` */
+static uint64_t hhdm_table_frames(uint64_t limit, int gb_pages)
+{
+    uint64_t frames = DIV_ROUND_UP(limit, 1ULL << 39);
+    if (!gb_pages) frames += DIV_ROUND_UP(limit, 1ULL << 30);
+    return frames;
+}
+
+#define HHDM_P  0x001ULL
+#define HHDM_W  0x002ULL
+#define HHDM_PS 0x080ULL
+
+/* boot.asm points PML4[0] (identity) and the HHDM slot at the same PDPT.
+ * Give the HHDM a private copy so growing it leaves the identity map alone,
+ * then map every GiB up to `limit` with 1GiB pages, or 2MiB pages when the
+ * CPU lacks them. */
+static int extend_hhdm(uint64_t limit, int gb_pages)
+{
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(cr3 & ~0xFFFULL);
+    unsigned slot = (TitanBootInfo.hhdm_base >> 39) & 511;
+
+    uint64_t pdpt_phys = early_alloc_table();
+    if (!pdpt_phys) return -1;
+    memcpy(PHYS_TO_VIRT(pdpt_phys), PHYS_TO_VIRT(pml4[slot] & ~0xFFFULL), PMM_PAGE_SIZE);
+    pml4[slot] = pdpt_phys | HHDM_P | HHDM_W;
+
+    for (uint64_t phys = PMM_BOOT_HHDM_LIMIT; phys < limit; phys += 1ULL << 30) {
+        unsigned i4 = slot + (phys >> 39);
+        if (i4 > 511) return -1;
+        if (!(pml4[i4] & HHDM_P)) {
+            uint64_t t = early_alloc_table();
+            if (!t) return -1;
+            pml4[i4] = t | HHDM_P | HHDM_W;
+        }
+        uint64_t *pdpt = (uint64_t*)PHYS_TO_VIRT(pml4[i4] & ~0xFFFULL);
+        unsigned i3 = (phys >> 30) & 511;
+        if (gb_pages) {
+            pdpt[i3] = phys | HHDM_P | HHDM_W | HHDM_PS;
+            continue;
+        }
+        uint64_t pd_phys = early_alloc_table();
+        if (!pd_phys) return -1;
+        uint64_t *pd = (uint64_t*)PHYS_TO_VIRT(pd_phys);
+        for (unsigned i2 = 0; i2 < 512; ++i2) {
+            uint64_t p = phys + ((uint64_t)i2 << 21);
+            if (p >= limit) break;
+            pd[i2] = p | HHDM_P | HHDM_W | HHDM_PS;
+        }
+        pdpt[i3] = pd_phys | HHDM_P | HHDM_W;
     }
 
-    /* Reserve frames used by the kernel image */
+    __asm__ volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    return 0;
+}
+
+#ifdef ENABLE_BENCH
+static uint64_t pmm_init_cycles;
+#endif
+
+void pmm_init(uint64_t multiboot_phys_addr)
+{
+#ifdef ENABLE_BENCH
+    uint64_t init_start = bench_rdtsc();
+#endif
+    uint64_t mb = multiboot_phys_addr;
+    if (!mb) {
+        kprintf("pmm_init: no multiboot info\n");
+        return;
+    }
+
+    struct multiboot_tag_mmap *mm = find_mmap(mb);
+    if (!mm) {
+        kprintf("pmm_init: no memory map\n");
+        return;
+    }
+
+    struct multiboot_mmap_entry *e;
+    uint64_t highest = 0;
+    for_each_mmap_entry(mm, e) {
+        if (e->type == MULTIBOOT_MEMORY_AVAILABLE && e->addr + e->len > highest)
+            highest = e->addr + e->len;
+    }
+    max_phys = highest;
+    total_frames = (max_phys + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+    pmm_bitmap_bytes = ALIGN_UP(DIV_ROUND_UP(total_frames, 8), 8);
+
+    /* Low memory below 1MiB (BIOS/IVT/EBDA areas) */
+    reserve_range(0, 0x100000);
+
+    /* Kernel image */
     extern char _kernel_phys_start[];
     extern char _kernel_load_end[];
     extern char _kernel_bss_end[];
     uint64_t kstart = (uint64_t)_kernel_phys_start;
     uint64_t kend = (uint64_t)_kernel_bss_end;
     if (kend == 0) kend = (uint64_t)_kernel_load_end;
-    if (kstart < kend) {
-        uint64_t fstart = kstart / PMM_PAGE_SIZE;
-        uint64_t fend = (kend + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
-        for (uint64_t f = fstart; f < fend && f < total_frames; ++f) set_frame_used(f);
-    }
+    reserve_range(kstart, kend);
 
-    /* Reserve low memory below 1MiB (BIOS/IVT/EBDA areas) */
-    uint64_t low_limit_frames = 0x100000 / PMM_PAGE_SIZE;
-    for (uint64_t f = 0; f < low_limit_frames && f < total_frames; ++f) set_frame_used(f);
-
-    /* Reserve the multiboot info block itself (so we don't clobber tags/modules) */
+    /* The multiboot info block itself (so we don't clobber tags/modules).
+     * mb2_addr is handed over as an HHDM pointer; the bitmap wants physical. */
     uint32_t mb_total_size = *(uint32_t*)mb;
     if (mb_total_size > 0) {
-        uint64_t mb_start = mb;
-        uint64_t mb_end = mb + mb_total_size;
-        uint64_t fstart = mb_start / PMM_PAGE_SIZE;
-        uint64_t fend = (mb_end + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
-        kprintf("pmm_init: reserving multiboot info frames 0x%llx-0x%llx (frames %llu..%llu)\n",
-                (unsigned long long)mb_start, (unsigned long long)mb_end, (unsigned long long)fstart, (unsigned long long)(fend-1));
-        for (uint64_t f = fstart; f < fend && f < total_frames; ++f) set_frame_used(f);
+        uint64_t mb_start = mb >= TitanBootInfo.hhdm_base ? VIRT_TO_PHYS(mb) : mb;
+        kprintf("pmm_init: reserving multiboot info 0x%llx-0x%llx\n",
+                (unsigned long long)mb_start, (unsigned long long)(mb_start + mb_total_size));
+        reserve_range(mb_start, mb_start + mb_total_size);
     }
 
-    /* Reserve any multiboot modules (initrd, etc) so they won't be allocated */
+    /* Multiboot modules (initrd, etc) */
     for (struct multiboot_tag *t = (struct multiboot_tag*)(mb + 8);
          t->type != MULTIBOOT_TAG_TYPE_END;
          t = (struct multiboot_tag*)((uint8_t*)t + ((t->size + 7) & ~7))) {
         if (t->type == MULTIBOOT_TAG_TYPE_MODULE) {
             struct multiboot_tag_module *m = (struct multiboot_tag_module*)t;
-            uint64_t mstart = (uint64_t)m->mod_start;
-            uint64_t mend = (uint64_t)m->mod_end;
-            if (mstart < mend) {
-                uint64_t fstart = mstart / PMM_PAGE_SIZE;
-                uint64_t fend = (mend + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
-                kprintf("pmm_init: reserving module frames 0x%llx-0x%llx (frames %llu..%llu)\n",
-                        (unsigned long long)mstart, (unsigned long long)mend, (unsigned long long)fstart, (unsigned long long)(fend-1));
-                for (uint64_t f = fstart; f < fend && f < total_frames; ++f) set_frame_used(f);
-            }
+            kprintf("pmm_init: reserving module 0x%llx-0x%llx\n",
+                    (unsigned long long)m->mod_start, (unsigned long long)m->mod_end);
+            reserve_range(m->mod_start, m->mod_end);
         }
     }
 
-    /* Count free frames */
-    free_frames = 0;
-    for (uint64_t f = 0; f < total_frames; ++f) if (frame_is_free(f)) free_frames++;
+    /* One boot region holds the bitmap and the per-CPU cache bitmap,
+     * followed by the HHDM page tables */
+    have_popcnt = cpu_has_popcnt();
+    int gb_pages = cpu_has_1g_pages();
+    uint64_t tables = max_phys > PMM_BOOT_HHDM_LIMIT ? hhdm_table_frames(max_phys, gb_pages) : 0;
+    uint64_t region_size = 2 * PAGE_ALIGN_UP(pmm_bitmap_bytes) + tables * PMM_PAGE_SIZE;
+    uint64_t region = find_boot_region(mm, region_size);
+    if (!region) {
+        kprintf(LOG_ERROR "pmm_init: no room for a %llu byte bitmap\n", (unsigned long long)region_size);
+        total_frames = 0;
+        return;
+    }
+    pmm_bitmap = (uint64_t*)PHYS_TO_VIRT(region);
+    pcp_cached = (uint64_t*)PHYS_TO_VIRT(region + PAGE_ALIGN_UP(pmm_bitmap_bytes));
+    early_next = region + 2 * PAGE_ALIGN_UP(pmm_bitmap_bytes);
+    early_end = region + region_size;
+
+    if (tables && extend_hhdm(max_phys, gb_pages) < 0) {
+        kprintf(LOG_ERROR "pmm_init: cannot map RAM above 4GiB, ignoring it\n");
+        max_phys = PMM_BOOT_HHDM_LIMIT;
+        total_frames = max_phys / PMM_PAGE_SIZE;
+    }
+    reserve_range(region, early_next);
+
+    /* Mark everything used, then free the available regions */
+    memset(pmm_bitmap, 0xFF, pmm_bitmap_bytes);
+    memset(pcp_cached, 0, pmm_bitmap_bytes);
+    for_each_mmap_entry(mm, e) {
+        if (e->type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+        uint64_t start = e->addr;
+        uint64_t end = e->addr + e->len;
+        if (start >= max_phys) continue;
+        if (end > max_phys) end = max_phys;
+        uint64_t fstart = DIV_ROUND_UP(start, PMM_PAGE_SIZE);
+        uint64_t fend = end / PMM_PAGE_SIZE;
+        if (fstart < fend) set_range_free(fstart, fend - fstart);
+    }
 
-    kprintf("pmm_init: max_phys=0x%llx total_frames=%llu free_frames=%zu\n", (unsigned long long)max_phys, (unsigned long long)total_frames, free_frames);
+    for (unsigned i = 0; i < reserved_count; ++i) {
+        uint64_t fstart = reserved[i].start / PMM_PAGE_SIZE;
+        uint64_t fend = reserved[i].end / PMM_PAGE_SIZE;
+        if (fend > total_frames) fend = total_frames;
+        if (fstart < fend) set_range_used(fstart, fend - fstart);
+    }
+
+    /* Build the buddy free lists from the runs of free frames */
+    for (unsigned o = 0; o <= PMM_MAX_ORDER; ++o) free_lists[o] = NULL;
+    for (uint64_t f = bitmap_find(0, total_frames, 0); f < total_frames; ) {
+        uint64_t end = bitmap_find(f, total_frames, 1);
+        buddy_push_range(f, end);
+        f = bitmap_find(end, total_frames, 0);
+    }
+    free_frames = bitmap_count_free();
+#ifdef ENABLE_BENCH
+    pmm_init_cycles = bench_rdtsc() - init_start;
+#endif
+
+    kprintf("pmm_init: max_phys=0x%llx total_frames=%llu free_frames=%zu bitmap=%llu bytes at 0x%llx\n",
+            (unsigned long long)max_phys, (unsigned long long)total_frames, free_frames,
+            (unsigned long long)pmm_bitmap_bytes, (unsigned long long)region);
 }
 
-uint64_t pmm_alloc_frame(void)
+static uint64_t buddy_alloc(unsigned order)
 {
-    if (free_frames == 0) return 0;
-    uint64_t frames = total_frames;
-    for (uint64_t b = 0; b < (total_frames + 7) / 8; ++b) {
-        uint8_t v = pmm_bitmap[b];
-        if (v == 0xFF) continue; /* all used */
-        /* find first zero bit */
-        for (int bit = 0; bit < 8; ++bit) {
-            uint64_t f = b * 8 + bit;
-            if (f >= frames) return 0;
-            if (frame_is_free(f)) {
-                set_frame_used(f);
-                free_frames--;
-                return f * PMM_PAGE_SIZE;
+    if (order > PMM_MAX_ORDER) return 0;
+
+    /* Smallest non-empty order that can satisfy the request */
+    unsigned o = order;
+    while (o <= PMM_MAX_ORDER && !free_lists[o]) ++o;
+    if (o > PMM_MAX_ORDER) return 0;
+
+    struct pmm_block *b = free_lists[o];
+    buddy_unlink(b);
+    uint64_t frame = block_to_frame(b);
+
+    /* Split, returning the upper halves, until the block has the wanted size */
+    while (o > order) {
+        --o;
+        buddy_push(frame + (1ULL << o), o);
+    }
+
+    set_range_used(frame, 1ULL << order);
+    free_frames -= 1ULL << order;
+    return frame * PMM_PAGE_SIZE;
+}
+
+static void buddy_free(uint64_t phys, unsigned order)
+{
+    if (order > PMM_MAX_ORDER) return;
+    if (phys % ((uint64_t)PMM_PAGE_SIZE << order)) return; /* not block aligned */
+    uint64_t f = phys / PMM_PAGE_SIZE;
+    uint64_t count = 1ULL << order;
+    if (f + count > total_frames) return;
+    if (frame_is_free(f)) return; /* double free */
+    if (pcp_is_cached(f)) return; /* still in a per-CPU cache */
+
+    set_range_free(f, count);
+    free_frames += count;
+    buddy_insert(f, order);
+}
+
+/* Where the next multi-block search starts, so repeated large allocations do
+ * not rescan the blocks earlier ones already took */
+static uint64_t contig_cursor = 0;
+
+/* Contiguous runs larger than one max-order block: find enough consecutive
+ * free max-order blocks and take them whole, returning the tail. */
+static uint64_t alloc_contig_large(uint64_t npages, uint64_t align_frames, uint64_t limit)
+{
+    const uint64_t block = 1ULL << PMM_MAX_ORDER;
+    uint64_t nblocks = DIV_ROUND_UP(npages, block);
+    uint64_t step = align_frames > block ? align_frames : block;
+    uint64_t from = contig_cursor < total_frames ? contig_cursor : 0;
+
+    /* Next-fit: scan from the cursor to the end, then wrap around and scan up
+     * to where the first pass began, plus enough to catch a straddling run */
+    for (int pass = 0; pass < 2; ++pass) {
+        uint64_t stop = pass ? from + nblocks * block : total_frames;
+        if (stop > total_frames) stop = total_frames;
+        uint64_t run = 0, start = 0;
+        uint64_t f = pass ? 0 : ALIGN_UP(from, block);
+
+        while (f + block <= stop) {
+            if (!is_free_head(f, PMM_MAX_ORDER)) {
+                /* A free head is a free frame: skip used words wholesale */
+                run = 0;
+                f = ALIGN_UP(bitmap_find(f + block, stop, 0), block);
+                continue;
+            }
+            if (run == 0) {
+                if (f % step) { f += block; continue; }
+                start = f;
+            }
+            f += block;
+            if (++run < nblocks) continue;
+            if (start + npages > limit) break; /* every later run starts higher */
+
+            for (uint64_t i = 0; i < nblocks; ++i) buddy_unlink(frame_to_block(start + i * block));
+            set_range_used(start, npages);
+            free_frames -= npages;
+            buddy_push_range(start + npages, start + nblocks * block);
+            contig_cursor = start + nblocks * block;
+            return start * PMM_PAGE_SIZE;
+        }
+        if (from == 0) break;
+    }
+    return 0;
+}
+
+static uint64_t contig_alloc(size_t npages, uint64_t align, uint64_t max_phys)
+{
+    if (npages == 0) return 0;
+    if (align < PMM_PAGE_SIZE) align = PMM_PAGE_SIZE;
+    if (align & (align - 1)) return 0;
+    uint64_t limit = max_phys ? max_phys / PMM_PAGE_SIZE : total_frames;
+
+    /* Buddy blocks are aligned to their size, so one block of this order
+     * satisfies both the length and the alignment */
+    unsigned order = 0;
+    while ((1ULL << order) < npages || ((uint64_t)PMM_PAGE_SIZE << order) < align) ++order;
+    if (order > PMM_MAX_ORDER) return alloc_contig_large(npages, align / PMM_PAGE_SIZE, limit);
+
+    for (unsigned o = order; o <= PMM_MAX_ORDER; ++o) {
+        for (struct pmm_block *b = free_lists[o]; b; b = b->next) {
+            uint64_t frame = block_to_frame(b);
+            if (frame + npages > limit) continue;
+
+            buddy_unlink(b);
+            while (o > order) {
+                --o;
+                buddy_push(frame + (1ULL << o), o);
             }
+            set_range_used(frame, npages);
+            free_frames -= npages;
+            /* The run sits at the base of the block: give back what follows it */
+            buddy_push_range(frame + npages, frame + (1ULL << order));
+            return frame * PMM_PAGE_SIZE;
         }
     }
     return 0;
 }
 
+/* Return every frame cached on this CPU to the buddy lists, so they can merge
+ * again when a larger allocation fails. Returns the number of frames moved. */
+static uint32_t pcp_drain_local(void)
+{
+    uint64_t flags = irq_save();
+    uint32_t cpu = smp_cpu_index();
+    uint32_t n = 0;
+    if (cpu < PMM_PCP_CPUS && pcp[cpu].count) {
+        struct pmm_pcp *pc = &pcp[cpu];
+        spin_lock(&pmm_lock);
+        for (uint32_t i = 0; i < pc->count; ++i) {
+            pcp_clear_cached(pc->frames[i] / PMM_PAGE_SIZE);
+            buddy_free(pc->frames[i], 0);
+        }
+        spin_unlock(&pmm_lock);
+        n = pc->count;
+        pc->count = 0;
+    }
+    irq_restore(flags);
+    return n;
+}
+
+/* Give the pre-zeroed pool back to the buddy lists; the idle loop refills it */
+static uint32_t zero_pool_release(void)
+{
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    uint32_t n = zero_count;
+    spin_lock(&pmm_lock);
+    for (uint32_t i = 0; i < n; ++i) buddy_free(zero_pool[i], 0);
+    spin_unlock(&pmm_lock);
+    zero_count = 0;
+    spin_unlock_irqrestore(&zero_lock, flags);
+    return n;
+}
+
+/* Callbacks of allocators that hold frames they could give back */
+#define PMM_MAX_RECLAIM 4
+static size_t (*reclaim_hooks[PMM_MAX_RECLAIM])(void);
+static unsigned reclaim_hook_count = 0;
+
+void pmm_register_reclaim(size_t (*fn)(void))
+{
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (reclaim_hook_count < PMM_MAX_RECLAIM) reclaim_hooks[reclaim_hook_count++] = fn;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/* Frames parked outside the buddy lists, returned before reporting failure.
+ * The registered allocators are only asked once our own caches are empty. */
+static uint32_t reclaim_cached(void)
+{
+    uint32_t n = pcp_drain_local() + zero_pool_release();
+    for (unsigned i = 0; !n && i < reclaim_hook_count; ++i) n += (uint32_t)reclaim_hooks[i]();
+    return n;
+}
+
+uint64_t pmm_alloc_pages(unsigned order)
+{
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        uint64_t phys = buddy_alloc(order);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (phys || !reclaim_cached()) return phys;
+    }
+}
+
+void pmm_free_pages(uint64_t phys, unsigned order)
+{
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    buddy_free(phys, order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+uint64_t pmm_alloc_contig(size_t npages, uint64_t align, uint64_t max_phys)
+{
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        uint64_t phys = contig_alloc(npages, align, max_phys);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (phys || !reclaim_cached()) return phys;
+    }
+}
+
+void pmm_free_contig(uint64_t phys, size_t npages)
+{
+    if (phys % PMM_PAGE_SIZE) return;
+    uint64_t f = phys / PMM_PAGE_SIZE;
+    uint64_t end = f + npages;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    while (f < end) {
+        unsigned order = max_block_order(f, end);
+        buddy_free(f * PMM_PAGE_SIZE, order);
+        f += 1ULL << order;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/* Single frames go through the per-CPU cache: the global lock is only taken
+ * to move PMM_PCP_BATCH frames at a time when the cache runs empty or full. */
+uint64_t pmm_alloc_frame(void)
+{
+    uint64_t flags = irq_save();
+    uint32_t cpu = smp_cpu_index();
+    if (cpu >= PMM_PCP_CPUS) {
+        irq_restore(flags);
+        return pmm_alloc_pages(0);
+    }
+
+    struct pmm_pcp *pc = &pcp[cpu];
+    if (pc->count) {
+        pc->hits++;
+    } else {
+        pc->misses++;
+        spin_lock(&pmm_lock);
+        while (pc->count < PMM_PCP_BATCH) {
+            uint64_t phys = buddy_alloc(0);
+            if (!phys) break;
+            pcp_mark_cached(phys / PMM_PAGE_SIZE);
+            pc->frames[pc->count++] = phys;
+        }
+        spin_unlock(&pmm_lock);
+        if (!pc->count) {
+            /* The slow path reclaims before giving up */
+            irq_restore(flags);
+            return pmm_alloc_pages(0);
+        }
+    }
+    uint64_t phys = pc->frames[--pc->count];
+    pcp_clear_cached(phys / PMM_PAGE_SIZE);
+    irq_restore(flags);
+    return phys;
+}
+
 void pmm_free_frame(uint64_t phys)
 {
     if (phys % PMM_PAGE_SIZE) return; /* not aligned */
     uint64_t f = phys / PMM_PAGE_SIZE;
     if (f >= total_frames) return;
-    if (!frame_is_free(f)) {
-        set_frame_free(f);
-        free_frames++;
+
+    /* Ignore a frame that is free already: in the buddy lists (its bitmap
+     * bit only changes under pmm_lock) or in a per-CPU cache */
+    uint64_t used = __atomic_load_n(&pmm_bitmap[f >> 6], __ATOMIC_ACQUIRE);
+    if (!((used >> (f & 63)) & 1)) return;
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = smp_cpu_index();
+    if (cpu >= PMM_PCP_CPUS) {
+        irq_restore(flags);
+        pmm_free_pages(phys, 0);
+        return;
+    }
+
+    if (!pcp_mark_cached(f)) {
+        irq_restore(flags);
+        return;
+    }
+
+    struct pmm_pcp *pc = &pcp[cpu];
+    if (pc->count == PMM_PCP_HIGH) {
+        /* Drain the oldest (coldest) batch; the hot end stays cached */
+        pc->drains++;
+        spin_lock(&pmm_lock);
+        for (uint32_t i = 0; i < PMM_PCP_BATCH; ++i) {
+            pcp_clear_cached(pc->frames[i] / PMM_PAGE_SIZE);
+            buddy_free(pc->frames[i], 0);
+        }
+        spin_unlock(&pmm_lock);
+        pc->count -= PMM_PCP_BATCH;
+        memmove(pc->frames, pc->frames + PMM_PCP_BATCH, pc->count * sizeof(pc->frames[0]));
+    }
+    pc->frames[pc->count++] = phys;
+    irq_restore(flags);
+}
+
+/* Zero a frame with non-temporal stores, so background zeroing does not
+ * evict the working set from the cache. Callers fence with sfence. */
+static void zero_frame_nt(uint64_t phys)
+{
+    memzero_nt(PHYS_TO_VIRT(phys), PMM_PAGE_SIZE);
+}
+
+uint64_t pmm_alloc_zeroed_frame(void)
+{
+    uint64_t phys = 0;
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    if (zero_count) {
+        phys = zero_pool[--zero_count];
+        zero_hits++;
+    } else {
+        zero_misses++;
+    }
+    spin_unlock_irqrestore(&zero_lock, flags);
+    if (phys) return phys;
+
+    /* Pool ran dry: pay for the zeroing here */
+    phys = pmm_alloc_frame();
+    if (phys) memset(PHYS_TO_VIRT(phys), 0, PMM_PAGE_SIZE);
+    return phys;
+}
+
+size_t pmm_zero_pool_refill(void)
+{
+    uint64_t batch[PMM_ZERO_BATCH];
+    size_t n = 0;
+
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    size_t want = PMM_ZERO_POOL - zero_count;
+    spin_unlock_irqrestore(&zero_lock, flags);
+    if (want > PMM_ZERO_BATCH) want = PMM_ZERO_BATCH;
+
+    /* Take frames straight from the buddy lists: the allocation paths would
+     * reclaim, and reclaiming releases this very pool, so a refill under
+     * memory pressure would hand it back and take it again forever. */
+    flags = spin_lock_irqsave(&pmm_lock);
+    while (n < want && free_frames > PMM_ZERO_RESERVE) {
+        uint64_t phys = buddy_alloc(0);
+        if (!phys) break;
+        batch[n++] = phys;
     }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    if (!n) return 0;
+
+    /* Zero outside the locks, then publish the batch in one go */
+    for (size_t i = 0; i < n; ++i) zero_frame_nt(batch[i]);
+    __asm__ volatile("sfence" ::: "memory");
+
+    size_t added = 0;
+    flags = spin_lock_irqsave(&zero_lock);
+    while (added < n && zero_count < PMM_ZERO_POOL) zero_pool[zero_count++] = batch[added++];
+    spin_unlock_irqrestore(&zero_lock, flags);
+    for (size_t i = added; i < n; ++i) pmm_free_frame(batch[i]);
+    return added;
 }
 
+size_t pmm_frame_count(void) { return (size_t)total_frames; }
+
 size_t pmm_free_count(void)
 {
-    return free_frames;
+    size_t n = free_frames;
+    for (int cpu = 0; cpu < PMM_PCP_CPUS; ++cpu) n += pcp[cpu].count;
+    return n + zero_count;
+}
+
+void pmm_print_stats(void)
+{
+    for (int cpu = 0; cpu < PMM_PCP_CPUS; ++cpu) {
+        struct pmm_pcp *pc = &pcp[cpu];
+        uint64_t total = pc->hits + pc->misses;
+        if (!total && !pc->drains) continue;
+        kprintf(LOG_INFO "pmm: cpu%d cached=%u hits=%llu misses=%llu drains=%llu hit rate=%llu%%\n",
+                cpu, pc->count, (unsigned long long)pc->hits, (unsigned long long)pc->misses,
+                (unsigned long long)pc->drains, (unsigned long long)(total ? pc->hits * 100 / total : 0));
+    }
+    uint64_t ztotal = zero_hits + zero_misses;
+    kprintf(LOG_INFO "pmm: zeroed pool=%u hits=%llu misses=%llu hit rate=%llu%%\n",
+            zero_count, (unsigned long long)zero_hits, (unsigned long long)zero_misses,
+            (unsigned long long)(ztotal ? zero_hits * 100 / ztotal : 0));
+}
+
+#ifdef ENABLE_BENCH
+/* The allocator this replaced: first-fit byte scan of the bitmap from frame 0 */
+static uint64_t bench_bitmap_alloc(void)
+{
+    const uint8_t *bytes = (const uint8_t*)pmm_bitmap;
+    for (uint64_t b = 0; b < (total_frames + 7) / 8; ++b) {
+        if (bytes[b] == 0xFF) continue;
+        for (int bit = 0; bit < 8; ++bit) {
+            uint64_t f = b * 8 + bit;
+            if (f >= total_frames) return 0;
+            if (frame_is_free(f)) { set_frame_used(f); return f; }
+        }
+    }
+    return 0;
+}
+
+/* The same search done a word at a time from a rotating next-fit cursor */
+static uint64_t bench_cursor = 0;
+
+static uint64_t bench_word_alloc(void)
+{
+    uint64_t f = bitmap_find(bench_cursor, total_frames, 0);
+    if (f == total_frames) f = bitmap_find(0, bench_cursor, 0);
+    if (f >= total_frames || !frame_is_free(f)) return 0;
+    set_frame_used(f);
+    bench_cursor = f + 1;
+    return f;
+}
+
+static uint64_t bench_bit_count_free(void)
+{
+    uint64_t n = 0;
+    for (uint64_t f = 0; f < total_frames; ++f) n += frame_is_free(f);
+    return n;
+}
+
+void pmm_bench(void)
+{
+    enum { N = 4096 };
+    static uint64_t frames[N];
+
+    uint64_t t0 = bench_rdtsc();
+    for (int i = 0; i < N; ++i) frames[i] = pmm_alloc_frame();
+    uint64_t t1 = bench_rdtsc();
+    for (int i = 0; i < N; ++i) pmm_free_frame(frames[i]);
+    uint64_t t2 = bench_rdtsc();
+
+    for (int i = 0; i < N; ++i) frames[i] = pmm_alloc_pages(0);
+    uint64_t t3 = bench_rdtsc();
+    for (int i = 0; i < N; ++i) pmm_free_pages(frames[i], 0);
+    uint64_t t4 = bench_rdtsc();
+
+    /* Frames taken by the scan are still free in the buddy lists: only the
+     * bitmap bits are flipped, and they are flipped back afterwards. */
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t t5 = bench_rdtsc();
+    for (int i = 0; i < N; ++i) frames[i] = bench_bitmap_alloc();
+    uint64_t t6 = bench_rdtsc();
+    for (int i = 0; i < N; ++i) if (frames[i]) set_frame_free(frames[i]);
+    uint64_t s0 = bench_rdtsc();
+    for (int i = 0; i < N; ++i) frames[i] = bench_word_alloc();
+    uint64_t s1 = bench_rdtsc();
+    for (int i = 0; i < N; ++i) if (frames[i]) set_frame_free(frames[i]);
+    uint64_t s2 = bench_rdtsc();
+    uint64_t bit_free = bench_bit_count_free();
+    uint64_t s3 = bench_rdtsc();
+    uint64_t word_free = bitmap_count_free();
+    uint64_t s4 = bench_rdtsc();
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    /* Zeroed frames: from a full pool vs. allocate-then-memset */
+    while (pmm_zero_pool_refill()) ;
+    uint64_t z0 = bench_rdtsc();
+    for (int i = 0; i < PMM_ZERO_POOL; ++i) frames[i] = pmm_alloc_zeroed_frame();
+    uint64_t z1 = bench_rdtsc();
+    for (int i = 0; i < PMM_ZERO_POOL; ++i) pmm_free_frame(frames[i]);
+    uint64_t z2 = bench_rdtsc();
+    for (int i = 0; i < PMM_ZERO_POOL; ++i) {
+        frames[i] = pmm_alloc_frame();
+        if (frames[i]) memset(PHYS_TO_VIRT(frames[i]), 0, PMM_PAGE_SIZE);
+    }
+    uint64_t z3 = bench_rdtsc();
+    for (int i = 0; i < PMM_ZERO_POOL; ++i) pmm_free_frame(frames[i]);
+
+    uint64_t t7 = bench_rdtsc();
+    for (int i = 0; i < 64; ++i) frames[i] = pmm_alloc_pages(9);
+    uint64_t t8 = bench_rdtsc();
+    for (int i = 0; i < 64; ++i) if (frames[i]) pmm_free_pages(frames[i], 9);
+
+    kprintf(LOG_INFO "pmm bench: %d frames: cached alloc %llu cyc/op, free %llu cyc/op\n",
+            N, (unsigned long long)((t1 - t0) / N), (unsigned long long)((t2 - t1) / N));
+    kprintf(LOG_INFO "pmm bench: %d frames: buddy alloc %llu cyc/op, free %llu cyc/op\n",
+            N, (unsigned long long)((t3 - t2) / N), (unsigned long long)((t4 - t3) / N));
+    kprintf(LOG_INFO "pmm bench: 2MiB blocks: buddy alloc %llu cyc/op\n",
+            (unsigned long long)((t8 - t7) / 64));
+    kprintf(LOG_INFO "pmm bench: free-frame search: bit scan from 0 %llu cyc/op, word next-fit %llu cyc/op\n",
+            (unsigned long long)((t6 - t5) / N), (unsigned long long)((s1 - s0) / N));
+    kprintf(LOG_INFO "pmm bench: count %llu frames: per bit %llu cyc, popcnt %llu cyc (%llu/%llu free)\n",
+            (unsigned long long)total_frames, (unsigned long long)(s3 - s2), (unsigned long long)(s4 - s3),
+            (unsigned long long)bit_free, (unsigned long long)word_free);
+    kprintf(LOG_INFO "pmm bench: zeroed frame: pool %llu cyc/op, alloc+memset %llu cyc/op\n",
+            (unsigned long long)((z1 - z0) / PMM_ZERO_POOL), (unsigned long long)((z3 - z2) / PMM_ZERO_POOL));
+    kprintf(LOG_INFO "pmm bench: pmm_init took %llu cycles\n", (unsigned long long)pmm_init_cycles);
+    pmm_print_stats();
 }
+#endif
@@ -3,33 +3,225 @@
 #include <kernel/kprintf.h>
 #include <common/boot.h>
 #include <lib/string.h>
+#include <lib/spinlock.h>
+#include <lib/alloc.h>
+#include <drivers/smp.h>
 #include <stdint.h>
 static const size_t slab_sizes[] = {16,32,64,128,256,512,1024,2048};
+static const char *const slab_names[] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
 #define SLAB_CLASS_COUNT (sizeof(slab_sizes)/sizeof(slab_sizes[0]))
 
+/* Slab metadata lives off the page, in a descriptor per frame indexed by
+ * PFN: a free finds its page and cache with one lookup, and objects can use
+ * the whole page. Free objects are chained by in-page offsets. */
 struct slab_page {
-    struct slab_page *next;
-    uint32_t obj_size;
+    uint32_t next;        /* PFN links on the cache's full/partial/empty list */
+    uint32_t prev;
+    uint16_t cache;       /* cache_table index, 0 if the frame is not a slab */
     uint16_t free_count;
-    uint16_t objs_per_page;
-    void *free_list; /* pointer to first free object */
+    uint16_t free_off;    /* offset of the first free object */
+    uint16_t pad;
+};
+
+#define SLAB_NO_PAGE 0xFFFFFFFFu
+#define SLAB_NO_OBJ  0xFFFFu
+
+/* Doubly linked list of slab pages, linked through their descriptors */
+struct slab_list {
+    uint32_t head;
+    uint32_t count;
 };
 
+/* Empty pages a cache keeps instead of returning them at once, so alloc/free
+ * bursts around a page boundary do not bounce frames through the PMM.
+ * slab_reclaim() gives them back under memory pressure. */
+#define SLAB_EMPTY_KEEP 2
+
+static struct slab_page *slab_pages = NULL;
+static size_t slab_page_count = 0;
+
+/* Magazines: per-CPU stacks of free objects (Bonwick's scheme). Each CPU
+ * has a loaded and a previous magazine per cache and works on them with
+ * interrupts off but no lock; when both are exhausted it trades a whole
+ * magazine with the cache's depot in O(1). Only the depot and the page
+ * layer take locks. */
 struct magazine {
-    void *objs[SLAB_MAGAZINE_SIZE];
-    uint16_t count;
+    struct magazine *next;   /* depot list */
+    uint32_t rounds;
+    uint32_t pad;
+    void *objs[SLAB_MAG_MAX];
 };
 
-struct slab_cache {
-    size_t obj_size;
-    struct slab_page *partial; /* pages with free objects */
-    struct magazine mags[SLAB_MAX_CPUS]; /* per-cpu magazines */
+/* Full magazines kept per depot; beyond this they go back to the pages */
+#define SLAB_DEPOT_FULL_MAX 8
+
+/* Counters are only written by their CPU; a line per CPU keeps them (and the
+ * magazine pointers) from bouncing between CPUs */
+struct slab_cpu {
+    struct magazine *loaded;
+    struct magazine *prev;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;       /* served by the loaded or previous magazine */
+    uint64_t misses;     /* went to the depot or the pages */
+    uint64_t waste;      /* bytes of stride not asked for, summed over allocs */
+} __attribute__((aligned(64)));
+
+struct kmem_cache {
+    char name[KMEM_NAME_MAX];
+    uint16_t id;         /* index in cache_table */
+    size_t obj_size;     /* as requested */
+    size_t stride;       /* distance between objects */
+    size_t link_off;     /* where a free object keeps its free-list link */
+    uint16_t objs_per_page;
+    uint32_t mag_size;
+    void (*ctor)(void *obj);
+
+    spinlock_t lock;            /* page layer */
+    struct slab_list slabs_full;     /* no free object */
+    struct slab_list slabs_partial;
+    struct slab_list slabs_empty;    /* retained, at most SLAB_EMPTY_KEEP */
+
+    spinlock_t depot_lock;
+    struct magazine *full;
+    struct magazine *empty;
+    uint32_t full_count;
+
+    struct slab_cpu *cpus;      /* slab_cpu_count entries, or NULL */
+    struct slab_cpu direct;     /* counters updated off the per-CPU path, atomically */
+    struct kmem_cache *next;    /* all caches */
 };
 
-static struct slab_cache caches[SLAB_CLASS_COUNT];
+static struct kmem_cache kmalloc_caches[SLAB_CLASS_COUNT];
+static uint32_t slab_cpu_count = 0;
+
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+static struct kmem_cache *cache_list = NULL;
 
-/* current CPU id stub (returns 0 for now) - replace with SMP-aware routine later */
-static inline int get_cpu_id(void) { return 0; }
+/* Descriptors name their cache by a 16-bit index into this table */
+#define SLAB_MAX_CACHES 256
+static struct kmem_cache *cache_table[SLAB_MAX_CACHES];
+
+/* Table entry of a destroyed cache whose pages still hold objects: keeps the
+ * id reserved, and a late free of one of those objects is caught */
+#define SLAB_CACHE_DEAD ((struct kmem_cache *)1)
+
+/* Magazines are carved from whole frames and recycled, never returned */
+static spinlock_t mag_pool_lock = SPINLOCK_INIT;
+static struct magazine *mag_pool = NULL;
+
+static struct magazine *mag_alloc(void)
+{
+    spin_lock(&mag_pool_lock);
+    if (!mag_pool) {
+        /* Not under the lock: the PMM may call back into slab_reclaim */
+        spin_unlock(&mag_pool_lock);
+        uint64_t phys = pmm_alloc_frame();
+        spin_lock(&mag_pool_lock);
+        if (phys) {
+            struct magazine *m = (struct magazine*)PHYS_TO_VIRT(phys);
+            for (size_t i = 0; i < PAGE_SIZE / sizeof(*m); ++i) {
+                m[i].next = mag_pool;
+                mag_pool = &m[i];
+            }
+        }
+    }
+    struct magazine *m = mag_pool;
+    if (m) mag_pool = m->next;
+    spin_unlock(&mag_pool_lock);
+    if (m) m->rounds = 0;
+    return m;
+}
+
+static void mag_free(struct magazine *m)
+{
+    spin_lock(&mag_pool_lock);
+    m->next = mag_pool;
+    mag_pool = m;
+    spin_unlock(&mag_pool_lock);
+}
+
+/* Rounds per magazine: small objects are cheap to hold, large ones pin more
+ * memory per magazine */
+static uint32_t mag_size_for(size_t stride)
+{
+    if (stride <= 64) return SLAB_MAG_MAX;
+    if (stride <= 128) return 48;
+    if (stride <= 256) return 32;
+    if (stride <= 512) return 16;
+    if (stride <= 1024) return 8;
+    return 4;
+}
+
+static inline struct slab_cpu *slab_this_cpu(struct kmem_cache *c)
+{
+    if (!c->cpus) return NULL;
+    uint32_t cpu = smp_cpu_index();
+    return cpu < slab_cpu_count ? &c->cpus[cpu] : NULL;
+}
+
+static inline uint16_t *obj_link(struct kmem_cache *c, void *obj)
+{
+    return (uint16_t*)((uint8_t*)obj + c->link_off);
+}
+
+static inline uint32_t page_pfn(const struct slab_page *sp)
+{
+    return (uint32_t)(sp - slab_pages);
+}
+
+static inline uint8_t *page_base(const struct slab_page *sp)
+{
+    return (uint8_t*)PHYS_TO_VIRT((uint64_t)page_pfn(sp) * PAGE_SIZE);
+}
+
+/* Descriptor of the slab page holding `ptr`, NULL if it is not in one */
+static inline struct slab_page *page_of(const void *ptr)
+{
+    uint64_t pfn = VIRT_TO_PHYS(ptr) / PAGE_SIZE;
+    if (pfn >= slab_page_count || !slab_pages[pfn].cache) return NULL;
+    return &slab_pages[pfn];
+}
+
+static void list_push(struct slab_list *l, struct slab_page *sp)
+{
+    uint32_t pfn = page_pfn(sp);
+    sp->prev = SLAB_NO_PAGE;
+    sp->next = l->head;
+    if (l->head != SLAB_NO_PAGE) slab_pages[l->head].prev = pfn;
+    l->head = pfn;
+    l->count++;
+}
+
+static void list_remove(struct slab_list *l, struct slab_page *sp)
+{
+    if (sp->prev != SLAB_NO_PAGE) slab_pages[sp->prev].next = sp->next;
+    else l->head = sp->next;
+    if (sp->next != SLAB_NO_PAGE) slab_pages[sp->next].prev = sp->prev;
+    l->count--;
+}
+
+static inline void list_init(struct slab_list *l)
+{
+    l->head = SLAB_NO_PAGE;
+    l->count = 0;
+}
+
+/* The list a page belongs on, going by its free count */
+static inline struct slab_list *list_for(struct kmem_cache *c, const struct slab_page *sp)
+{
+    if (sp->free_count == 0) return &c->slabs_full;
+    if (sp->free_count == c->objs_per_page) return &c->slabs_empty;
+    return &c->slabs_partial;
+}
+
+static inline uint32_t cache_pages(const struct kmem_cache *c)
+{
+    return c->slabs_full.count + c->slabs_partial.count + c->slabs_empty.count;
+}
 
 static int size_to_index(size_t sz)
 {
@@ -37,124 +229,520 @@ static int size_to_index(size_t sz)
     return -1;
 }
 
-static struct slab_page *create_slab_page(size_t obj_size)
+/* Lay out a cache: objects `stride` apart from the start of the page. With a
+ * constructor the free-list link goes after the object, so constructed state
+ * survives a trip through the free list. */
+static int cache_setup(struct kmem_cache *c, const char *name, size_t size, size_t align,
+                       void (*ctor)(void *))
+{
+    if (align == 0) align = sizeof(void*);
+    if (align & (align - 1) || size == 0) return -1;
+
+    memset(c, 0, sizeof(*c));
+    size_t len = strlen(name);
+    memcpy(c->name, name, len < KMEM_NAME_MAX ? len : KMEM_NAME_MAX - 1);
+    c->obj_size = size;
+    c->ctor = ctor;
+    c->link_off = ctor ? ALIGN_UP(size, sizeof(void*)) : 0;
+    size_t span = ctor ? c->link_off + sizeof(uint16_t) : (size < sizeof(void*) ? sizeof(void*) : size);
+    c->stride = ALIGN_UP(span, align);
+    if (c->stride > PAGE_SIZE) return -1;
+    c->objs_per_page = (uint16_t)(PAGE_SIZE / c->stride);
+    c->mag_size = mag_size_for(c->stride);
+    list_init(&c->slabs_full);
+    list_init(&c->slabs_partial);
+    list_init(&c->slabs_empty);
+    return 0;
+}
+
+static int cache_register(struct kmem_cache *c)
+{
+    int ret = -1;
+    spin_lock(&cache_list_lock);
+    for (uint16_t i = 1; i < SLAB_MAX_CACHES; ++i) {
+        if (cache_table[i]) continue;
+        cache_table[i] = c;
+        c->id = i;
+        c->next = cache_list;
+        cache_list = c;
+        ret = 0;
+        break;
+    }
+    spin_unlock(&cache_list_lock);
+    return ret;
+}
+
+static struct slab_page *create_slab_page(struct kmem_cache *c)
 {
-    uint64_t phys = pmm_alloc_frame();
+    uint64_t phys = pmm_alloc_zeroed_frame();
     if (!phys) return NULL;
-    void *base = PHYS_TO_VIRT(phys);
-    memset(base, 0, PAGE_SIZE);
-    struct slab_page *sp = (struct slab_page*)base;
-    sp->next = NULL;
-    sp->obj_size = (uint32_t)obj_size;
-
-    size_t hdr = sizeof(struct slab_page);
-    size_t usable = PAGE_SIZE - hdr;
-    sp->objs_per_page = (uint16_t)(usable / obj_size);
-    sp->free_count = sp->objs_per_page;
-    sp->free_list = NULL;
-
-    uint8_t *data = (uint8_t*)base + hdr;
-    for (size_t i = 0; i < sp->objs_per_page; ++i) {
-        void *obj = data + i * obj_size;
-        /* store next pointer in the object itself */
-        *(void**)obj = sp->free_list;
-        sp->free_list = obj;
+    if (phys / PAGE_SIZE >= slab_page_count) {
+        pmm_free_frame(phys);
+        return NULL;
+    }
+    struct slab_page *sp = &slab_pages[phys / PAGE_SIZE];
+    sp->cache = c->id;
+    sp->free_count = c->objs_per_page;
+    sp->free_off = SLAB_NO_OBJ;
+
+    uint8_t *data = (uint8_t*)PHYS_TO_VIRT(phys);
+    for (size_t i = c->objs_per_page; i-- > 0;) {
+        void *obj = data + i * c->stride;
+        if (c->ctor) c->ctor(obj);
+        *obj_link(c, obj) = sp->free_off;
+        sp->free_off = (uint16_t)(i * c->stride);
     }
     return sp;
 }
 
 void slab_init(void)
 {
+    /* One descriptor per frame the PMM can hand out */
+    size_t frames = pmm_frame_count();
+    uint64_t desc = pmm_alloc_contig(DIV_ROUND_UP(frames * sizeof(struct slab_page), PAGE_SIZE), 0, 0);
+    if (!desc) {
+        kprintf(LOG_ERROR "slab: cannot allocate page descriptors for %zu frames\n", frames);
+        return;
+    }
+    slab_pages = (struct slab_page*)PHYS_TO_VIRT(desc);
+    memset(slab_pages, 0, frames * sizeof(struct slab_page));
+    slab_page_count = frames;
+
+    uint32_t n = TitanBootInfo.smp_info.cpu_count;
+    if (n == 0) n = 1;
+
+    /* Per-CPU magazine slots of the size classes come straight from the PMM:
+     * kmalloc is what they are being set up for */
+    size_t bytes = SLAB_CLASS_COUNT * n * sizeof(struct slab_cpu);
+    uint64_t phys = pmm_alloc_contig(DIV_ROUND_UP(bytes, PAGE_SIZE), 0, 0);
+    struct slab_cpu *cpus = NULL;
+    if (phys) {
+        cpus = (struct slab_cpu*)PHYS_TO_VIRT(phys);
+        memset(cpus, 0, bytes);
+        slab_cpu_count = n;
+    } else {
+        kprintf(LOG_WARN "slab: no memory for per-CPU magazines, using the page lists only\n");
+    }
+
     for (size_t i = 0; i < SLAB_CLASS_COUNT; ++i) {
-        caches[i].obj_size = slab_sizes[i];
-        caches[i].partial = NULL;
-        for (size_t c = 0; c < SLAB_MAX_CPUS; ++c) {
-            caches[i].mags[c].count = 0;
-        }
+        struct kmem_cache *c = &kmalloc_caches[i];
+        size_t align = slab_sizes[i] < KMEM_CACHE_LINE ? slab_sizes[i] : KMEM_CACHE_LINE;
+        cache_setup(c, slab_names[i], slab_sizes[i], align, NULL);
+        c->cpus = cpus ? cpus + i * n : NULL;
+        cache_register(c);
     }
-    kprintf("slab: initialized size classes up to %zu, mags=%d cpus size=%d\n",
-            slab_sizes[SLAB_CLASS_COUNT-1], SLAB_MAX_CPUS, SLAB_MAGAZINE_SIZE);
+    pmm_register_reclaim(slab_reclaim);
+    kprintf("slab: initialized size classes up to %zu, magazines for %u cpus (%u..%u rounds)\n",
+            slab_sizes[SLAB_CLASS_COUNT-1], slab_cpu_count,
+            kmalloc_caches[SLAB_CLASS_COUNT-1].mag_size, kmalloc_caches[0].mag_size);
 }
 
-void *slab_alloc(size_t size)
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                     void (*ctor)(void *obj))
 {
-    int idx = size_to_index(size);
-    if (idx < 0) return NULL; /* too big for slab */
+    struct kmem_cache *c = kmalloc(sizeof(*c));
+    if (!c) return NULL;
+    if (cache_setup(c, name, size, align, ctor) < 0 || cache_register(c) < 0) {
+        kprintf(LOG_ERROR "slab: cannot create cache %s (size %zu, align %zu)\n", name, size, align);
+        kfree(c);
+        return NULL;
+    }
+    if (slab_cpu_count) {
+        c->cpus = kmalloc(slab_cpu_count * sizeof(struct slab_cpu));
+        if (c->cpus) memset(c->cpus, 0, slab_cpu_count * sizeof(struct slab_cpu));
+    }
+    kprintf(LOG_INFO "slab: cache %s: %zu-byte objects, stride %zu, %u per page\n",
+            c->name, c->obj_size, c->stride, c->objs_per_page);
+    return c;
+}
 
-    struct slab_cache *c = &caches[idx];
-    int cpu = get_cpu_id();
+static void release_page(struct slab_page *sp)
+{
+    sp->cache = 0;
+    pmm_free_frame((uint64_t)page_pfn(sp) * PAGE_SIZE);
+}
 
-    /* Try pop from magazine first (per-cpu, lockless for now) */
-    struct magazine *m = &c->mags[cpu];
-    if (m->count > 0) {
-        void *obj = m->objs[--m->count];
-        return obj;
-    }
+/* Page layer: one object from the cache's pages, preferring partial pages
+ * over retained empty ones. A new page is built outside the lock (the PMM
+ * may call back into slab_reclaim). */
+static void *page_alloc_obj(struct kmem_cache *c)
+{
+    spin_lock(&c->lock);
+    struct slab_page *sp = NULL;
+    if (c->slabs_partial.head != SLAB_NO_PAGE) sp = &slab_pages[c->slabs_partial.head];
+    else if (c->slabs_empty.head != SLAB_NO_PAGE) sp = &slab_pages[c->slabs_empty.head];
 
-    /* Fall back to partial slab page */
-    struct slab_page *sp = c->partial;
-    if (!sp || sp->free_count == 0) {
-        sp = create_slab_page(c->obj_size);
+    if (!sp) {
+        spin_unlock(&c->lock);
+        sp = create_slab_page(c);
         if (!sp) return NULL;
-        sp->next = c->partial;
-        c->partial = sp;
+        spin_lock(&c->lock);
+        list_push(&c->slabs_empty, sp);
     }
 
-    void *obj = sp->free_list;
-    sp->free_list = *(void**)obj;
+    struct slab_list *from = list_for(c, sp);
+    void *obj = page_base(sp) + sp->free_off;
+    sp->free_off = *obj_link(c, obj);
     sp->free_count--;
+    struct slab_list *to = list_for(c, sp);
+    if (to != from) {
+        list_remove(from, sp);
+        list_push(to, sp);
+    }
+    spin_unlock(&c->lock);
     return obj;
 }
 
-void slab_free(void *ptr)
+/* Page layer: return `n` objects to their pages. Pages that empty are kept
+ * up to SLAB_EMPTY_KEEP, the rest go back to the PMM. */
+static void page_free_objs(struct kmem_cache *c, void **objs, uint32_t n)
+{
+    spin_lock(&c->lock);
+    for (uint32_t i = 0; i < n; ++i) {
+        void *ptr = objs[i];
+        struct slab_page *sp = page_of(ptr);
+
+        struct slab_list *from = list_for(c, sp);
+        *obj_link(c, ptr) = sp->free_off;
+        sp->free_off = (uint16_t)((uint8_t*)ptr - page_base(sp));
+        sp->free_count++;
+        struct slab_list *to = list_for(c, sp);
+        if (to == from) continue;
+
+        list_remove(from, sp);
+        if (to == &c->slabs_empty && c->slabs_empty.count >= SLAB_EMPTY_KEEP) release_page(sp);
+        else list_push(to, sp);
+    }
+    spin_unlock(&c->lock);
+}
+
+static inline void stat_add(uint64_t *ctr, uint64_t v)
+{
+    __atomic_add_fetch(ctr, v, __ATOMIC_RELAXED);
+}
+
+/* `size` is what the caller asked for, for the fragmentation counter */
+static void *cache_alloc(struct kmem_cache *c, size_t size)
+{
+    void *obj;
+    uint64_t flags = irq_save();
+    struct slab_cpu *pc = slab_this_cpu(c);
+    if (!pc) {
+        irq_restore(flags);
+        goto pages;
+    }
+
+    /* Fast path: this CPU's magazines, no lock */
+    if (pc->loaded && pc->loaded->rounds) goto hit;
+    if (pc->prev && pc->prev->rounds) {
+        struct magazine *t = pc->loaded;
+        pc->loaded = pc->prev;
+        pc->prev = t;
+        goto hit;
+    }
+    pc->misses++;
+
+    /* Both empty: swap a full magazine in from the depot, parking the
+     * previous one as empty */
+    spin_lock(&c->depot_lock);
+    struct magazine *full = c->full;
+    if (full) {
+        c->full = full->next;
+        c->full_count--;
+        if (pc->prev) {
+            pc->prev->next = c->empty;
+            c->empty = pc->prev;
+        }
+        pc->prev = pc->loaded;
+        pc->loaded = full;
+    }
+    spin_unlock(&c->depot_lock);
+    if (!full) {
+        irq_restore(flags);
+        goto pages;
+    }
+    goto pop;
+
+hit:
+    pc->hits++;
+pop:
+    pc->allocs++;
+    pc->waste += c->stride - size;
+    obj = pc->loaded->objs[--pc->loaded->rounds];
+    irq_restore(flags);
+    return obj;
+
+pages:
+    obj = page_alloc_obj(c);
+    if (obj) {
+        stat_add(&c->direct.allocs, 1);
+        stat_add(&c->direct.waste, c->stride - size);
+    }
+    return obj;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+    return cache_alloc(c, c->obj_size);
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *ptr)
 {
     if (!ptr) return;
-    uintptr_t page_base = (uintptr_t)ptr & ~(PAGE_SIZE - 1);
-    struct slab_page *sp = (struct slab_page*)page_base;
-    size_t obj_size = sp->obj_size;
-    if (obj_size == 0 || sp->objs_per_page == 0) {
-        /* not a slab page */
+
+    uint64_t flags = irq_save();
+    struct slab_cpu *pc = slab_this_cpu(c);
+    if (!pc) {
+        irq_restore(flags);
+        stat_add(&c->direct.frees, 1);
+        page_free_objs(c, &ptr, 1);
         return;
     }
+    pc->frees++;
 
-    int idx = size_to_index(obj_size);
-    if (idx < 0) return;
+    /* Fast path: room in this CPU's magazines, no lock */
+    if (pc->loaded && pc->loaded->rounds < c->mag_size) goto hit;
+    if (pc->prev && pc->prev->rounds < c->mag_size) {
+        struct magazine *t = pc->loaded;
+        pc->loaded = pc->prev;
+        pc->prev = t;
+        goto hit;
+    }
+    pc->misses++;
 
-    struct slab_cache *c = &caches[idx];
-    int cpu = get_cpu_id();
-    struct magazine *m = &c->mags[cpu];
+    /* Both full (or missing): hand the previous one to the depot and load an
+     * empty one. Past the depot limit the previous one goes back to pages. */
+    struct magazine *spill = NULL;
+    spin_lock(&c->depot_lock);
+    struct magazine *empty = c->empty;
+    if (empty) c->empty = empty->next;
+    if (pc->prev) {
+        if (c->full_count < SLAB_DEPOT_FULL_MAX) {
+            pc->prev->next = c->full;
+            c->full = pc->prev;
+            c->full_count++;
+        } else {
+            spill = pc->prev;
+        }
+        pc->prev = NULL;
+    }
+    spin_unlock(&c->depot_lock);
 
-    /* Try to push into magazine first */
-    if (m->count < SLAB_MAGAZINE_SIZE) {
-        m->objs[m->count++] = ptr;
+    if (spill) {
+        page_free_objs(c, spill->objs, spill->rounds);
+        spill->rounds = 0;
+        if (!empty) empty = spill;
+        else mag_free(spill);
+    }
+    if (!empty) empty = mag_alloc();
+    if (!empty) {
+        irq_restore(flags);
+        page_free_objs(c, &ptr, 1);
         return;
     }
+    pc->prev = pc->loaded;
+    pc->loaded = empty;
+    goto push;
+
+hit:
+    pc->hits++;
+push:
+    pc->loaded->objs[pc->loaded->rounds++] = ptr;
+    irq_restore(flags);
+}
+
+/* Empty a magazine into the pages and recycle it */
+static void mag_drain(struct kmem_cache *c, struct magazine *m)
+{
+    if (!m) return;
+    page_free_objs(c, m->objs, m->rounds);
+    mag_free(m);
+}
 
-    /* push back onto page free list */
-    *(void**)ptr = sp->free_list;
-    sp->free_list = ptr;
-    sp->free_count++;
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+    if (!c) return;
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; ++i) if (c == &kmalloc_caches[i]) return;
 
-    if (sp->free_count == sp->objs_per_page) {
-        /* fully free: if we have a spare magazine page capacity, we can keep the page; but for now return to PMM */
-        struct slab_page **pp = &c->partial;
-        while (*pp && *pp != sp) pp = &((*pp)->next);
-        if (*pp == sp) {
-            *pp = sp->next;
+    spin_lock(&cache_list_lock);
+    for (struct kmem_cache **pp = &cache_list; *pp; pp = &(*pp)->next) {
+        if (*pp == c) { *pp = c->next; break; }
+    }
+    spin_unlock(&cache_list_lock);
+
+    /* No CPU may use the cache any more: drain every magazine, which frees
+     * every page whose objects all came back */
+    for (uint32_t cpu = 0; c->cpus && cpu < slab_cpu_count; ++cpu) {
+        mag_drain(c, c->cpus[cpu].loaded);
+        mag_drain(c, c->cpus[cpu].prev);
+    }
+    while (c->full) {
+        struct magazine *m = c->full;
+        c->full = m->next;
+        mag_drain(c, m);
+    }
+    while (c->empty) {
+        struct magazine *m = c->empty;
+        c->empty = m->next;
+        mag_free(m);
+    }
+    while (c->slabs_empty.head != SLAB_NO_PAGE) {
+        struct slab_page *sp = &slab_pages[c->slabs_empty.head];
+        list_remove(&c->slabs_empty, sp);
+        release_page(sp);
+    }
+    if (cache_pages(c))
+        kprintf(LOG_WARN "slab: cache %s destroyed with objects still allocated\n", c->name);
+
+    /* Pages still holding objects keep the id, so it is not handed out again */
+    spin_lock(&cache_list_lock);
+    cache_table[c->id] = cache_pages(c) ? SLAB_CACHE_DEAD : NULL;
+    spin_unlock(&cache_list_lock);
+    kfree(c->cpus);
+    kfree(c);
+}
+
+/* Give back what the caches hold without anyone using it: full magazines in
+ * the depots are emptied into their pages, then every retained empty page
+ * goes to the PMM. The PMM calls this when an allocation fails, which may be
+ * under a slab lock on this CPU, so a cache whose lock is taken is skipped. */
+size_t slab_reclaim(void)
+{
+    size_t freed = 0;
+    if (!spin_trylock(&cache_list_lock)) return 0;
+    for (struct kmem_cache *c = cache_list; c; c = c->next) {
+        if (!spin_trylock(&c->lock)) continue;
+        uint32_t held = cache_pages(c);
+        spin_unlock(&c->lock);
+
+        struct magazine *mags = NULL;
+        if (spin_trylock(&c->depot_lock)) {
+            mags = c->full;
+            c->full = NULL;
+            c->full_count = 0;
+            spin_unlock(&c->depot_lock);
         }
-        uint64_t phys = (uint64_t)page_base;
-        pmm_free_frame(phys);
+        while (mags) {
+            struct magazine *m = mags;
+            mags = m->next;
+            mag_drain(c, m);
+        }
+
+        spin_lock(&c->lock);
+        while (c->slabs_empty.head != SLAB_NO_PAGE) {
+            struct slab_page *sp = &slab_pages[c->slabs_empty.head];
+            list_remove(&c->slabs_empty, sp);
+            release_page(sp);
+        }
+        /* Draining may also have emptied pages past the retained few */
+        if (cache_pages(c) < held) freed += held - cache_pages(c);
+        spin_unlock(&c->lock);
+    }
+    spin_unlock(&cache_list_lock);
+    return freed;
+}
+
+void *slab_alloc(size_t size)
+{
+    int idx = size_to_index(size);
+    if (idx < 0) return NULL; /* too big for slab */
+    return cache_alloc(&kmalloc_caches[idx], size);
+}
+
+size_t slab_size(const void *ptr)
+{
+    struct slab_page *sp = ptr ? page_of(ptr) : NULL;
+    if (!sp || cache_table[sp->cache] == SLAB_CACHE_DEAD) return 0;
+    return cache_table[sp->cache]->obj_size;
+}
+
+void slab_free(void *ptr)
+{
+    if (!ptr) return;
+    struct slab_page *sp = page_of(ptr);
+    if (!sp) {
+        kprintf(LOG_WARN "slab: free of %p, which is not a slab object\n", ptr);
+        return;
+    }
+    struct kmem_cache *c = cache_table[sp->cache];
+    if (c == SLAB_CACHE_DEAD) {
+        /* Its page stays allocated: nothing owns it any more */
+        kprintf(LOG_WARN "slab: free of %p from a destroyed cache\n", ptr);
+        return;
     }
+    kmem_cache_free(c, ptr);
 }
 
+
 size_t slab_free_objects(size_t size_class)
 {
     int idx = size_to_index(size_class);
     if (idx < 0) return 0;
-    struct slab_cache *c = &caches[idx];
+    struct kmem_cache *c = &kmalloc_caches[idx];
     size_t total = 0;
-    for (struct slab_page *p = c->partial; p; p = p->next) total += p->free_count;
+    spin_lock(&c->lock);
+    for (uint32_t p = c->slabs_partial.head; p != SLAB_NO_PAGE; p = slab_pages[p].next) total += slab_pages[p].free_count;
+    total += (size_t)c->slabs_empty.count * c->objs_per_page;
+    spin_unlock(&c->lock);
     /* include magazines */
-    for (int cpu = 0; cpu < SLAB_MAX_CPUS; ++cpu) total += c->mags[cpu].count;
+    spin_lock(&c->depot_lock);
+    for (struct magazine *m = c->full; m; m = m->next) total += m->rounds;
+    spin_unlock(&c->depot_lock);
+    for (uint32_t cpu = 0; c->cpus && cpu < slab_cpu_count; ++cpu) {
+        struct slab_cpu *pc = &c->cpus[cpu];
+        if (pc->loaded) total += pc->loaded->rounds;
+        if (pc->prev) total += pc->prev->rounds;
+    }
     return total;
 }
+
+void kmem_cache_get_stats(struct kmem_cache *c, struct kmem_cache_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->name = c->name;
+    st->obj_size = c->obj_size;
+    st->stride = c->stride;
+
+    /* Other CPUs' counters are read without stopping them: each is exact,
+     * the sum is a snapshot */
+    st->allocs = __atomic_load_n(&c->direct.allocs, __ATOMIC_RELAXED);
+    st->frees = __atomic_load_n(&c->direct.frees, __ATOMIC_RELAXED);
+    st->waste_alloc = __atomic_load_n(&c->direct.waste, __ATOMIC_RELAXED);
+    for (uint32_t cpu = 0; c->cpus && cpu < slab_cpu_count; ++cpu) {
+        struct slab_cpu *pc = &c->cpus[cpu];
+        st->allocs += pc->allocs;
+        st->frees += pc->frees;
+        st->mag_hits += pc->hits;
+        st->mag_misses += pc->misses;
+        st->waste_alloc += pc->waste;
+    }
+
+    spin_lock(&c->lock);
+    st->pages_full = c->slabs_full.count;
+    st->pages_partial = c->slabs_partial.count;
+    st->pages_empty = c->slabs_empty.count;
+    spin_unlock(&c->lock);
+    uint32_t pages = st->pages_full + st->pages_partial + st->pages_empty;
+    st->waste_page = (uint64_t)pages * (PAGE_SIZE - c->objs_per_page * c->stride);
+}
+
+void slab_print_stats(void)
+{
+    spin_lock(&cache_list_lock);
+    for (struct kmem_cache *c = cache_list; c; c = c->next) {
+        struct kmem_cache_stats st;
+        kmem_cache_get_stats(c, &st);
+        if (!st.allocs) continue;
+        uint64_t mag = st.mag_hits + st.mag_misses;
+        kprintf(LOG_INFO "slab: %-16s live=%llu allocs=%llu frees=%llu mag hit rate=%llu%% "
+                "pages=%u/%u/%u (full/partial/empty)\n",
+                st.name, (unsigned long long)(st.allocs - st.frees),
+                (unsigned long long)st.allocs, (unsigned long long)st.frees,
+                (unsigned long long)(mag ? st.mag_hits * 100 / mag : 0),
+                st.pages_full, st.pages_partial, st.pages_empty);
+        kprintf(LOG_INFO "slab: %-16s waste: %llu bytes/alloc rounding up, %llu bytes at page ends\n",
+                st.name, (unsigned long long)(st.waste_alloc / st.allocs),
+                (unsigned long long)st.waste_page);
+    }
+    spin_unlock(&cache_list_lock);
+}
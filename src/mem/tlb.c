@@ -0,0 +1,287 @@
+#include <mem/tlb.h>
+#include <mem/pmm.h>
+#include <common/boot.h>
+#include <kernel/kprintf.h>
+#include <lib/spinlock.h>
+#include <lib/string.h>
+#include <drivers/acpi.h>
+#include <drivers/idt.h>
+#include <drivers/smp.h>
+
+/* Per-CPU shootdown queue. Initiators append under `lock` and bump req_seq;
+ * the target drains the queue in its IPI handler and publishes the sequence
+ * number it reached in done_seq, which is what initiators wait on. */
+struct tlb_cpu {
+    spinlock_t lock;
+    uint32_t apic_id;
+    volatile uint8_t online;
+    uint8_t ipi_pending;          /* an IPI is on its way, no need for another */
+    volatile uint64_t active_pml4;
+    volatile uint64_t req_seq;
+    volatile uint64_t done_seq;
+    struct tlb_batch pending;
+
+    /* PCID tags: slot i is PCID i + 1 and holds the space `slot_id[i]` as of
+     * its generation `slot_gen[i]`. Only this CPU touches them, with
+     * interrupts off. */
+    uint8_t pcid_on;
+    uint8_t next_slot;            /* round-robin victim */
+    int8_t cur_slot;              /* slot in CR3, -1 while still on PCID 0 */
+    uint64_t slot_id[TLB_PCID_SLOTS];
+    uint64_t slot_gen[TLB_PCID_SLOTS];
+} __attribute__((aligned(64)));
+
+#define TLB_CR3_NOFLUSH (1ULL << 63)
+#define TLB_CR4_PGE     (1ULL << 7)
+#define TLB_CR4_PCIDE   (1ULL << 17)
+#define TLB_GEN_STALE   (~0ULL)
+
+static struct tlb_cpu *tlb_cpus = NULL;
+static uint32_t tlb_cpu_count = 0;
+static volatile uint32_t tlb_online_count = 0;
+static uint8_t tlb_vector = 0;
+static int tlb_pcid_supported = 0;
+
+static struct tlb_cpu *tlb_this_cpu(void)
+{
+    if (!tlb_cpus) return NULL;
+    uint32_t cpu = smp_cpu_index();
+    return cpu < tlb_cpu_count ? &tlb_cpus[cpu] : NULL;
+}
+
+static inline void invlpg(uint64_t virt)
+{
+    __asm__ volatile ("invlpg (%0)" :: "r" ((void*)virt) : "memory");
+}
+
+void tlb_flush_local_all(void)
+{
+    /* Any change to CR4.PGE drops every entry, global ones and those of all
+     * PCIDs alike; a CR3 reload would only reach the current PCID */
+    uint64_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r" (cr4));
+    __asm__ volatile ("mov %0, %%cr4" :: "r" (cr4 ^ TLB_CR4_PGE) : "memory");
+    __asm__ volatile ("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+static void batch_invalidate(struct tlb_cpu *tc, const struct tlb_batch *b)
+{
+    if (b->all) {
+        tlb_flush_local_all();
+        return;
+    }
+    for (uint32_t i = 0; i < b->count; ++i) invlpg(b->addrs[i]);
+
+    /* Kernel mappings are not global, so every PCID caches its own copy and
+     * invlpg only reached the loaded one: the others flush on next load */
+    if (b->kernel && tc && tc->pcid_on) {
+        for (int i = 0; i < TLB_PCID_SLOTS; ++i) {
+            if (i != tc->cur_slot) tc->slot_gen[i] = TLB_GEN_STALE;
+        }
+    }
+}
+
+void tlb_batch_add(struct tlb_batch *b, uint64_t virt)
+{
+    if (virt >= 0xFFFF800000000000ULL) b->kernel = 1;
+    if (b->all) return;
+    if (b->count == TLB_BATCH) {
+        b->all = 1;
+        return;
+    }
+    b->addrs[b->count++] = virt;
+}
+
+/* Merge `src` into a CPU's queue; an overflowing queue degrades to a full flush */
+static void batch_merge(struct tlb_batch *dst, const struct tlb_batch *src)
+{
+    dst->kernel |= src->kernel;
+    if (dst->all) return;
+    if (src->all || dst->count + src->count > TLB_BATCH) {
+        dst->all = 1;
+        dst->count = 0;
+        return;
+    }
+    memcpy(&dst->addrs[dst->count], src->addrs, src->count * sizeof(src->addrs[0]));
+    dst->count += src->count;
+}
+
+/* Drain this CPU's queue and acknowledge everything queued so far */
+static void tlb_process_local(void)
+{
+    struct tlb_cpu *tc = tlb_this_cpu();
+    if (!tc) return;
+
+    struct tlb_batch b;
+    spin_lock(&tc->lock);
+    b = tc->pending;
+    uint64_t seq = tc->req_seq;
+    tlb_batch_init(&tc->pending);
+    tc->ipi_pending = 0;
+    spin_unlock(&tc->lock);
+
+    batch_invalidate(tc, &b);
+    __atomic_store_n(&tc->done_seq, seq, __ATOMIC_RELEASE);
+}
+
+static void tlb_ipi_handler(context_t *ctx)
+{
+    (void)ctx;
+    tlb_process_local();
+    apic_eoi();
+}
+
+void tlb_batch_flush(struct tlb_batch *b, uint64_t pml4_phys)
+{
+    uint64_t flags = irq_save();
+    batch_invalidate(tlb_this_cpu(), b);
+
+    if (!tlb_cpus || tlb_online_count <= 1 || (!b->all && !b->count)) {
+        irq_restore(flags);
+        tlb_batch_init(b);
+        return;
+    }
+
+    uint64_t root = pml4_phys & ~0xFFFULL;
+    uint32_t self = smp_cpu_index();
+
+    /* Queue the batch on every target and kick it, unless an IPI is already
+     * in flight that will find the new entries */
+    for (uint32_t i = 0; i < tlb_cpu_count; ++i) {
+        struct tlb_cpu *tc = &tlb_cpus[i];
+        if (i == self || !tc->online) continue;
+        if (!b->kernel && tc->active_pml4 != root) continue;
+
+        spin_lock(&tc->lock);
+        batch_merge(&tc->pending, b);
+        __atomic_store_n(&tc->req_seq, tc->req_seq + 1, __ATOMIC_RELEASE);
+        int kick = !tc->ipi_pending;
+        tc->ipi_pending = 1;
+        spin_unlock(&tc->lock);
+        if (kick) apic_ipi(tc->apic_id, tlb_vector, APIC_IPI_SINGLE);
+    }
+
+    /* Wait for the acks. Keep draining our own queue meanwhile: another CPU
+     * may be waiting on us with interrupts off, just like we are. */
+    for (uint32_t i = 0; i < tlb_cpu_count; ++i) {
+        struct tlb_cpu *tc = &tlb_cpus[i];
+        if (i == self || !tc->online) continue;
+        if (!b->kernel && tc->active_pml4 != root) continue;
+
+        uint64_t want = __atomic_load_n(&tc->req_seq, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&tc->done_seq, __ATOMIC_ACQUIRE) < want) {
+            tlb_process_local();
+            __asm__ volatile ("pause");
+        }
+    }
+
+    irq_restore(flags);
+    tlb_batch_init(b);
+}
+
+void tlb_set_active(uint64_t pml4_phys)
+{
+    struct tlb_cpu *tc = tlb_this_cpu();
+    if (tc) tc->active_pml4 = pml4_phys & ~0xFFFULL;
+}
+
+void tlb_switch(uint64_t pml4_phys, uint64_t id, volatile uint64_t *gen)
+{
+    uint64_t root = pml4_phys & ~0xFFFULL;
+    uint64_t flags = irq_save();
+    struct tlb_cpu *tc = tlb_this_cpu();
+
+    /* An initiator bumps *gen before it picks its targets, and we publish
+     * ourselves before reading *gen: either it sees us and sends an IPI, or
+     * we see the new generation and flush */
+    if (tc) tc->active_pml4 = root;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t g = __atomic_load_n(gen, __ATOMIC_ACQUIRE);
+
+    uint64_t cr3;
+    __asm__ volatile ("mov %%cr3, %0" : "=r" (cr3));
+
+    if (tc && tc->pcid_on) {
+        int slot = -1;
+        for (int i = 0; i < TLB_PCID_SLOTS; ++i) {
+            if (tc->slot_id[i] == id) { slot = i; break; }
+        }
+        uint64_t next = root;
+        if (slot >= 0 && tc->slot_gen[slot] == g) {
+            next |= TLB_CR3_NOFLUSH;
+        } else if (slot < 0) {
+            slot = tc->next_slot;
+            tc->next_slot = (uint8_t)((slot + 1) % TLB_PCID_SLOTS);
+            tc->slot_id[slot] = id;
+        }
+        tc->slot_gen[slot] = g;
+        tc->cur_slot = (int8_t)slot;
+        next |= (uint64_t)(slot + 1);
+        __asm__ volatile ("mov %0, %%cr3" :: "r" (next) : "memory");
+    } else if ((cr3 & ~0xFFFULL) != root) {
+        __asm__ volatile ("mov %0, %%cr3" :: "r" (root) : "memory");
+    }
+    irq_restore(flags);
+}
+
+int tlb_pcid_enabled(void)
+{
+    struct tlb_cpu *tc = tlb_this_cpu();
+    return tc && tc->pcid_on;
+}
+
+void tlb_cpu_online(void)
+{
+    struct tlb_cpu *tc = tlb_this_cpu();
+    if (!tc || tc->online) return;
+
+    uint64_t cr3, cr4;
+    __asm__ volatile ("mov %%cr3, %0" : "=r" (cr3));
+    tc->cur_slot = -1;
+
+    /* CR4.PCIDE may only be set while CR3 names PCID 0 */
+    if (tlb_pcid_supported && !(cr3 & 0xFFF)) {
+        __asm__ volatile ("mov %%cr4, %0" : "=r" (cr4));
+        __asm__ volatile ("mov %0, %%cr4" :: "r" (cr4 | TLB_CR4_PCIDE) : "memory");
+        tc->pcid_on = 1;
+    }
+
+    tc->active_pml4 = cr3 & ~0xFFFULL;
+    tc->online = 1;
+    __atomic_add_fetch(&tlb_online_count, 1, __ATOMIC_SEQ_CST);
+
+    /* Nothing was shot down here before now */
+    tlb_flush_local_all();
+}
+
+void tlb_init(void)
+{
+    uint32_t n = TitanBootInfo.smp_info.cpu_count;
+    if (n == 0) n = 1;
+
+    size_t bytes = n * sizeof(struct tlb_cpu);
+    uint64_t phys = pmm_alloc_contig(DIV_ROUND_UP(bytes, PMM_PAGE_SIZE), 0, 0);
+    if (!phys) {
+        kprintf(LOG_ERROR "tlb: cannot allocate %u shootdown queues\n", n);
+        return;
+    }
+    struct tlb_cpu *cpus = (struct tlb_cpu*)PHYS_TO_VIRT(phys);
+    memset(cpus, 0, bytes);
+    for (uint32_t i = 0; i < n; ++i) {
+        cpus[i].apic_id = TitanBootInfo.smp_cpus[i].apic_id;
+        tlb_batch_init(&cpus[i].pending);
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    tlb_pcid_supported = (ecx >> 17) & 1;
+
+    tlb_vector = interrupts_alloc_vec();
+    interrupts_set_handler(tlb_vector, tlb_ipi_handler);
+
+    tlb_cpu_count = n;
+    tlb_cpus = cpus;
+    tlb_cpu_online();
+    kprintf(LOG_INFO "tlb: shootdown vector %u for %u CPUs, PCID=%s\n", tlb_vector, n,
+            tlb_pcid_enabled() ? "yes" : "no");
+}
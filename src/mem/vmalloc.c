@@ -0,0 +1,430 @@
+#include <mem/vmalloc.h>
+#include <mem/vmm.h>
+#include <mem/pmm.h>
+#include <common/boot.h>
+#include <kernel/kprintf.h>
+#include <lib/spinlock.h>
+#include <lib/string.h>
+
+/* The region is tiled by areas in address order. Free areas also sit on the
+ * list of their size class (bin b holds 2^b .. 2^(b+1)-1 pages, the last bin
+ * everything larger); used areas are hashed by start address for release. */
+#define VMALLOC_BINS 20
+#define VMALLOC_HASH 256
+#define VMALLOC_MAX_ORDER 9 /* 2MiB: the largest block one leaf can map */
+
+#define VMA_FREE 0x80000000u
+
+struct vm_area {
+    uint64_t start;
+    uint64_t pages;                    /* guard page included */
+    uint32_t flags;
+    struct vm_area *prev, *next;       /* neighbours in address order */
+    struct vm_area *bin_prev, *bin_next; /* size class, or hash chain when used */
+};
+
+static struct vm_area *bins[VMALLOC_BINS];
+static uint32_t bin_mask = 0;
+static struct vm_area *used_hash[VMALLOC_HASH];
+static struct vm_area *spare = NULL;   /* unused descriptors */
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+static int vmalloc_ready = 0;
+
+static inline uint64_t area_end(const struct vm_area *a) { return a->start + a->pages * PAGE_SIZE; }
+
+static inline int bin_of(uint64_t pages)
+{
+    int b = 63 - __builtin_clzll(pages);
+    return b < VMALLOC_BINS ? b : VMALLOC_BINS - 1;
+}
+
+static inline uint32_t hash_of(uint64_t addr)
+{
+    return (uint32_t)((addr >> 12) * 0x9E3779B97F4A7C15ULL >> 56) % VMALLOC_HASH;
+}
+
+/* Descriptors come from whole frames and are recycled, never returned */
+static struct vm_area *area_get(void)
+{
+    if (!spare) {
+        uint64_t phys = pmm_alloc_zeroed_frame();
+        if (!phys) return NULL;
+        struct vm_area *a = (struct vm_area*)PHYS_TO_VIRT(phys);
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(*a); ++i) {
+            a[i].next = spare;
+            spare = &a[i];
+        }
+    }
+    struct vm_area *a = spare;
+    spare = a->next;
+    return a;
+}
+
+static void area_put(struct vm_area *a)
+{
+    a->next = spare;
+    spare = a;
+}
+
+static void bin_insert(struct vm_area *a)
+{
+    int b = bin_of(a->pages);
+    a->flags |= VMA_FREE;
+    a->bin_prev = NULL;
+    a->bin_next = bins[b];
+    if (bins[b]) bins[b]->bin_prev = a;
+    bins[b] = a;
+    bin_mask |= 1u << b;
+}
+
+static void bin_remove(struct vm_area *a)
+{
+    int b = bin_of(a->pages);
+    if (a->bin_prev) a->bin_prev->bin_next = a->bin_next;
+    else bins[b] = a->bin_next;
+    if (a->bin_next) a->bin_next->bin_prev = a->bin_prev;
+    if (!bins[b]) bin_mask &= ~(1u << b);
+    a->flags &= ~VMA_FREE;
+}
+
+/* Put `n` before / after `a` in address order */
+static void link_before(struct vm_area *a, struct vm_area *n)
+{
+    n->next = a;
+    n->prev = a->prev;
+    if (a->prev) a->prev->next = n;
+    a->prev = n;
+}
+
+static void link_after(struct vm_area *a, struct vm_area *n)
+{
+    n->prev = a;
+    n->next = a->next;
+    if (a->next) a->next->prev = n;
+    a->next = n;
+}
+
+static void unlink_area(struct vm_area *a)
+{
+    if (a->prev) a->prev->next = a->next;
+    if (a->next) a->next->prev = a->prev;
+}
+
+static struct vm_area *hash_find(uint64_t addr, int remove)
+{
+    struct vm_area **pp = &used_hash[hash_of(addr)];
+    for (; *pp; pp = &(*pp)->bin_next) {
+        struct vm_area *a = *pp;
+        if (a->start != addr) continue;
+        if (remove) *pp = a->bin_next;
+        return a;
+    }
+    return NULL;
+}
+
+void vmalloc_init(void)
+{
+    uint64_t flags = irq_save();
+    spin_lock(&vmalloc_lock);
+    if (!vmalloc_ready) {
+        struct vm_area *a = area_get();
+        if (a) {
+            a->start = VMALLOC_START;
+            a->pages = (VMALLOC_END - VMALLOC_START) / PAGE_SIZE;
+            a->flags = 0;
+            a->prev = a->next = NULL;
+            bin_insert(a);
+            vmalloc_ready = 1;
+        }
+    }
+    spin_unlock(&vmalloc_lock);
+    irq_restore(flags);
+
+    if (vmalloc_ready)
+        kprintf(LOG_INFO "vmalloc: region 0x%016llx-0x%016llx\n",
+                (unsigned long long)VMALLOC_START, (unsigned long long)VMALLOC_END);
+    else
+        kprintf(LOG_ERROR "vmalloc: cannot allocate area descriptors\n");
+}
+
+uint64_t vmalloc_reserve(size_t pages, uint64_t align, uint32_t flags)
+{
+    if (pages == 0) return 0;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+    if (align & (align - 1)) return 0;
+    uint64_t need = pages + ((flags & VMALLOC_GUARD) ? 1 : 0);
+
+    uint64_t irq = irq_save();
+    spin_lock(&vmalloc_lock);
+    uint64_t ret = 0;
+    if (!vmalloc_ready) goto out;
+
+    /* Head and tail leftovers each need a descriptor; take them up front so
+     * nothing has to be undone */
+    struct vm_area *head = area_get();
+    struct vm_area *tail = area_get();
+    if (!head || !tail) {
+        if (head) area_put(head);
+        if (tail) area_put(tail);
+        goto out;
+    }
+
+    /* First fit from the smallest class that can hold `need`; every area of a
+     * higher class fits unless alignment eats into it */
+    struct vm_area *a = NULL;
+    uint64_t start = 0;
+    for (int b = bin_of(need); b < VMALLOC_BINS && !a; ++b) {
+        if (!(bin_mask & (1u << b))) continue;
+        for (struct vm_area *c = bins[b]; c; c = c->bin_next) {
+            uint64_t s = ALIGN_UP(c->start, align);
+            if (s >= c->start && s < area_end(c) && (area_end(c) - s) / PAGE_SIZE >= need) {
+                a = c;
+                start = s;
+                break;
+            }
+        }
+    }
+    if (!a) {
+        area_put(head);
+        area_put(tail);
+        goto out;
+    }
+
+    bin_remove(a);
+    if (start > a->start) {
+        head->start = a->start;
+        head->pages = (start - a->start) / PAGE_SIZE;
+        head->flags = 0;
+        link_before(a, head);
+        a->start = start;
+        a->pages -= head->pages;
+        bin_insert(head);
+    } else {
+        area_put(head);
+    }
+    if (a->pages > need) {
+        tail->start = a->start + need * PAGE_SIZE;
+        tail->pages = a->pages - need;
+        tail->flags = 0;
+        link_after(a, tail);
+        a->pages = need;
+        bin_insert(tail);
+    } else {
+        area_put(tail);
+    }
+
+    a->flags = flags & VMALLOC_GUARD;
+    uint32_t h = hash_of(a->start);
+    a->bin_next = used_hash[h];
+    used_hash[h] = a;
+    ret = a->start;
+out:
+    spin_unlock(&vmalloc_lock);
+    irq_restore(irq);
+    return ret;
+}
+
+void vmalloc_release(uint64_t addr)
+{
+    uint64_t irq = irq_save();
+    spin_lock(&vmalloc_lock);
+    struct vm_area *a = hash_find(addr, 1);
+    if (!a) {
+        spin_unlock(&vmalloc_lock);
+        irq_restore(irq);
+        kprintf(LOG_WARN "vmalloc: release of unknown range 0x%016llx\n", (unsigned long long)addr);
+        return;
+    }
+    a->flags = 0;
+
+    /* Coalesce with free neighbours */
+    struct vm_area *p = a->prev;
+    if (p && (p->flags & VMA_FREE)) {
+        bin_remove(p);
+        p->pages += a->pages;
+        unlink_area(a);
+        area_put(a);
+        a = p;
+    }
+    struct vm_area *n = a->next;
+    if (n && (n->flags & VMA_FREE)) {
+        bin_remove(n);
+        a->pages += n->pages;
+        unlink_area(n);
+        area_put(n);
+    }
+    bin_insert(a);
+    spin_unlock(&vmalloc_lock);
+    irq_restore(irq);
+}
+
+/* Give the last `pages` pages of used area `a` back as free space */
+static void area_trim(struct vm_area *a, uint64_t pages)
+{
+    struct vm_area *n = a->next;
+    if (n && (n->flags & VMA_FREE)) {
+        bin_remove(n);
+        n->start -= pages * PAGE_SIZE;
+        n->pages += pages;
+        bin_insert(n);
+    } else {
+        struct vm_area *t = area_get();
+        if (!t) return;   /* keep the VA with the area rather than lose it */
+        t->start = area_end(a) - pages * PAGE_SIZE;
+        t->pages = pages;
+        t->flags = 0;
+        link_after(a, t);
+        bin_insert(t);
+    }
+    a->pages -= pages;
+}
+
+size_t vmalloc_pages(uint64_t addr)
+{
+    uint64_t irq = irq_save();
+    spin_lock(&vmalloc_lock);
+    struct vm_area *a = hash_find(addr, 0);
+    size_t pages = a ? a->pages - ((a->flags & VMALLOC_GUARD) ? 1 : 0) : 0;
+    spin_unlock(&vmalloc_lock);
+    irq_restore(irq);
+    return pages;
+}
+
+/* Back [start, start + npages) with the largest buddy blocks available, one
+ * vmm_map_range per block; 2MiB-aligned blocks become 2MiB pages. With `zero`
+ * anything short of a large page is built from pre-zeroed frames instead.
+ * Returns the number of pages mapped, short of npages when memory runs out. */
+static size_t vmalloc_map(uint64_t start, size_t npages, int zero)
+{
+    size_t done = 0;
+    while (done < npages) {
+        unsigned order = VMALLOC_MAX_ORDER;
+        while ((1UL << order) > npages - done) order--;
+
+        uint64_t phys = 0;
+        if (zero && order < VMALLOC_MAX_ORDER) {
+            order = 0;
+            phys = pmm_alloc_zeroed_frame();
+        } else {
+            for (;; --order) {
+                phys = pmm_alloc_pages(order);
+                if (phys || order == 0) break;
+            }
+            if (phys && zero) memset(PHYS_TO_VIRT(phys), 0, (size_t)PAGE_SIZE << order);
+        }
+        if (!phys) break;
+
+        uint64_t v = start + done * PAGE_SIZE;
+        if (vmm_map_range(v, phys, (uint64_t)PAGE_SIZE << order, VMM_PTE_W) < 0) {
+            vmm_unmap_range(v, (uint64_t)PAGE_SIZE << order);
+            pmm_free_pages(phys, order);
+            break;
+        }
+        done += 1UL << order;
+    }
+    return done;
+}
+
+static void *vmalloc_area(size_t size, uint64_t align, int zero)
+{
+    if (size == 0) return NULL;
+    size_t npages = DIV_ROUND_UP(size, PAGE_SIZE);
+
+    /* Ranges of 2MiB or more start 2MiB-aligned so their blocks map as large pages */
+    if (npages * PAGE_SIZE >= VMM_PAGE_2M && align < VMM_PAGE_2M) align = VMM_PAGE_2M;
+    uint64_t start = vmalloc_reserve(npages, align, VMALLOC_GUARD);
+    if (!start) return NULL;
+
+    size_t mapped = vmalloc_map(start, npages, zero);
+    if (mapped != npages) {
+        vmm_unmap_range_free(start, mapped * PAGE_SIZE);
+        vmalloc_release(start);
+        return NULL;
+    }
+    return (void*)start;
+}
+
+void *vmalloc(size_t size)
+{
+    return vmalloc_area(size, PAGE_SIZE, 0);
+}
+
+void *vzalloc(size_t size)
+{
+    return vmalloc_area(size, PAGE_SIZE, 1);
+}
+
+void *vmalloc_aligned(size_t size, uint64_t align)
+{
+    if (align & (align - 1)) return NULL;
+    return vmalloc_area(size, align, 0);
+}
+
+int vmalloc_grow(void *ptr, size_t size)
+{
+    uint64_t start = (uint64_t)ptr;
+    uint64_t want = DIV_ROUND_UP(size, PAGE_SIZE);
+
+    uint64_t irq = irq_save();
+    spin_lock(&vmalloc_lock);
+    struct vm_area *a = hash_find(start, 0);
+    if (!a) goto fail;
+    uint64_t guard = (a->flags & VMALLOC_GUARD) ? 1 : 0;
+    uint64_t have = a->pages - guard;
+    if (want <= have) {
+        spin_unlock(&vmalloc_lock);
+        irq_restore(irq);
+        return 0;
+    }
+
+    /* Take the pages from the free area right after us; the guard page moves
+     * to the new end */
+    uint64_t extra = want - have;
+    struct vm_area *n = a->next;
+    if (!n || !(n->flags & VMA_FREE) || n->pages < extra) goto fail;
+    bin_remove(n);
+    if (n->pages == extra) {
+        unlink_area(n);
+        area_put(n);
+    } else {
+        n->start += extra * PAGE_SIZE;
+        n->pages -= extra;
+        bin_insert(n);
+    }
+    a->pages += extra;
+    spin_unlock(&vmalloc_lock);
+    irq_restore(irq);
+
+    /* The old guard page is the first one to map */
+    uint64_t from = start + have * PAGE_SIZE;
+    size_t mapped = vmalloc_map(from, extra, 0);
+    if (mapped == extra) return 0;
+
+    vmm_unmap_range_free(from, mapped * PAGE_SIZE);
+    irq = irq_save();
+    spin_lock(&vmalloc_lock);
+    area_trim(a, extra);
+    spin_unlock(&vmalloc_lock);
+    irq_restore(irq);
+    return -1;
+
+fail:
+    spin_unlock(&vmalloc_lock);
+    irq_restore(irq);
+    return -1;
+}
+
+void vfree(void *ptr)
+{
+    if (!ptr) return;
+    uint64_t start = (uint64_t)ptr;
+    size_t npages = vmalloc_pages(start);
+    if (!npages) {
+        kprintf(LOG_WARN "vfree: %p is not a vmalloc range\n", ptr);
+        return;
+    }
+    /* One walk over the range; frames are freed after a single TLB flush, and
+     * the VA only becomes reusable after that */
+    vmm_unmap_range_free(start, (uint64_t)npages * PAGE_SIZE);
+    vmalloc_release(start);
+}
@@ -3,9 +3,20 @@
 #include <common/boot.h>
 #include <kernel/kprintf.h>
 #include <lib/string.h>
+#include <kernel/bench.h>
+#include <mem/tlb.h>
+#include <lib/alloc.h>
+#include <lib/spinlock.h>
+#include <drivers/smp.h>
+
+#define VMM_KERNEL_BASE 0xFFFF800000000000ULL
 
 /* Internal state */
-static uint64_t pml4_phys = 0;
+static struct vmm_space kernel_space;
+static struct vmm_space *vmm_spaces = NULL;   /* all spaces, for shared PML4 entries */
+static spinlock_t vmm_space_lock = SPINLOCK_INIT;
+static uint64_t vmm_space_next_id = 2;
+static struct vmm_space *vmm_cur[MAX_CPUS];
 
 /* Helpers for indexes */
 static inline int idx_pml4(uint64_t v) { return (v >> 39) & 0x1FF; }
@@ -20,87 +31,331 @@ static uint64_t read_cr3_phys(void) {
     return v;
 }
 
+static int cpu_has_1g_pages(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000));
+    if (eax < 0x80000001) return 0;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001));
+    return (edx >> 26) & 1;
+}
+
+static int vmm_1g_pages = 0;
+
 void vmm_init(void)
 {
-    pml4_phys = read_cr3_phys();
-    kprintf("vmm_init: pml4_phys=0x%016llx\n", (unsigned long long)pml4_phys);
+    kernel_space.pml4_phys = read_cr3_phys() & VMM_ADDR_MASK;
+    kernel_space.id = 1;
+    kernel_space.tlb_gen = 0;
+    kernel_space.next = NULL;
+    vmm_spaces = &kernel_space;
+    vmm_1g_pages = cpu_has_1g_pages();
+    kprintf("vmm_init: pml4_phys=0x%016llx 1GiB pages=%s\n",
+            (unsigned long long)kernel_space.pml4_phys, vmm_1g_pages ? "yes" : "no");
+}
+
+struct vmm_space *vmm_space_kernel(void) { return &kernel_space; }
+
+struct vmm_space *vmm_space_current(void)
+{
+    uint32_t cpu = smp_cpu_index();
+    if (cpu < MAX_CPUS && vmm_cur[cpu]) return vmm_cur[cpu];
+    return &kernel_space;
 }
 
-uint64_t vmm_get_pml4_phys(void) { return pml4_phys; }
+uint64_t vmm_get_pml4_phys(void) { return vmm_space_current()->pml4_phys; }
+
+static inline void invlpg(uint64_t virt)
+{
+    __asm__ volatile ("invlpg (%0)" :: "r" ((void*)virt) : "memory");
+}
+
+/* Replace a 1GiB or 2MiB leaf (`size` bytes, covering `virt`) with a table of
+ * the next size down mapping the same memory with the same attributes.
+ * Returns the new table's physical address or 0. */
+static uint64_t split_large(uint64_t *entry, uint64_t virt, uint64_t size)
+{
+    uint64_t table = pmm_alloc_frame(); /* every entry is written below */
+    if (!table) return 0;
+
+    uint64_t *t = (uint64_t*)PHYS_TO_VIRT(table);
+    uint64_t base = *entry & VMM_ADDR_MASK & ~(size - 1);
+    uint64_t attr = (*entry & (0xFFFULL | VMM_PTE_NX)) & ~VMM_PTE_PS;
+    uint64_t sub = size >> 9;
+    if (sub > VMM_PAGE_4K) attr |= VMM_PTE_PS;
+    for (int i = 0; i < 512; ++i) t[i] = (base + (uint64_t)i * sub) | attr;
+
+    *entry = table | VMM_PTE_P | VMM_PTE_W | (*entry & VMM_PTE_U);
+    invlpg(virt & ~(size - 1));
+    return table;
+}
 
-/* Ensure a page table page exists at a given entry pointer; allocates frame using PMM if needed */
-static uint64_t ensure_table(uint64_t *entry)
+/* Ensure a page table page exists at a given entry pointer; allocates frame using
+ * PMM if needed. A large page there (of `size` bytes) is split to make room. */
+static uint64_t ensure_table(uint64_t *entry, uint64_t virt, uint64_t size)
 {
-    if ((*entry) & VMM_PTE_P) return (*entry) & ~0xFFFULL;
+    if ((*entry) & VMM_PTE_P) {
+        if ((*entry) & VMM_PTE_PS) return split_large(entry, virt, size);
+        return (*entry) & VMM_ADDR_MASK;
+    }
 
-    uint64_t new_frame = pmm_alloc_frame();
+    uint64_t new_frame = pmm_alloc_zeroed_frame();
     if (!new_frame) return 0;
-    /* zero table */
-    void *ptr = PHYS_TO_VIRT(new_frame);
-    memset(ptr, 0, 4096);
-    *entry = (new_frame & ~0xFFFULL) | VMM_PTE_P | VMM_PTE_W;
+    *entry = (new_frame & VMM_ADDR_MASK) | VMM_PTE_P | VMM_PTE_W;
     return new_frame;
 }
 
-int vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags)
+/* Upper-half PML4 entries are shared by every space, so a new one is copied
+ * into all of them */
+static uint64_t ensure_pml4e(struct vmm_space *as, uint64_t virt)
 {
-    if (!pml4_phys) return -1;
-    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(pml4_phys);
+    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(as->pml4_phys);
+    int i = idx_pml4(virt);
+    if (virt < VMM_KERNEL_BASE || (pml4[i] & VMM_PTE_P)) return ensure_table(&pml4[i], virt, 0);
 
-    int i4 = idx_pml4(virt);
-    int i3 = idx_pdpt(virt);
-    int i2 = idx_pd(virt);
-    int i1 = idx_pt(virt);
+    spin_lock(&vmm_space_lock);
+    uint64_t table = ensure_table(&pml4[i], virt, 0);
+    if (table) {
+        for (struct vmm_space *s = vmm_spaces; s; s = s->next)
+            ((uint64_t*)PHYS_TO_VIRT(s->pml4_phys))[i] = pml4[i];
+    }
+    spin_unlock(&vmm_space_lock);
+    return table;
+}
 
-    uint64_t pdpt_phys = ensure_table(&pml4[i4]);
-    if (!pdpt_phys) return -1;
-    uint64_t *pdpt = (uint64_t*)PHYS_TO_VIRT(pdpt_phys);
+/* Flush a batch of changes to `as`. Lower-half changes also bump its
+ * generation: CPUs holding it under a PCID without having it loaded get no
+ * IPI, and flush when they load it next instead. */
+static void space_flush(struct vmm_space *as, struct tlb_batch *b, uint64_t virt)
+{
+    if (virt < VMM_KERNEL_BASE && (b->all || b->count))
+        __atomic_add_fetch(&as->tlb_gen, 1, __ATOMIC_SEQ_CST);
+    tlb_batch_flush(b, as->pml4_phys);
+}
 
-    uint64_t pd_phys = ensure_table(&pdpt[i3]);
-    if (!pd_phys) return -1;
-    uint64_t *pd = (uint64_t*)PHYS_TO_VIRT(pd_phys);
+/* Can a leaf of `size` bytes map virt -> phys with `left` bytes still to go? */
+static inline int leaf_fits(uint64_t virt, uint64_t phys, uint64_t left, uint64_t size)
+{
+    return !((virt | phys) & (size - 1)) && left >= size;
+}
 
-    uint64_t pt_phys = ensure_table(&pd[i2]);
-    if (!pt_phys) return -1;
-    uint64_t *pt = (uint64_t*)PHYS_TO_VIRT(pt_phys);
+/* A large leaf may only replace an empty entry or another leaf: an existing
+ * table may hold mappings outside the range, so we descend into it instead */
+static inline int leaf_replaces(uint64_t entry)
+{
+    return !(entry & VMM_PTE_P) || (entry & VMM_PTE_PS);
+}
+
+/* Leaves removed by an unmap whose frames go back to the PMM. They are only
+ * freed after the TLB flush, so no stale translation can reach a reused frame. */
+#define VMM_GATHER_BATCH 64
 
-    /* set final PTE */
-    pt[i1] = (phys & ~0xFFFULL) | (flags & 0xFFFULL) | VMM_PTE_P;
-    __asm__ volatile ("invlpg (%0)" :: "r" ((void*)virt));
-    return 0;
+struct vmm_gather {
+    struct tlb_batch fl;
+    struct vmm_space *as;
+    uint64_t virt;
+    int free;
+    uint32_t count;
+    uint64_t phys[VMM_GATHER_BATCH];
+    uint64_t size[VMM_GATHER_BATCH];
+};
+
+static void gather_run(struct vmm_gather *g)
+{
+    space_flush(g->as, &g->fl, g->virt);
+    for (uint32_t i = 0; i < g->count; ++i) {
+        if (g->size[i] == VMM_PAGE_4K) pmm_free_frame(g->phys[i]);
+        else if (g->size[i] == VMM_PAGE_2M) pmm_free_pages(g->phys[i], 9);
+        else pmm_free_contig(g->phys[i], g->size[i] / VMM_PAGE_4K);
+    }
+    g->count = 0;
 }
 
-int vmm_unmap_page(uint64_t virt)
+static void gather_leaf(struct vmm_gather *g, uint64_t virt, uint64_t entry, uint64_t size)
 {
-    if (!pml4_phys) return -1;
-    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(pml4_phys);
+    tlb_batch_add(&g->fl, virt);
+    if (!g->free) return;
+    if (g->count == VMM_GATHER_BATCH) gather_run(g);
+    g->phys[g->count] = entry & VMM_ADDR_MASK & ~(size - 1);
+    g->size[g->count] = size;
+    g->count++;
+}
 
-    int i4 = idx_pml4(virt);
-    int i3 = idx_pdpt(virt);
-    int i2 = idx_pd(virt);
-    int i1 = idx_pt(virt);
+/* Offset from `virt` to the end of the `size`-aligned span holding virt + off,
+ * capped at len. Loops work on offsets so a range may end at the top of the
+ * address space. */
+static inline uint64_t span_off(uint64_t virt, uint64_t off, uint64_t size, uint64_t len)
+{
+    uint64_t end = (((virt + off) | (size - 1)) - virt) + 1;
+    return end < len ? end : len;
+}
 
-    if (!(pml4[i4] & VMM_PTE_P)) return -1;
-    uint64_t pdpt_phys = pml4[i4] & ~0xFFFULL;
-    uint64_t *pdpt = (uint64_t*)PHYS_TO_VIRT(pdpt_phys);
+static inline uint64_t *table_virt(uint64_t entry)
+{
+    return (uint64_t*)PHYS_TO_VIRT(entry & VMM_ADDR_MASK);
+}
 
-    if (!(pdpt[i3] & VMM_PTE_P)) return -1;
-    uint64_t pd_phys = pdpt[i3] & ~0xFFFULL;
-    uint64_t *pd = (uint64_t*)PHYS_TO_VIRT(pd_phys);
+/* One descent per table: each level loops over the entries the range covers
+ * in the table below it, rather than walking from the PML4 for every page */
+int vmm_space_map(struct vmm_space *as, uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags)
+{
+    if (!as || !as->pml4_phys) return -1;
+    if ((virt | phys) & (VMM_PAGE_4K - 1)) return -1;
+    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(as->pml4_phys);
+    uint64_t attr = (flags & (0xFFFULL | VMM_PTE_NX) & ~VMM_PTE_PS) | VMM_PTE_P;
+    len = ALIGN_UP(len, VMM_PAGE_4K);
 
-    if (!(pd[i2] & VMM_PTE_P)) return -1;
-    uint64_t pt_phys = pd[i2] & ~0xFFFULL;
-    uint64_t *pt = (uint64_t*)PHYS_TO_VIRT(pt_phys);
+    struct tlb_batch fl;
+    tlb_batch_init(&fl);
+    int ret = 0;
+    uint64_t off = 0;
+
+    while (off < len && ret == 0) {
+        uint64_t *e4 = &pml4[idx_pml4(virt + off)];
+        if (!ensure_pml4e(as, virt + off)) { ret = -1; break; }
+        uint64_t *pdpt = table_virt(*e4);
+        uint64_t end4 = span_off(virt, off, 1ULL << 39, len);
 
-    pt[i1] = 0;
-    __asm__ volatile ("invlpg (%0)" :: "r" ((void*)virt));
-    return 0;
+        while (off < end4) {
+            uint64_t v = virt + off, p = phys + off;
+            uint64_t *e3 = &pdpt[idx_pdpt(v)];
+            if (vmm_1g_pages && leaf_fits(v, p, end4 - off, VMM_PAGE_1G) && leaf_replaces(*e3)) {
+                *e3 = p | attr | VMM_PTE_PS;
+                tlb_batch_add(&fl, v);
+                off += VMM_PAGE_1G;
+                continue;
+            }
+            if (!ensure_table(e3, v, VMM_PAGE_1G)) { ret = -1; break; }
+            uint64_t *pd = table_virt(*e3);
+            uint64_t end3 = span_off(virt, off, VMM_PAGE_1G, len);
+
+            while (off < end3) {
+                v = virt + off;
+                p = phys + off;
+                uint64_t *e2 = &pd[idx_pd(v)];
+                if (leaf_fits(v, p, end3 - off, VMM_PAGE_2M) && leaf_replaces(*e2)) {
+                    *e2 = p | attr | VMM_PTE_PS;
+                    tlb_batch_add(&fl, v);
+                    off += VMM_PAGE_2M;
+                    continue;
+                }
+                if (!ensure_table(e2, v, VMM_PAGE_2M)) { ret = -1; break; }
+                uint64_t *pt = table_virt(*e2);
+                uint64_t end2 = span_off(virt, off, VMM_PAGE_2M, len);
+
+                for (; off < end2; off += VMM_PAGE_4K) {
+                    pt[idx_pt(virt + off)] = (phys + off) | attr;
+                    tlb_batch_add(&fl, virt + off);
+                }
+            }
+            if (ret) break;
+        }
+    }
+    space_flush(as, &fl, virt);
+    return ret;
+}
+
+int vmm_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags)
+{
+    return vmm_space_map(vmm_space_current(), virt, phys, len, flags);
+}
+
+static int unmap_range(uint64_t virt, uint64_t len, struct vmm_gather *g)
+{
+    if (!g->as || !g->as->pml4_phys) return -1;
+    if (virt & (VMM_PAGE_4K - 1)) return -1;
+    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(g->as->pml4_phys);
+    len = ALIGN_UP(len, VMM_PAGE_4K);
+    int ret = 0;
+    uint64_t off = 0;
+
+    while (off < len && ret == 0) {
+        uint64_t *e4 = &pml4[idx_pml4(virt + off)];
+        uint64_t end4 = span_off(virt, off, 1ULL << 39, len);
+        if (!(*e4 & VMM_PTE_P)) { off = end4; continue; }
+        uint64_t *pdpt = table_virt(*e4);
+
+        while (off < end4) {
+            uint64_t v = virt + off;
+            uint64_t *e3 = &pdpt[idx_pdpt(v)];
+            uint64_t end3 = span_off(virt, off, VMM_PAGE_1G, len);
+            if (!(*e3 & VMM_PTE_P)) { off = end3; continue; }
+            if ((*e3 & VMM_PTE_PS) && leaf_fits(v, 0, end4 - off, VMM_PAGE_1G)) {
+                uint64_t old = *e3;
+                *e3 = 0;
+                gather_leaf(g, v, old, VMM_PAGE_1G);
+                off += VMM_PAGE_1G;
+                continue;
+            }
+            if (!ensure_table(e3, v, VMM_PAGE_1G)) { ret = -1; break; }
+            uint64_t *pd = table_virt(*e3);
+
+            while (off < end3) {
+                v = virt + off;
+                uint64_t *e2 = &pd[idx_pd(v)];
+                uint64_t end2 = span_off(virt, off, VMM_PAGE_2M, len);
+                if (!(*e2 & VMM_PTE_P)) { off = end2; continue; }
+                if ((*e2 & VMM_PTE_PS) && leaf_fits(v, 0, end3 - off, VMM_PAGE_2M)) {
+                    uint64_t old = *e2;
+                    *e2 = 0;
+                    gather_leaf(g, v, old, VMM_PAGE_2M);
+                    off += VMM_PAGE_2M;
+                    continue;
+                }
+                if (!ensure_table(e2, v, VMM_PAGE_2M)) { ret = -1; break; }
+                uint64_t *pt = table_virt(*e2);
+
+                for (; off < end2; off += VMM_PAGE_4K) {
+                    uint64_t *e1 = &pt[idx_pt(virt + off)];
+                    if (!(*e1 & VMM_PTE_P)) continue;
+                    uint64_t old = *e1;
+                    *e1 = 0;
+                    gather_leaf(g, virt + off, old, VMM_PAGE_4K);
+                }
+            }
+            if (ret) break;
+        }
+    }
+    gather_run(g);
+    return ret;
+}
+
+int vmm_space_unmap(struct vmm_space *as, uint64_t virt, uint64_t len, int free_frames)
+{
+    struct vmm_gather g;
+    tlb_batch_init(&g.fl);
+    g.as = as;
+    g.virt = virt;
+    g.free = free_frames;
+    g.count = 0;
+    return unmap_range(virt, len, &g);
+}
+
+int vmm_unmap_range(uint64_t virt, uint64_t len)
+{
+    return vmm_space_unmap(vmm_space_current(), virt, len, 0);
+}
+
+int vmm_unmap_range_free(uint64_t virt, uint64_t len)
+{
+    return vmm_space_unmap(vmm_space_current(), virt, len, 1);
+}
+
+int vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    return vmm_map_range(virt, phys & VMM_ADDR_MASK, VMM_PAGE_4K, flags);
+}
+
+int vmm_unmap_page(uint64_t virt)
+{
+    return vmm_unmap_range(virt & ~(VMM_PAGE_4K - 1), VMM_PAGE_4K);
 }
 
 uint64_t vmm_translate(uint64_t virt)
 {
-    if (!pml4_phys) return 0;
-    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(pml4_phys);
+    uint64_t root = vmm_space_current()->pml4_phys;
+    if (!root) return 0;
+    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(root);
 
     int i4 = idx_pml4(virt);
     int i3 = idx_pdpt(virt);
@@ -147,3 +402,90 @@ uint64_t vmm_map_alloc_page(uint64_t virt, uint64_t flags)
     }
     return phys;
 }
+
+struct vmm_space *vmm_space_create(void)
+{
+    if (!kernel_space.pml4_phys) return NULL;
+    struct vmm_space *as = (struct vmm_space*)kmalloc(sizeof(*as));
+    if (!as) return NULL;
+    uint64_t pml4 = pmm_alloc_zeroed_frame();
+    if (!pml4) {
+        kfree(as);
+        return NULL;
+    }
+    as->pml4_phys = pml4;
+    as->tlb_gen = 0;
+
+    uint64_t *dst = (uint64_t*)PHYS_TO_VIRT(pml4);
+    const uint64_t *src = (const uint64_t*)PHYS_TO_VIRT(kernel_space.pml4_phys);
+    spin_lock(&vmm_space_lock);
+    as->id = vmm_space_next_id++;
+    memcpy(&dst[256], &src[256], 256 * sizeof(uint64_t));
+    as->next = vmm_spaces;
+    vmm_spaces = as;
+    spin_unlock(&vmm_space_lock);
+    return as;
+}
+
+/* Free a PDPT (level 3), PD or PT and every table below it */
+static void free_tables(uint64_t table, int level)
+{
+    uint64_t *t = (uint64_t*)PHYS_TO_VIRT(table);
+    if (level > 1) {
+        for (int i = 0; i < 512; ++i) {
+            if ((t[i] & VMM_PTE_P) && !(t[i] & VMM_PTE_PS)) free_tables(t[i] & VMM_ADDR_MASK, level - 1);
+        }
+    }
+    pmm_free_frame(table);
+}
+
+void vmm_space_destroy(struct vmm_space *as)
+{
+    if (!as || as == &kernel_space) return;
+
+    spin_lock(&vmm_space_lock);
+    for (struct vmm_space **pp = &vmm_spaces; *pp; pp = &(*pp)->next) {
+        if (*pp == as) { *pp = as->next; break; }
+    }
+    spin_unlock(&vmm_space_lock);
+
+    /* Its id is never handed out again, so whatever PCID still tags its
+     * entries on some CPU is flushed before that PCID is reused */
+    uint64_t *pml4 = (uint64_t*)PHYS_TO_VIRT(as->pml4_phys);
+    for (int i = 0; i < 256; ++i) {
+        if (pml4[i] & VMM_PTE_P) free_tables(pml4[i] & VMM_ADDR_MASK, 3);
+    }
+    pmm_free_frame(as->pml4_phys);
+    kfree(as);
+}
+
+void vmm_space_switch(struct vmm_space *as)
+{
+    if (!as || !as->pml4_phys) return;
+    uint32_t cpu = smp_cpu_index();
+    tlb_switch(as->pml4_phys, as->id, &as->tlb_gen);
+    if (cpu < MAX_CPUS) vmm_cur[cpu] = as;
+}
+
+#ifdef ENABLE_BENCH
+/* Map and unmap 8MiB of 4KiB pages (the physical side is offset by a page so
+ * no large leaf fits) at an unused address, page by page and as one range */
+void vmm_bench(void)
+{
+    const uint64_t va = 0xFFFFC00000000000ULL, pa = 0x1000, len = 8ULL << 20;
+
+    uint64_t t0 = bench_rdtsc();
+    for (uint64_t off = 0; off < len; off += VMM_PAGE_4K) vmm_map_page(va + off, pa + off, VMM_PTE_W);
+    uint64_t t1 = bench_rdtsc();
+    for (uint64_t off = 0; off < len; off += VMM_PAGE_4K) vmm_unmap_page(va + off);
+    uint64_t t2 = bench_rdtsc();
+    vmm_map_range(va, pa, len, VMM_PTE_W);
+    uint64_t t3 = bench_rdtsc();
+    vmm_unmap_range(va, len);
+    uint64_t t4 = bench_rdtsc();
+
+    kprintf(LOG_INFO "vmm bench: 8MiB of 4KiB pages: per page map %llu cyc, unmap %llu cyc; range map %llu cyc, unmap %llu cyc\n",
+            (unsigned long long)(t1 - t0), (unsigned long long)(t2 - t1),
+            (unsigned long long)(t3 - t2), (unsigned long long)(t4 - t3));
+}
+#endif